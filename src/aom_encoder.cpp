@@ -0,0 +1,259 @@
+#include "encoder.hpp"
+#include "util.hpp"
+
+#ifdef LVSC_AOM
+#include <algorithm>
+#include <cstdlib>
+#include <aom/aom_encoder.h>
+#include <aom/aomcx.h>
+#endif
+
+using namespace std;
+
+#ifdef LVSC_AOM
+
+// AV1 info
+static const int AV1_FOURCC = 0x31305641;
+
+// libaom's cpu-used goes from 0, the slowest, to 9.
+static const int MAX_AOM_CPU_USED = 9;
+
+// The first bytes of an AV1CodecConfigurationRecord: the marker bit with version 1, then the
+// profile and level, then the tier, bit depth and subsampling flags that follow them.
+static const uint8_t AV1C_MARKER_VERSION = 0x81;
+static const uint8_t AV1C_420_SUBSAMPLING = 0x0C;
+static const uint8_t AV1C_444_SUBSAMPLING = 0x00;
+// The level for a stream that is not held to one, used if the sequence header cannot be read.
+static const int AV1_LEVEL_MAX = 31;
+
+// Reads the bits of an OBU from the most significant one down.
+struct BitReader
+{
+    const uint8_t *data;
+    size_t size;
+    size_t position;
+
+    unsigned read(int bits)
+    {
+        unsigned value = 0;
+        for (int i = 0; i < bits; ++i, ++position)
+        {
+            unsigned bit = position / 8 < size ? (data[position / 8] >> (7 - position % 8)) & 1 : 0;
+            value = (value << 1) | bit;
+        }
+        return value;
+    }
+};
+
+// Builds the CodecPrivate of an AV1 track in WebM from the sequence header OBU: the profile and
+// level of the first operating point, followed by the OBU itself.
+static vector<uint8_t> av1_codec_private(const uint8_t *obu, size_t size, bool full_chroma)
+{
+    unsigned profile = 0, level = AV1_LEVEL_MAX, tier = 0;
+    BitReader reader = {obu, size, 0};
+    reader.read(1);
+    unsigned type = reader.read(4);
+    bool extension = reader.read(1);
+    bool has_size = reader.read(1);
+    reader.read(1 + (extension ? 8 : 0));
+    if (has_size)
+    {
+        while (reader.read(8) & 0x80)
+        {
+        }
+    }
+    // Only the short form is read, libaom has no timing info unless asked for it.
+    static const unsigned SEQUENCE_HEADER_OBU = 1;
+    if (type == SEQUENCE_HEADER_OBU)
+    {
+        profile = reader.read(3);
+        reader.read(1);
+        bool reduced_still_picture_header = reader.read(1);
+        if (reduced_still_picture_header)
+        {
+            level = reader.read(5);
+        }
+        else if (!reader.read(1))
+        {
+            reader.read(1);
+            reader.read(5);
+            reader.read(12);
+            level = reader.read(5);
+            tier = level > 7 ? reader.read(1) : 0;
+        }
+    }
+    auto subsampling = full_chroma ? AV1C_444_SUBSAMPLING : AV1C_420_SUBSAMPLING;
+    vector<uint8_t> config = {AV1C_MARKER_VERSION, uint8_t(profile << 5 | level), uint8_t(tier << 7 | subsampling), 0};
+    config.insert(config.end(), obu, obu + size);
+    return config;
+}
+
+// Encodes AV1 in software with libaom, tuned for screen content even when lossless. Palette mode and
+// intra block copy code text and flat user interfaces exactly, and far smaller than video tools.
+struct AomEncoder : Encoder
+{
+    aom_codec_ctx_t codec;
+    aom_codec_enc_cfg_t cfg;
+    EncoderOptions options;
+    aom_codec_iter_t iter;
+    // Points at the planes of the frame being encoded, which libaom reads in place.
+    aom_image_t img;
+
+    void check(aom_codec_err_t error, const char *what)
+    {
+        if (error != AOM_CODEC_OK)
+            fatal("Failed to %s on AV1 codec. %s\n", what, aom_codec_error_detail(&codec));
+    }
+
+    void encode(const vpx_image_t *frame, int64_t pts, int64_t duration, bool keyframe) override
+    {
+        const aom_image_t *input = nullptr;
+        if (frame)
+        {
+            aom_img_wrap(&img, options.full_chroma ? AOM_IMG_FMT_I444 : AOM_IMG_FMT_I420, frame->d_w, frame->d_h, 1, frame->planes[0]);
+            for (int plane = 0; plane < 3; ++plane)
+            {
+                img.planes[plane] = frame->planes[plane];
+                img.stride[plane] = frame->stride[plane];
+            }
+            input = &img;
+        }
+        iter = nullptr;
+        if (aom_codec_encode(&codec, input, pts, duration, input && keyframe ? AOM_EFLAG_FORCE_KF : 0) != AOM_CODEC_OK)
+            fatal("Failed to encode frame. %s\n", aom_codec_error_detail(&codec));
+    }
+
+    bool next_packet(EncodedPacket &packet) override
+    {
+        const aom_codec_cx_pkt_t *pkt;
+        while ((pkt = aom_codec_get_cx_data(&codec, &iter)) != NULL)
+        {
+            if (pkt->kind != AOM_CODEC_CX_FRAME_PKT)
+                continue;
+            packet = EncodedPacket{(const uint8_t *)pkt->data.frame.buf, pkt->data.frame.sz, pkt->data.frame.pts,
+                                   int64_t(pkt->data.frame.duration), (pkt->data.frame.flags & AOM_FRAME_IS_KEY) != 0};
+            return true;
+        }
+        return false;
+    }
+
+    bool resize(int width, int height) override
+    {
+        cfg.g_w = width;
+        cfg.g_h = height;
+        // Like libvpx, libaom cannot grow past the size it was started with.
+        if (aom_codec_enc_config_set(&codec, &cfg) != AOM_CODEC_OK)
+        {
+            debug("Reconfiguring failed, restarting the encoder. %s\n", aom_codec_error_detail(&codec));
+            return false;
+        }
+        set_tile_columns();
+        return true;
+    }
+
+    void init_codec()
+    {
+        if (aom_codec_enc_init(&codec, aom_codec_av1_cx(), &cfg, 0))
+            fatal("Failed to initialize encoder with AV1 codec. %s\n", aom_codec_error_detail(&codec));
+
+        check(aom_codec_control(&codec, AV1E_SET_LOSSLESS, options.lossless ? 1 : 0), "set lossless mode");
+        if (!options.lossless)
+        {
+            debug("Encoding lossy AV1 with rate control %d at %u kbit/s and cq-level %d\n", options.rate_control,
+                  cfg.rc_target_bitrate, options.cq_level);
+            if (options.rate_control == VPX_CQ || options.rate_control == VPX_Q)
+                check(aom_codec_control(&codec, AOME_SET_CQ_LEVEL, options.cq_level), "set cq-level");
+        }
+        check(aom_codec_control(&codec, AV1E_SET_TUNE_CONTENT, AOM_CONTENT_SCREEN), "tune for screen content");
+        check(aom_codec_control(&codec, AV1E_SET_ENABLE_PALETTE, 1), "enable palette mode");
+        check(aom_codec_control(&codec, AV1E_SET_ENABLE_INTRABC, 1), "enable intra block copy");
+        check(aom_codec_control(&codec, AOME_SET_CPUUSED, clamp(options.cpu_used, 0, MAX_AOM_CPU_USED)), "set cpu-used");
+        check(aom_codec_control(&codec, AV1E_SET_ROW_MT, options.row_mt ? 1 : 0), "set row-mt");
+        // The colour description goes into the sequence header, so it is set before that is read.
+        check(aom_codec_control(&codec, AV1E_SET_COLOR_PRIMARIES, AOM_CICP_CP_BT_709), "set colour primaries");
+        check(aom_codec_control(&codec, AV1E_SET_TRANSFER_CHARACTERISTICS, AOM_CICP_TC_SRGB), "set transfer");
+        static const aom_matrix_coefficients_t MATRICES[] = {AOM_CICP_MC_BT_601, AOM_CICP_MC_BT_709,
+                                                             AOM_CICP_MC_IDENTITY};
+        check(aom_codec_control(&codec, AV1E_SET_MATRIX_COEFFICIENTS, MATRICES[options.matrix]),
+              "set matrix coefficients");
+        check(aom_codec_control(&codec, AV1E_SET_COLOR_RANGE, options.full_range ? AOM_CR_FULL_RANGE : AOM_CR_STUDIO_RANGE),
+              "set colour range");
+        set_tile_columns();
+
+        aom_fixed_buf_t *header = aom_codec_get_global_headers(&codec);
+        if (!header)
+            fatal("Failed to get the AV1 sequence header. %s\n", aom_codec_error_detail(&codec));
+        codec_private = av1_codec_private((const uint8_t *)header->buf, header->sz, options.full_chroma);
+        free(header->buf);
+        free(header);
+    }
+
+    void set_tile_columns()
+    {
+        auto tile_columns = options.log2_tile_columns(cfg.g_w);
+        debug("Encoding AV1 with %d threads, %d tile columns, row-mt=%d and cpu-used=%d\n",
+              options.threads, 1 << tile_columns, options.row_mt, options.cpu_used);
+        check(aom_codec_control(&codec, AV1E_SET_TILE_COLUMNS, tile_columns), "set tile columns");
+    }
+
+    AomEncoder(int width, int height, const EncoderOptions &options)
+        : Encoder(AV1_FOURCC, "V_AV1"), codec(aom_codec_ctx_t()), options(options), iter(nullptr), img(aom_image_t())
+    {
+        auto usage = options.realtime ? AOM_USAGE_REALTIME : AOM_USAGE_GOOD_QUALITY;
+        if (aom_codec_enc_config_default(aom_codec_av1_cx(), &cfg, usage))
+            fatal("Failed to get default AV1 codec config. %s\n", aom_codec_error_detail(&codec));
+
+        cfg.g_w = width;
+        cfg.g_h = height;
+        // The high profile is the one with 4:4:4.
+        cfg.g_profile = options.full_chroma ? 1 : 0;
+        cfg.g_timebase.num = TIMEBASE_NUMERATOR;
+        cfg.g_timebase.den = TIMEBASE_DENOMINATOR;
+        cfg.g_error_resilient = 0;
+        cfg.g_threads = options.threads;
+        cfg.kf_mode = options.auto_keyframes && options.keyframe_interval > 0 ? AOM_KF_AUTO : AOM_KF_DISABLED;
+        cfg.kf_min_dist = 0;
+        cfg.kf_max_dist = options.keyframe_interval;
+        if (options.realtime)
+            cfg.g_lag_in_frames = 0;
+        if (!options.lossless)
+        {
+            // In the order of vpx_rc_mode.
+            static const aom_rc_mode MODES[] = {AOM_VBR, AOM_CBR, AOM_CQ, AOM_Q};
+            cfg.rc_end_usage = MODES[options.rate_control];
+            if (options.bitrate > 0)
+                cfg.rc_target_bitrate = options.bitrate;
+        }
+        init_codec();
+    }
+
+    ~AomEncoder()
+    {
+        aom_codec_destroy(&codec);
+    }
+};
+
+unique_ptr<Encoder> open_aom_encoder(int width, int height, const EncoderOptions &options)
+{
+    return make_unique<AomEncoder>(width, height, options);
+}
+
+bool aom_available()
+{
+    return true;
+}
+
+#else
+
+unique_ptr<Encoder> open_aom_encoder(int width, int height, const EncoderOptions &options)
+{
+    fatal("lvsc was built without AV1, rebuild it with make AOM=1\n");
+    return nullptr;
+}
+
+bool aom_available()
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,234 @@
+#include <algorithm>
+#include <cstdlib>
+#include <fnmatch.h>
+#include "capture.hpp"
+#include "ppm.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+// The first allocation for a screenshot, enough for its header and first chunk.
+static const size_t MIN_SCREENSHOT_BUFFER = 256 * 1024;
+
+Connection connect(const string &name)
+{
+    auto connection = Connection(virConnectOpen(name.c_str()));
+    if (!connection)
+        fatal("Could not connect to %s\n", name.c_str());
+    return connection;
+}
+
+Domain get_domain(Connection &connection, const string &name)
+{
+    auto domain = Domain(virDomainLookupByName(connection.get(), name.c_str()));
+    if (!domain)
+        fatal("Could not find domain %s\n", name.c_str());
+    if (virDomainIsActive(domain.get()) != 1)
+        fatal("Domain %s must be running\n", name.c_str());
+    return domain;
+}
+
+Stream new_stream(Connection &connection)
+{
+    return Stream(virStreamNew(connection.get(), 0));
+}
+
+vector<string> find_domains(Connection &connection, const vector<string> &patterns)
+{
+    virDomainPtr *domains;
+    auto count = virConnectListAllDomains(connection.get(), &domains, VIR_CONNECT_LIST_DOMAINS_ACTIVE);
+    if (count < 0)
+        fatal("Could not list the domains\n");
+
+    vector<string> names;
+    for (int i = 0; i < count; ++i)
+    {
+        string name = virDomainGetName(domains[i]);
+        if (any_of(patterns.begin(), patterns.end(),
+                   [&](const string &pattern) { return fnmatch(pattern.c_str(), name.c_str(), 0) == 0; }))
+            names.push_back(name);
+        virDomainFree(domains[i]);
+    }
+    free(domains);
+    return names;
+}
+
+// Called when a screenshot fills its buffer after received bytes.
+static void grow_screenshot_buffer(FrameBuffer &buffer, size_t received)
+{
+    PPMHeader header;
+    size_t wanted = max(buffer.size() * 2, MIN_SCREENSHOT_BUFFER);
+    if (parse_ppm_header(buffer.data(), received, header) && header.frame_size() >= received)
+        wanted = header.frame_size() + 1;
+    debug("Growing screenshot buffer to %zu bytes\n", wanted);
+    buffer.resize(wanted);
+}
+
+ssize_t take_screenshot(Domain &domain, Stream &stream, FrameBuffer &buffer, size_t &last_size)
+{
+    TRACE_SCOPE(screenshot);
+    auto mimetype = virDomainScreenshot(domain.get(), stream.get(), 0, 0);
+    if (!mimetype)
+        return -1;
+    free(mimetype);
+
+    if (buffer.size() <= last_size)
+        buffer.resize(last_size + 1);
+    size_t received = 0;
+    while (true)
+    {
+        if (received == buffer.size())
+            grow_screenshot_buffer(buffer, received);
+
+        auto res = virStreamRecv(stream.get(), (char *)buffer.data() + received, buffer.size() - received);
+        if (res < 0)
+        {
+            virStreamAbort(stream.get());
+            return -1;
+        }
+        else if (res == 0)
+        {
+            virStreamFinish(stream.get());
+            last_size = received;
+            return received;
+        }
+        received += res;
+    }
+}
+
+EventLoop::EventLoop() : running(true)
+{
+    if (virEventRegisterDefaultImpl() < 0)
+        fatal("Could not start the libvirt event loop\n");
+    timer = virEventAddTimeout(100, [](int timer, void *opaque) {}, nullptr, nullptr);
+    thread = std::thread([this]() {
+        while (running)
+        {
+            if (virEventRunDefaultImpl() < 0)
+                fatal("The libvirt event loop failed\n");
+        }
+    });
+}
+
+EventLoop::~EventLoop()
+{
+    running = false;
+    thread.join();
+    virEventRemoveTimeout(timer);
+}
+
+// libvirt takes every event callback as the generic type and calls it with the arguments of the
+// event, the cast through a function without arguments says this is on purpose.
+template <typename F>
+static virConnectDomainEventGenericCallback generic_callback(F callback)
+{
+    return (virConnectDomainEventGenericCallback)(void (*)())callback;
+}
+
+static void lifecycle_event(virConnectPtr connection, virDomainPtr domain, int event, int detail, void *opaque)
+{
+    auto watch = (DomainWatch *)opaque;
+    if (event == VIR_DOMAIN_EVENT_CRASHED ||
+        (event == VIR_DOMAIN_EVENT_STOPPED && detail == VIR_DOMAIN_EVENT_STOPPED_CRASHED))
+        watch->failed(watch->context, "crashed");
+}
+
+static void watchdog_event(virConnectPtr connection, virDomainPtr domain, int action, void *opaque)
+{
+    auto watch = (DomainWatch *)opaque;
+    watch->failed(watch->context, "set off its watchdog");
+}
+
+static void reboot_event(virConnectPtr connection, virDomainPtr domain, void *opaque)
+{
+    auto watch = (DomainWatch *)opaque;
+    watch->failed(watch->context, "rebooted");
+}
+
+DomainWatch::DomainWatch(Connection &connection, Domain &domain, void (*failed)(void *, const char *), void *context)
+    : connection(connection.get()), failed(failed), context(context)
+{
+    static const struct
+    {
+        int id;
+        virConnectDomainEventGenericCallback callback;
+    } EVENTS[] = {{VIR_DOMAIN_EVENT_ID_LIFECYCLE, generic_callback(lifecycle_event)},
+                  {VIR_DOMAIN_EVENT_ID_WATCHDOG, generic_callback(watchdog_event)},
+                  {VIR_DOMAIN_EVENT_ID_REBOOT, generic_callback(reboot_event)}};
+
+    for (auto &event : EVENTS)
+    {
+        int id = virConnectDomainEventRegisterAny(this->connection, domain.get(), event.id, event.callback, this, nullptr);
+        if (id < 0)
+            fatal("Could not watch %s for events\n", virDomainGetName(domain.get()));
+        callbacks.push_back(id);
+    }
+}
+
+DomainWatch::~DomainWatch()
+{
+    for (auto id : callbacks)
+        virConnectDomainEventDeregisterAny(connection, id);
+}
+
+// Receives whatever the stream has ready without blocking.
+static void receive_screenshot(virStreamPtr stream, int events, void *opaque)
+{
+    auto request = (PendingScreenshot *)opaque;
+    auto &buffer = *request->buffer;
+    while (true)
+    {
+        if (request->received == buffer.size())
+            grow_screenshot_buffer(buffer, request->received);
+
+        auto res = virStreamRecv(stream, (char *)buffer.data() + request->received, buffer.size() - request->received);
+        if (res == -2)
+            return;
+        if (res > 0)
+        {
+            request->received += res;
+            continue;
+        }
+
+        // The stream itself is freed by the next request, not from inside its own callback.
+        virStreamEventRemoveCallback(stream);
+        ssize_t size = -1;
+        if (res == 0)
+        {
+            virStreamFinish(stream);
+            *request->last_size = request->received;
+            size = request->received;
+        }
+        else
+        {
+            virStreamAbort(stream);
+        }
+        request->done(request->context, size);
+        return;
+    }
+}
+
+bool begin_screenshot(Connection &connection, Domain &domain, PendingScreenshot &request)
+{
+    request.stream = Stream(virStreamNew(connection.get(), VIR_STREAM_NONBLOCK));
+    if (!request.stream)
+        return false;
+
+    auto mimetype = virDomainScreenshot(domain.get(), request.stream.get(), 0, 0);
+    if (!mimetype)
+        return false;
+    free(mimetype);
+
+    auto &buffer = *request.buffer;
+    if (buffer.size() <= *request.last_size)
+        buffer.resize(*request.last_size + 1);
+    request.received = 0;
+    auto events = VIR_STREAM_EVENT_READABLE | VIR_STREAM_EVENT_ERROR | VIR_STREAM_EVENT_HANGUP;
+    if (virStreamEventAddCallback(request.stream.get(), events, receive_screenshot, &request, nullptr) < 0)
+    {
+        virStreamAbort(request.stream.get());
+        return false;
+    }
+    return true;
+}
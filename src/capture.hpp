@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include <libvirt/libvirt.h>
+#include "memory.hpp"
+
+// Wrappers for the libvirt pointers. The deleters are stateless so that the wrappers are no bigger
+// than the pointers and making one never allocates.
+struct ConnectionDeleter
+{
+    void operator()(virConnectPtr ptr) const
+    {
+        virConnectClose(ptr);
+    }
+};
+
+struct DomainDeleter
+{
+    void operator()(virDomainPtr ptr) const
+    {
+        virDomainFree(ptr);
+    }
+};
+
+struct StreamDeleter
+{
+    void operator()(virStreamPtr ptr) const
+    {
+        virStreamFree(ptr);
+    }
+};
+
+typedef std::unique_ptr<virConnect, ConnectionDeleter> Connection;
+typedef std::unique_ptr<virDomain, DomainDeleter> Domain;
+typedef std::unique_ptr<virStream, StreamDeleter> Stream;
+
+Connection connect(const std::string &name);
+Domain get_domain(Connection &connection, const std::string &name);
+Stream new_stream(Connection &connection);
+
+// Names of the running domains matching any of the shell style patterns, in libvirt's order.
+std::vector<std::string> find_domains(Connection &connection, const std::vector<std::string> &patterns);
+
+// Receives a screenshot into buffer. When it runs out of room the buffer grows to the size the
+// PPM header announces, plus a byte so the end of the stream can be read, so a buffer is only
+// resized when the guest changes resolution. Fresh buffers start at last_size, which is updated
+// to the size of this screenshot.
+ssize_t take_screenshot(Domain &domain, Stream &stream, FrameBuffer &buffer, size_t &last_size);
+
+// Runs libvirt's default event loop on a thread of its own so that non-blocking streams receive
+// in the background. Must be created before connecting.
+struct EventLoop
+{
+    std::thread thread;
+    std::atomic<bool> running;
+    // Wakes the loop regularly so that it notices when to stop.
+    int timer;
+
+    EventLoop();
+    ~EventLoop();
+
+    EventLoop(const EventLoop &o) = delete;
+};
+
+// Calls failed on the event loop thread, with what happened, whenever the domain crashes, its
+// watchdog fires or it reboots. Needs an EventLoop.
+struct DomainWatch
+{
+    virConnectPtr connection;
+    std::vector<int> callbacks;
+    void (*failed)(void *context, const char *what);
+    void *context;
+
+    // The connection and domain must outlive the watch.
+    DomainWatch(Connection &connection, Domain &domain, void (*failed)(void *, const char *), void *context);
+    ~DomainWatch();
+
+    DomainWatch(const DomainWatch &o) = delete;
+};
+
+// A screenshot being received on the event loop. Once it is complete, or has failed, done is called
+// on the event loop thread with its size or -1.
+struct PendingScreenshot
+{
+    Stream stream;
+    FrameBuffer *buffer;
+    size_t *last_size;
+    size_t received;
+    void (*done)(void *context, ssize_t size);
+    void *context;
+};
+
+// Requests a screenshot over a fresh non-blocking stream and returns once libvirt has accepted the
+// request, leaving the transfer to the event loop, so many screenshots can be in flight at once.
+// Returns false without calling done if the request failed.
+bool begin_screenshot(Connection &connection, Domain &domain, PendingScreenshot &request);
@@ -0,0 +1,10 @@
+#include "container.hpp"
+
+using namespace std;
+
+unique_ptr<ContainerWriter> open_container_writer(Sink *sink, const StreamInfo &info)
+{
+    if (ivf_name(sink->name))
+        return open_ivf_writer(sink, info);
+    return open_webm_writer(sink, info);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "sink.hpp"
+
+// ISO/IEC 23091-4 code points for the colour of a stream. Captured pixels are sRGB, which has the
+// BT.709 primaries whichever matrix they are converted with.
+static const int CICP_PRIMARIES_BT709 = 1;
+static const int CICP_TRANSFER_SRGB = 13;
+static const int CICP_MATRIX_BT709 = 1;
+static const int CICP_MATRIX_BT601 = 6;
+static const int CICP_MATRIX_IDENTITY = 0;
+
+// What a container needs to know about the encoded stream before the first frame is written.
+struct StreamInfo
+{
+    uint32_t fourcc;
+    const char *codec_id;
+    int width;
+    int height;
+    int timebase_num;
+    int timebase_den;
+    // Set up data the decoder needs before the first frame, written to WebM only.
+    std::vector<uint8_t> codec_private;
+    // The colour description as ISO/IEC 23091-4 code points, and whether chroma is subsampled
+    // from the centre of each 2x2 block, written to WebM only.
+    int primaries;
+    int transfer;
+    int matrix_coefficients;
+    bool full_range;
+    bool subsampled;
+};
+
+// Receives encoded frames in presentation order and lays them out in a sink. finish() completes
+// the headers and indexes that depend on the whole stream, if the sink is seekable, and closes the
+// sink. It may only be called once.
+struct ContainerWriter
+{
+    Sink *sink;
+
+    virtual bool write_frame(const uint8_t *data, size_t size, int64_t pts, int64_t duration, bool keyframe) = 0;
+    virtual void finish() = 0;
+
+    // The stream is encoded as info describes from the next keyframe on, after changing size.
+    virtual void resize(const StreamInfo &info) = 0;
+
+    // Stretches the last frame so that it is shown until end_pts, used when frames repeat.
+    virtual void extend(int64_t end_pts)
+    {
+    }
+
+    explicit ContainerWriter(Sink *sink) : sink(sink)
+    {
+    }
+
+    virtual ~ContainerWriter()
+    {
+    }
+};
+
+std::unique_ptr<ContainerWriter> open_ivf_writer(Sink *sink, const StreamInfo &info);
+std::unique_ptr<ContainerWriter> open_webm_writer(Sink *sink, const StreamInfo &info);
+
+// Picks the container from the extension of the sink's name: .ivf is written as IVF and everything
+// else as WebM.
+std::unique_ptr<ContainerWriter> open_container_writer(Sink *sink, const StreamInfo &info);
@@ -0,0 +1,72 @@
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "control.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+// How often the server checks whether it should stop.
+static const int POLL_INTERVAL_MS = 100;
+
+// A client gets this long to send its command, so that one that never does cannot hold up the rest.
+static const int COMMAND_TIMEOUT_MS = 1000;
+
+static const size_t MAX_COMMAND_SIZE = 256;
+
+// Reads up to the end of the first line, or returns false if it does not arrive in time.
+static bool read_command(int client, string &command)
+{
+    char buffer[MAX_COMMAND_SIZE];
+    while (command.size() < MAX_COMMAND_SIZE)
+    {
+        pollfd fd = {client, POLLIN, 0};
+        if (poll(&fd, 1, COMMAND_TIMEOUT_MS) <= 0)
+            return false;
+        auto res = recv(client, buffer, sizeof(buffer), 0);
+        if (res <= 0)
+            return !command.empty();
+        command.append(buffer, res);
+        auto end = command.find('\n');
+        if (end != string::npos)
+        {
+            command.resize(end);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ControlServer::run()
+{
+    while (running)
+    {
+        int client = accept_client(listener, POLL_INTERVAL_MS);
+        if (client < 0)
+            continue;
+        string command;
+        if (read_command(client, command))
+        {
+            auto reply = handle(context, command) + "\n";
+            send(client, reply.data(), reply.size(), MSG_NOSIGNAL);
+        }
+        close(client);
+    }
+}
+
+ControlServer::ControlServer(const string &path, string (*handle)(void *, const string &), void *context)
+    : path(path), listener(-1), running(true), handle(handle), context(context)
+{
+    listener = listen_unix(path);
+    if (listener < 0)
+        fatal("Could not listen for commands on %s\n", path.c_str());
+    thread = std::thread([this]() { run(); });
+}
+
+ControlServer::~ControlServer()
+{
+    running = false;
+    thread.join();
+    close(listener);
+    unlink(path.c_str());
+}
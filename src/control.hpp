@@ -0,0 +1,25 @@
+#pragma once
+
+#include <atomic>
+#include <string>
+#include <thread>
+
+// Takes commands on a Unix socket, on a thread of its own. Each connection sends one line and is
+// answered with the line handle returns for it.
+struct ControlServer
+{
+    std::string path;
+    int listener;
+    std::thread thread;
+    std::atomic<bool> running;
+    std::string (*handle)(void *context, const std::string &command);
+    void *context;
+
+    ControlServer(const std::string &path, std::string (*handle)(void *, const std::string &), void *context);
+    ~ControlServer();
+
+    ControlServer(const ControlServer &o) = delete;
+
+private:
+    void run();
+};
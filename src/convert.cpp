@@ -0,0 +1,1087 @@
+#include <cstring>
+#include <vector>
+#include "convert.hpp"
+#include "util.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS 1
+#endif
+
+#if defined(__aarch64__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+// Kept in int, which the vectoriser handles far better than ssize_t.
+static inline uint8_t clamp_byte(int x)
+{
+    return x < 0 ? 0 : x > 255 ? 255 : x;
+}
+
+// The Y, U and V coefficients of each transform, BT.601 and BT.709 in limited and then full range.
+static constexpr int COLOUR_COEFFICIENTS[4][3][3] = {
+    {{66, 129, 25}, {-38, -74, 112}, {112, -94, -18}},
+    {{47, 157, 16}, {-26, -86, 112}, {112, -102, -10}},
+    {{77, 150, 29}, {-43, -85, 128}, {128, -107, -21}},
+    {{54, 183, 19}, {-29, -99, 128}, {128, -116, -12}},
+};
+
+static constexpr int colour_index(ColourMatrix matrix, bool full_range)
+{
+    return (full_range ? 2 : 0) + (matrix == MATRIX_BT709 ? 1 : 0);
+}
+
+// The coefficients of a transform held in a local, which stays in registers. Read through the
+// transform they would be loaded again after every store into the planes, which might alias them,
+// and loops over them would not vectorise. The packed converters have them as constants, which the
+// vectoriser turns into far cheaper code than multiplies by variables.
+struct Coefficients
+{
+    int y[3];
+    int u[3];
+    int v[3];
+    int luma_offset;
+
+    constexpr explicit Coefficients(int index)
+        : y{COLOUR_COEFFICIENTS[index][0][0], COLOUR_COEFFICIENTS[index][0][1], COLOUR_COEFFICIENTS[index][0][2]},
+          u{COLOUR_COEFFICIENTS[index][1][0], COLOUR_COEFFICIENTS[index][1][1], COLOUR_COEFFICIENTS[index][1][2]},
+          v{COLOUR_COEFFICIENTS[index][2][0], COLOUR_COEFFICIENTS[index][2][1], COLOUR_COEFFICIENTS[index][2][2]},
+          luma_offset(index >= 2 ? 0 : 16)
+    {
+    }
+
+    explicit Coefficients(const ColourTransform &c) : Coefficients(colour_index(c.matrix, c.full_range))
+    {
+    }
+};
+
+// Every kernel uses these exact expressions, including the truncating division, so that all of them
+// produce bit identical planes.
+static inline uint8_t rgb_to_y(const Coefficients &c, int r, int g, int b)
+{
+    return clamp_byte((c.y[0] * r + c.y[1] * g + c.y[2] * b + 128) / 256 + c.luma_offset);
+}
+
+static inline uint8_t rgb_to_u(const Coefficients &c, int r, int g, int b)
+{
+    return clamp_byte((c.u[0] * r + c.u[1] * g + c.u[2] * b + 128) / 256 + 128);
+}
+
+static inline uint8_t rgb_to_v(const Coefficients &c, int r, int g, int b)
+{
+    return clamp_byte((c.v[0] * r + c.v[1] * g + c.v[2] * b + 128) / 256 + 128);
+}
+
+// The same values from the tables. Luma sums are never negative, so the division can be a shift.
+static inline uint8_t table_y(const ColourTransform &c, int r, int g, int b)
+{
+    return (c.y_table[0][r] + c.y_table[1][g] + c.y_table[2][b]) >> 8;
+}
+
+static inline uint8_t table_u(const ColourTransform &c, int r, int g, int b)
+{
+    return clamp_byte((c.u_table[0][r] + c.u_table[1][g] + c.u_table[2][b]) / 256 + 128);
+}
+
+static inline uint8_t table_v(const ColourTransform &c, int r, int g, int b)
+{
+    return clamp_byte((c.v_table[0][r] + c.v_table[1][g] + c.v_table[2][b]) / 256 + 128);
+}
+
+// The rounded average of the four values of a 2x2 block.
+static inline int average4(int a, int b, int c, int d)
+{
+    return (a + b + c + d + 2) >> 2;
+}
+
+static ColourTransform make_colour_transform(ColourMatrix matrix, bool full_range)
+{
+    ColourTransform c = {};
+    c.matrix = matrix;
+    c.full_range = full_range;
+    if (matrix == MATRIX_GBR)
+        return c;
+    const Coefficients coefficients(colour_index(matrix, full_range));
+    for (int ch = 0; ch < 3; ++ch)
+    {
+        c.y[ch] = coefficients.y[ch];
+        c.u[ch] = coefficients.u[ch];
+        c.v[ch] = coefficients.v[ch];
+    }
+    c.luma_offset = coefficients.luma_offset;
+    for (int ch = 0; ch < 3; ++ch)
+    {
+        for (int value = 0; value < 256; ++value)
+        {
+            int bias = ch == 0 ? 128 : 0;
+            c.y_table[ch][value] = c.y[ch] * value + bias + (ch == 0 ? c.luma_offset * 256 : 0);
+            c.u_table[ch][value] = c.u[ch] * value + bias;
+            c.v_table[ch][value] = c.v[ch] * value + bias;
+        }
+    }
+    return c;
+}
+
+const ColourTransform &colour_transform(ColourMatrix matrix, bool full_range)
+{
+    static const ColourTransform TRANSFORMS[2][3] = {
+        {make_colour_transform(MATRIX_BT601, false), make_colour_transform(MATRIX_BT709, false),
+         make_colour_transform(MATRIX_GBR, true)},
+        {make_colour_transform(MATRIX_BT601, true), make_colour_transform(MATRIX_BT709, true),
+         make_colour_transform(MATRIX_GBR, true)},
+    };
+    return TRANSFORMS[full_range][matrix];
+}
+
+void convert_rgb24_to_i420_reference(const uint8_t *src, size_t src_stride, int width, int height,
+                                     uint8_t *const planes[3], const int strides[3], const ColourTransform &transform)
+{
+    const Coefficients colour(transform);
+    for (int y = 0; y < height; ++y)
+    {
+        const uint8_t *row = src + y * src_stride;
+        uint8_t *dest = planes[0] + y * strides[0];
+        for (int x = 0; x < width; ++x)
+        {
+            int o = x * 3;
+            dest[x] = rgb_to_y(colour, row[o], row[o + 1], row[o + 2]);
+        }
+    }
+
+    for (int plane = 1; plane < 3; ++plane)
+    {
+        for (int y = 0; y < height; y += 2)
+        {
+            const uint8_t *top = src + y * src_stride;
+            const uint8_t *bottom = y + 1 < height ? top + src_stride : top;
+            uint8_t *dest = planes[plane] + (y / 2) * strides[plane];
+            for (int x = 0; x < width; x += 2)
+            {
+                int o = x * 3;
+                int p = x + 1 < width ? o + 3 : o;
+                int rgb[3];
+                for (int ch = 0; ch < 3; ++ch)
+                    rgb[ch] = average4(top[o + ch], top[p + ch], bottom[o + ch], bottom[p + ch]);
+                dest[x / 2] = plane == 1 ? rgb_to_u(colour, rgb[0], rgb[1], rgb[2])
+                                         : rgb_to_v(colour, rgb[0], rgb[1], rgb[2]);
+            }
+        }
+    }
+}
+
+// The vector kernels work on a pair of rows at a time, writing both luma rows and the chroma row
+// averaged from them in a single pass. src1 and y1 are null for the last row of an odd height.
+// Whatever is left over at the end of a row is finished by this scalar version, which is also the
+// kernel when the CPU has no supported vector unit.
+typedef void (*RowPairKernel)(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1, uint8_t *u,
+                              uint8_t *v, int start, int width, const ColourTransform &colour);
+
+static void convert_row_pair_scalar(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1,
+                                    uint8_t *u, uint8_t *v, int start, int width, const ColourTransform &colour)
+{
+    const uint8_t *bottom = src1 ? src1 : src0;
+    for (int x = start; x < width; ++x)
+    {
+        int o = x * 3;
+        y0[x] = table_y(colour, src0[o], src0[o + 1], src0[o + 2]);
+        if (src1)
+            y1[x] = table_y(colour, src1[o], src1[o + 1], src1[o + 2]);
+        if ((x & 1) == 0)
+        {
+            int p = x + 1 < width ? o + 3 : o;
+            int r = average4(src0[o], src0[p], bottom[o], bottom[p]);
+            int g = average4(src0[o + 1], src0[p + 1], bottom[o + 1], bottom[p + 1]);
+            int b = average4(src0[o + 2], src0[p + 2], bottom[o + 2], bottom[p + 2]);
+            u[x / 2] = table_u(colour, r, g, b);
+            v[x / 2] = table_v(colour, r, g, b);
+        }
+    }
+}
+
+static void convert_by_row_pairs(RowPairKernel kernel, const uint8_t *src, size_t src_stride, int width,
+                                 int height, uint8_t *const planes[3], const int strides[3],
+                                 const ColourTransform &colour)
+{
+    for (int y = 0; y < height; y += 2)
+    {
+        bool pair = y + 1 < height;
+        const uint8_t *src0 = src + y * src_stride;
+        uint8_t *y0 = planes[0] + y * strides[0];
+        kernel(src0, pair ? src0 + src_stride : nullptr, y0, pair ? y0 + strides[0] : nullptr,
+               planes[1] + (y / 2) * strides[1], planes[2] + (y / 2) * strides[2], 0, width, colour);
+    }
+}
+
+static void convert_scalar(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                           const int strides[3], const ColourTransform &colour)
+{
+    convert_by_row_pairs(convert_row_pair_scalar, src, src_stride, width, height, planes, strides, colour);
+}
+
+// GBR only has to deinterleave each row of RGB 24 bit into the three planes. The vector kernels
+// reuse their shuffles for it and leave what is left at the end of a row to this scalar version.
+typedef void (*RowSplitter)(const uint8_t *src, uint8_t *g, uint8_t *b, uint8_t *r, int start, int width);
+
+static void split_row_scalar(const uint8_t *src, uint8_t *g, uint8_t *b, uint8_t *r, int start, int width)
+{
+    for (int x = start; x < width; ++x)
+    {
+        r[x] = src[x * 3];
+        g[x] = src[x * 3 + 1];
+        b[x] = src[x * 3 + 2];
+    }
+}
+
+static void split_by_rows(RowSplitter splitter, const uint8_t *src, size_t src_stride, int width, int height,
+                          uint8_t *const planes[3], const int strides[3])
+{
+    for (int y = 0; y < height; ++y)
+        splitter(src + y * src_stride, planes[0] + y * strides[0], planes[1] + y * strides[1],
+                 planes[2] + y * strides[2], 0, width);
+}
+
+static void split_scalar(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                         const int strides[3], const ColourTransform &colour)
+{
+    split_by_rows(split_row_scalar, src, src_stride, width, height, planes, strides);
+}
+
+// The packed formats, read one pixel at a time into red, green and blue.
+struct RGB24Pixels
+{
+    static const int SIZE = 3;
+
+    static inline void load(const uint8_t *p, int &r, int &g, int &b)
+    {
+        r = p[0];
+        g = p[1];
+        b = p[2];
+    }
+};
+
+struct BGRX32Pixels
+{
+    static const int SIZE = 4;
+
+    static inline void load(const uint8_t *p, int &r, int &g, int &b)
+    {
+        r = p[2];
+        g = p[1];
+        b = p[0];
+    }
+};
+
+// The top bits of each channel are repeated into the bottom ones, so white stays 255.
+struct RGB565Pixels
+{
+    static const int SIZE = 2;
+
+    static inline void load(const uint8_t *p, int &r, int &g, int &b)
+    {
+        unsigned value = p[0] | p[1] << 8;
+        unsigned r5 = value >> 11, g6 = (value >> 5) & 0x3F, b5 = value & 0x1F;
+        r = r5 << 3 | r5 >> 2;
+        g = g6 << 2 | g6 >> 4;
+        b = b5 << 3 | b5 >> 2;
+    }
+};
+
+// Averages the 2x2 block with columns x and p of row and next.
+template <typename Pixels>
+static inline __attribute__((always_inline)) void average_block(const uint8_t *row, const uint8_t *next, int x, int p,
+                                                                int &r, int &g, int &b)
+{
+    int pr[4], pg[4], pb[4];
+    Pixels::load(row + x * Pixels::SIZE, pr[0], pg[0], pb[0]);
+    Pixels::load(row + p * Pixels::SIZE, pr[1], pg[1], pb[1]);
+    Pixels::load(next + x * Pixels::SIZE, pr[2], pg[2], pb[2]);
+    Pixels::load(next + p * Pixels::SIZE, pr[3], pg[3], pb[3]);
+    r = average4(pr[0], pr[1], pr[2], pr[3]);
+    g = average4(pg[0], pg[1], pg[2], pg[3]);
+    b = average4(pb[0], pb[1], pb[2], pb[3]);
+}
+
+// Converts a row at a time, luma and then chroma, which is taken from every pixel for I444 and
+// averaged over each 2x2 block for I420 like the reference. It is inlined into every version, so
+// one with a constant width gets loops the compiler can unroll and vectorise. COLOUR is the index
+// of the transform's coefficients.
+template <typename Pixels, bool FULL_CHROMA, int COLOUR>
+static inline __attribute__((always_inline)) void convert_packed_rows(const uint8_t *src, size_t src_stride, int width,
+                                                                       int height, uint8_t *const planes[3],
+                                                                       const int strides[3])
+{
+    constexpr Coefficients colour(COLOUR);
+    for (int y = 0; y < height; ++y)
+    {
+        const uint8_t *row = src + y * src_stride;
+        uint8_t *luma = planes[0] + y * strides[0];
+        for (int x = 0; x < width; ++x)
+        {
+            int r, g, b;
+            Pixels::load(row + x * Pixels::SIZE, r, g, b);
+            luma[x] = rgb_to_y(colour, r, g, b);
+        }
+        if (FULL_CHROMA)
+        {
+            uint8_t *u = planes[1] + y * strides[1];
+            uint8_t *v = planes[2] + y * strides[2];
+            for (int x = 0; x < width; ++x)
+            {
+                int r, g, b;
+                Pixels::load(row + x * Pixels::SIZE, r, g, b);
+                u[x] = rgb_to_u(colour, r, g, b);
+                v[x] = rgb_to_v(colour, r, g, b);
+            }
+            continue;
+        }
+        if (y % 2 != 0)
+            continue;
+        const uint8_t *next = y + 1 < height ? row + src_stride : row;
+        uint8_t *u = planes[1] + (y / 2) * strides[1];
+        uint8_t *v = planes[2] + (y / 2) * strides[2];
+        // The last column of an odd width is its own neighbour, which is left out of the main loop
+        // to keep it free of branches.
+        int pairs = width / 2;
+        for (int i = 0; i < pairs; ++i)
+        {
+            int r, g, b;
+            average_block<Pixels>(row, next, 2 * i, 2 * i + 1, r, g, b);
+            u[i] = rgb_to_u(colour, r, g, b);
+            v[i] = rgb_to_v(colour, r, g, b);
+        }
+        if (width % 2 != 0)
+        {
+            int r, g, b;
+            average_block<Pixels>(row, next, width - 1, width - 1, r, g, b);
+            u[pairs] = rgb_to_u(colour, r, g, b);
+            v[pairs] = rgb_to_v(colour, r, g, b);
+        }
+    }
+}
+
+// WIDTH is 0 for the version that takes any width. The transform is built in, so the one passed is
+// not read.
+template <typename Pixels, bool FULL_CHROMA, int COLOUR, int WIDTH>
+static void convert_packed(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                           const int strides[3], const ColourTransform &colour)
+{
+    if (WIDTH > 0 && width == WIDTH)
+        convert_packed_rows<Pixels, FULL_CHROMA, COLOUR>(src, src_stride, WIDTH, height, planes, strides);
+    else
+        convert_packed_rows<Pixels, FULL_CHROMA, COLOUR>(src, src_stride, width, height, planes, strides);
+}
+
+// The display widths that get a version of their own.
+template <int... WIDTHS>
+struct ConverterWidths
+{
+    template <typename Pixels, bool FULL_CHROMA, int COLOUR>
+    static Converter find(int width)
+    {
+        static const int widths[] = {WIDTHS...};
+        static const Converter converters[] = {convert_packed<Pixels, FULL_CHROMA, COLOUR, WIDTHS>...};
+        for (size_t i = 0; i < sizeof...(WIDTHS); ++i)
+        {
+            if (widths[i] == width)
+                return converters[i];
+        }
+        return convert_packed<Pixels, FULL_CHROMA, COLOUR, 0>;
+    }
+};
+
+typedef ConverterWidths<640, 800, 1024, 1280, 1366, 1440, 1600, 1920, 2560, 3840> CommonWidths;
+
+// Finds the version for the transform of colour.
+template <typename Pixels, bool FULL_CHROMA>
+static Converter find_packed(const ColourTransform &colour, int width)
+{
+    static Converter (*const FINDERS[])(int) = {
+        CommonWidths::find<Pixels, FULL_CHROMA, 0>, CommonWidths::find<Pixels, FULL_CHROMA, 1>,
+        CommonWidths::find<Pixels, FULL_CHROMA, 2>, CommonWidths::find<Pixels, FULL_CHROMA, 3>};
+    return FINDERS[colour_index(colour.matrix, colour.full_range)](width);
+}
+
+// Splits the other packed formats into GBR planes.
+template <typename Pixels>
+static void split_packed(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                         const int strides[3], const ColourTransform &colour)
+{
+    for (int y = 0; y < height; ++y)
+    {
+        const uint8_t *row = src + y * src_stride;
+        uint8_t *g = planes[0] + y * strides[0];
+        uint8_t *b = planes[1] + y * strides[1];
+        uint8_t *r = planes[2] + y * strides[2];
+        for (int x = 0; x < width; ++x)
+        {
+            int red, green, blue;
+            Pixels::load(row + x * Pixels::SIZE, red, green, blue);
+            g[x] = green;
+            b[x] = blue;
+            r[x] = red;
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+// pshufb masks gathering the R, G and B bytes of 16 packed pixels out of three 16 byte loads.
+alignas(16) static const int8_t RGB_SHUFFLE[3][3][16] = {
+    {{0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13}},
+    {{1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14}},
+    {{2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1},
+     {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15}},
+};
+
+// SSE2 has no byte shuffle, so the 128 bit kernel needs SSSE3 for pshufb. Every CPU with
+// hardware virtualisation has it.
+__attribute__((target("ssse3"))) static inline void deinterleave_ssse3(const uint8_t *p, __m128i &r, __m128i &g,
+                                                                      __m128i &b)
+{
+    __m128i a = _mm_loadu_si128((const __m128i *)p);
+    __m128i m = _mm_loadu_si128((const __m128i *)(p + 16));
+    __m128i c = _mm_loadu_si128((const __m128i *)(p + 32));
+    __m128i *out[3] = {&r, &g, &b};
+    for (int ch = 0; ch < 3; ++ch)
+    {
+        *out[ch] = _mm_or_si128(
+            _mm_or_si128(_mm_shuffle_epi8(a, _mm_load_si128((const __m128i *)RGB_SHUFFLE[ch][0])),
+                         _mm_shuffle_epi8(m, _mm_load_si128((const __m128i *)RGB_SHUFFLE[ch][1]))),
+            _mm_shuffle_epi8(c, _mm_load_si128((const __m128i *)RGB_SHUFFLE[ch][2])));
+    }
+}
+
+// Y for 8 pixels held as 16 bit lanes. The sum can exceed 32767, so it is kept unsigned.
+__attribute__((target("ssse3"))) static inline __m128i luma_ssse3(__m128i r, __m128i g, __m128i b,
+                                                                 const Coefficients &c)
+{
+    __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(c.y[0])),
+                                              _mm_mullo_epi16(g, _mm_set1_epi16(c.y[1]))),
+                                _mm_add_epi16(_mm_mullo_epi16(b, _mm_set1_epi16(c.y[2])), _mm_set1_epi16(128)));
+    return _mm_add_epi16(_mm_srli_epi16(sum, 8), _mm_set1_epi16(c.luma_offset));
+}
+
+// Two 16 bit coefficients in every 32 bit lane, for pmaddwd against pairs of 16 bit values.
+static inline int coefficient_pair(int first, int second)
+{
+    return int(uint32_t(uint16_t(second)) << 16 | uint16_t(first));
+}
+
+// Signed chroma for 8 pixels, rounding towards zero to match the scalar division. A full range sum
+// reaches 32768, so pmaddwd takes it to 32 bits: red with green, and blue with the rounding bias
+// against ones.
+__attribute__((target("ssse3"))) static inline __m128i chroma_ssse3(__m128i r, __m128i g, __m128i b,
+                                                                   const int coefficients[3])
+{
+    __m128i red_green = _mm_set1_epi32(coefficient_pair(coefficients[0], coefficients[1]));
+    __m128i blue_bias = _mm_set1_epi32(coefficient_pair(coefficients[2], 128));
+    __m128i ones = _mm_set1_epi16(1);
+    __m128i halves[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        __m128i rg = i == 0 ? _mm_unpacklo_epi16(r, g) : _mm_unpackhi_epi16(r, g);
+        __m128i b1 = i == 0 ? _mm_unpacklo_epi16(b, ones) : _mm_unpackhi_epi16(b, ones);
+        __m128i sum = _mm_add_epi32(_mm_madd_epi16(rg, red_green), _mm_madd_epi16(b1, blue_bias));
+        sum = _mm_add_epi32(sum, _mm_and_si128(_mm_srai_epi32(sum, 31), _mm_set1_epi32(255)));
+        halves[i] = _mm_srai_epi32(sum, 8);
+    }
+    return _mm_add_epi16(_mm_packs_epi32(halves[0], halves[1]), _mm_set1_epi16(128));
+}
+
+__attribute__((target("ssse3"))) static inline __m128i luma16_ssse3(__m128i r, __m128i g, __m128i b,
+                                                                   const Coefficients &c)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i lo = luma_ssse3(_mm_unpacklo_epi8(r, zero), _mm_unpacklo_epi8(g, zero), _mm_unpacklo_epi8(b, zero), c);
+    __m128i hi = luma_ssse3(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero), _mm_unpackhi_epi8(b, zero), c);
+    return _mm_packus_epi16(lo, hi);
+}
+
+// Averages the 2x2 blocks of 16 pixels of a row pair into 8 16 bit lanes. pmaddubsw against ones
+// adds each pair of neighbouring bytes.
+__attribute__((target("ssse3"))) static inline __m128i average_ssse3(__m128i top, __m128i bottom)
+{
+    __m128i ones = _mm_set1_epi8(1);
+    __m128i sum = _mm_add_epi16(_mm_maddubs_epi16(top, ones), _mm_maddubs_epi16(bottom, ones));
+    return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+__attribute__((target("ssse3"))) static void convert_row_pair_ssse3(const uint8_t *src0, const uint8_t *src1,
+                                                                   uint8_t *y0, uint8_t *y1, uint8_t *u,
+                                                                   uint8_t *v, int start, int width,
+                                                                   const ColourTransform &colour)
+{
+    const Coefficients coefficients(colour);
+    int x = start;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i r0, g0, b0;
+        deinterleave_ssse3(src0 + x * 3, r0, g0, b0);
+        _mm_storeu_si128((__m128i *)(y0 + x), luma16_ssse3(r0, g0, b0, coefficients));
+        __m128i r1 = r0, g1 = g0, b1 = b0;
+        if (src1)
+        {
+            deinterleave_ssse3(src1 + x * 3, r1, g1, b1);
+            _mm_storeu_si128((__m128i *)(y1 + x), luma16_ssse3(r1, g1, b1, coefficients));
+        }
+
+        __m128i r = average_ssse3(r0, r1);
+        __m128i g = average_ssse3(g0, g1);
+        __m128i b = average_ssse3(b0, b1);
+        __m128i cu = chroma_ssse3(r, g, b, coefficients.u);
+        __m128i cv = chroma_ssse3(r, g, b, coefficients.v);
+        _mm_storel_epi64((__m128i *)(u + x / 2), _mm_packus_epi16(cu, cu));
+        _mm_storel_epi64((__m128i *)(v + x / 2), _mm_packus_epi16(cv, cv));
+    }
+    convert_row_pair_scalar(src0, src1, y0, y1, u, v, x, width, colour);
+}
+
+static void convert_ssse3(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                          const int strides[3], const ColourTransform &colour)
+{
+    convert_by_row_pairs(convert_row_pair_ssse3, src, src_stride, width, height, planes, strides, colour);
+}
+
+__attribute__((target("ssse3"))) static void split_row_ssse3(const uint8_t *src, uint8_t *g, uint8_t *b, uint8_t *r,
+                                                            int start, int width)
+{
+    int x = start;
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i red, green, blue;
+        deinterleave_ssse3(src + x * 3, red, green, blue);
+        _mm_storeu_si128((__m128i *)(g + x), green);
+        _mm_storeu_si128((__m128i *)(b + x), blue);
+        _mm_storeu_si128((__m128i *)(r + x), red);
+    }
+    split_row_scalar(src, g, b, r, x, width);
+}
+
+static void split_ssse3(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                        const int strides[3], const ColourTransform &colour)
+{
+    split_by_rows(split_row_ssse3, src, src_stride, width, height, planes, strides);
+}
+
+// The AVX2 kernel runs the same shuffles on 32 pixels, with each 128 bit lane holding 16 of them.
+__attribute__((target("avx2"))) static inline __m256i load_lanes_avx2(const uint8_t *lo, const uint8_t *hi)
+{
+    return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *)lo)),
+                                   _mm_loadu_si128((const __m128i *)hi), 1);
+}
+
+__attribute__((target("avx2"))) static inline void deinterleave_avx2(const uint8_t *p, __m256i &r, __m256i &g,
+                                                                    __m256i &b)
+{
+    __m256i a = load_lanes_avx2(p, p + 48);
+    __m256i m = load_lanes_avx2(p + 16, p + 64);
+    __m256i c = load_lanes_avx2(p + 32, p + 80);
+    __m256i *out[3] = {&r, &g, &b};
+    for (int ch = 0; ch < 3; ++ch)
+    {
+        __m256i ma = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)RGB_SHUFFLE[ch][0]));
+        __m256i mm = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)RGB_SHUFFLE[ch][1]));
+        __m256i mc = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *)RGB_SHUFFLE[ch][2]));
+        *out[ch] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(a, ma), _mm256_shuffle_epi8(m, mm)),
+                                   _mm256_shuffle_epi8(c, mc));
+    }
+}
+__attribute__((target("avx2"))) static inline __m256i luma_avx2(__m256i r, __m256i g, __m256i b,
+                                                               const Coefficients &c)
+{
+    __m256i sum = _mm256_add_epi16(_mm256_add_epi16(_mm256_mullo_epi16(r, _mm256_set1_epi16(c.y[0])),
+                                                    _mm256_mullo_epi16(g, _mm256_set1_epi16(c.y[1]))),
+                                   _mm256_add_epi16(_mm256_mullo_epi16(b, _mm256_set1_epi16(c.y[2])),
+                                                    _mm256_set1_epi16(128)));
+    return _mm256_add_epi16(_mm256_srli_epi16(sum, 8), _mm256_set1_epi16(c.luma_offset));
+}
+
+// Like chroma_ssse3, the unpacks and the pack all stay within each lane.
+__attribute__((target("avx2"))) static inline __m256i chroma_avx2(__m256i r, __m256i g, __m256i b,
+                                                                 const int coefficients[3])
+{
+    __m256i red_green = _mm256_set1_epi32(coefficient_pair(coefficients[0], coefficients[1]));
+    __m256i blue_bias = _mm256_set1_epi32(coefficient_pair(coefficients[2], 128));
+    __m256i ones = _mm256_set1_epi16(1);
+    __m256i halves[2];
+    for (int i = 0; i < 2; ++i)
+    {
+        __m256i rg = i == 0 ? _mm256_unpacklo_epi16(r, g) : _mm256_unpackhi_epi16(r, g);
+        __m256i b1 = i == 0 ? _mm256_unpacklo_epi16(b, ones) : _mm256_unpackhi_epi16(b, ones);
+        __m256i sum = _mm256_add_epi32(_mm256_madd_epi16(rg, red_green), _mm256_madd_epi16(b1, blue_bias));
+        sum = _mm256_add_epi32(sum, _mm256_and_si256(_mm256_srai_epi32(sum, 31), _mm256_set1_epi32(255)));
+        halves[i] = _mm256_srai_epi32(sum, 8);
+    }
+    return _mm256_add_epi16(_mm256_packs_epi32(halves[0], halves[1]), _mm256_set1_epi16(128));
+}
+
+__attribute__((target("avx2"))) static inline __m256i luma32_avx2(__m256i r, __m256i g, __m256i b,
+                                                                 const Coefficients &c)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i lo = luma_avx2(_mm256_unpacklo_epi8(r, zero), _mm256_unpacklo_epi8(g, zero),
+                           _mm256_unpacklo_epi8(b, zero), c);
+    __m256i hi = luma_avx2(_mm256_unpackhi_epi8(r, zero), _mm256_unpackhi_epi8(g, zero),
+                           _mm256_unpackhi_epi8(b, zero), c);
+    return _mm256_packus_epi16(lo, hi);
+}
+
+// Neighbouring pixels are in the same lane, so the pairs add up like in the SSSE3 kernel.
+__attribute__((target("avx2"))) static inline __m256i average_avx2(__m256i top, __m256i bottom)
+{
+    __m256i ones = _mm256_set1_epi8(1);
+    __m256i sum = _mm256_add_epi16(_mm256_maddubs_epi16(top, ones), _mm256_maddubs_epi16(bottom, ones));
+    return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(2)), 2);
+}
+
+// Packs 16 chroma values and moves the low half of each lane together.
+__attribute__((target("avx2"))) static inline __m128i pack_chroma_avx2(__m256i c)
+{
+    return _mm256_castsi256_si128(_mm256_permute4x64_epi64(_mm256_packus_epi16(c, c), 0x08));
+}
+
+__attribute__((target("avx2"))) static void convert_row_pair_avx2(const uint8_t *src0, const uint8_t *src1,
+                                                                 uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v,
+                                                                 int start, int width, const ColourTransform &colour)
+{
+    const Coefficients coefficients(colour);
+    int x = start;
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i r0, g0, b0;
+        deinterleave_avx2(src0 + x * 3, r0, g0, b0);
+        _mm256_storeu_si256((__m256i *)(y0 + x), luma32_avx2(r0, g0, b0, coefficients));
+        __m256i r1 = r0, g1 = g0, b1 = b0;
+        if (src1)
+        {
+            deinterleave_avx2(src1 + x * 3, r1, g1, b1);
+            _mm256_storeu_si256((__m256i *)(y1 + x), luma32_avx2(r1, g1, b1, coefficients));
+        }
+
+        __m256i r = average_avx2(r0, r1);
+        __m256i g = average_avx2(g0, g1);
+        __m256i b = average_avx2(b0, b1);
+        _mm_storeu_si128((__m128i *)(u + x / 2), pack_chroma_avx2(chroma_avx2(r, g, b, coefficients.u)));
+        _mm_storeu_si128((__m128i *)(v + x / 2), pack_chroma_avx2(chroma_avx2(r, g, b, coefficients.v)));
+    }
+    convert_row_pair_ssse3(src0, src1, y0, y1, u, v, x, width, colour);
+}
+
+static void convert_avx2(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                         const int strides[3], const ColourTransform &colour)
+{
+    convert_by_row_pairs(convert_row_pair_avx2, src, src_stride, width, height, planes, strides, colour);
+}
+
+// The lanes hold pixels 0 to 15 and 16 to 31, so each channel comes out in order.
+__attribute__((target("avx2"))) static void split_row_avx2(const uint8_t *src, uint8_t *g, uint8_t *b, uint8_t *r,
+                                                          int start, int width)
+{
+    int x = start;
+    for (; x + 32 <= width; x += 32)
+    {
+        __m256i red, green, blue;
+        deinterleave_avx2(src + x * 3, red, green, blue);
+        _mm256_storeu_si256((__m256i *)(g + x), green);
+        _mm256_storeu_si256((__m256i *)(b + x), blue);
+        _mm256_storeu_si256((__m256i *)(r + x), red);
+    }
+    split_row_ssse3(src, g, b, r, x, width);
+}
+
+static void split_avx2(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                       const int strides[3], const ColourTransform &colour)
+{
+    split_by_rows(split_row_avx2, src, src_stride, width, height, planes, strides);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static inline uint8x8_t luma_neon(uint8x8_t r, uint8x8_t g, uint8x8_t b, const Coefficients &c)
+{
+    uint16x8_t sum = vmull_u8(r, vdup_n_u8(c.y[0]));
+    sum = vmlal_u8(sum, g, vdup_n_u8(c.y[1]));
+    sum = vmlal_u8(sum, b, vdup_n_u8(c.y[2]));
+    sum = vaddq_u16(sum, vdupq_n_u16(128));
+    return vadd_u8(vshrn_n_u16(sum, 8), vdup_n_u8(c.luma_offset));
+}
+
+// Signed chroma for 4 pixels, with the sum widened to 32 bits as a full range one reaches 32768.
+static inline int16x4_t chroma_half_neon(int16x4_t r, int16x4_t g, int16x4_t b, const int coefficients[3])
+{
+    int32x4_t sum = vmull_n_s16(r, coefficients[0]);
+    sum = vmlal_n_s16(sum, g, coefficients[1]);
+    sum = vmlal_n_s16(sum, b, coefficients[2]);
+    sum = vaddq_s32(sum, vdupq_n_s32(128));
+    sum = vaddq_s32(sum, vandq_s32(vshrq_n_s32(sum, 31), vdupq_n_s32(255)));
+    return vshrn_n_s32(sum, 8);
+}
+
+static inline uint8x8_t chroma_neon(int16x8_t r, int16x8_t g, int16x8_t b, const int coefficients[3])
+{
+    int16x4_t lo = chroma_half_neon(vget_low_s16(r), vget_low_s16(g), vget_low_s16(b), coefficients);
+    int16x4_t hi = chroma_half_neon(vget_high_s16(r), vget_high_s16(g), vget_high_s16(b), coefficients);
+    return vqmovun_s16(vaddq_s16(vcombine_s16(lo, hi), vdupq_n_s16(128)));
+}
+
+static inline uint8x16_t luma16_neon(uint8x16x3_t p, const Coefficients &c)
+{
+    return vcombine_u8(luma_neon(vget_low_u8(p.val[0]), vget_low_u8(p.val[1]), vget_low_u8(p.val[2]), c),
+                       luma_neon(vget_high_u8(p.val[0]), vget_high_u8(p.val[1]), vget_high_u8(p.val[2]), c));
+}
+
+// Adds neighbouring bytes of the top row, then those of the bottom one, and rounds the quarter.
+static inline int16x8_t average_neon(uint8x16_t top, uint8x16_t bottom)
+{
+    return vreinterpretq_s16_u16(vrshrq_n_u16(vpadalq_u8(vpaddlq_u8(top), bottom), 2));
+}
+
+static void convert_row_pair_neon(const uint8_t *src0, const uint8_t *src1, uint8_t *y0, uint8_t *y1, uint8_t *u,
+                                  uint8_t *v, int start, int width, const ColourTransform &colour)
+{
+    const Coefficients coefficients(colour);
+    int x = start;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16x3_t p = vld3q_u8(src0 + x * 3);
+        vst1q_u8(y0 + x, luma16_neon(p, coefficients));
+        uint8x16x3_t q = p;
+        if (src1)
+        {
+            q = vld3q_u8(src1 + x * 3);
+            vst1q_u8(y1 + x, luma16_neon(q, coefficients));
+        }
+
+        int16x8_t r = average_neon(p.val[0], q.val[0]);
+        int16x8_t g = average_neon(p.val[1], q.val[1]);
+        int16x8_t b = average_neon(p.val[2], q.val[2]);
+        vst1_u8(u + x / 2, chroma_neon(r, g, b, coefficients.u));
+        vst1_u8(v + x / 2, chroma_neon(r, g, b, coefficients.v));
+    }
+    convert_row_pair_scalar(src0, src1, y0, y1, u, v, x, width, colour);
+}
+
+static void convert_neon(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                         const int strides[3], const ColourTransform &colour)
+{
+    convert_by_row_pairs(convert_row_pair_neon, src, src_stride, width, height, planes, strides, colour);
+}
+
+static void split_row_neon(const uint8_t *src, uint8_t *g, uint8_t *b, uint8_t *r, int start, int width)
+{
+    int x = start;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16x3_t p = vld3q_u8(src + x * 3);
+        vst1q_u8(g + x, p.val[1]);
+        vst1q_u8(b + x, p.val[2]);
+        vst1q_u8(r + x, p.val[0]);
+    }
+    split_row_scalar(src, g, b, r, x, width);
+}
+
+static void split_neon(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                       const int strides[3], const ColourTransform &colour)
+{
+    split_by_rows(split_row_neon, src, src_stride, width, height, planes, strides);
+}
+#endif
+
+struct ConverterEntry
+{
+    const char *name;
+    Converter convert;
+    Converter split;
+    bool (*supported)();
+};
+
+static bool always_supported()
+{
+    return true;
+}
+
+#ifdef HAVE_X86_KERNELS
+static bool cpu_has_avx2()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static bool cpu_has_ssse3()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("ssse3");
+}
+#endif
+
+// In order of preference for "auto".
+static const ConverterEntry CONVERTERS[] = {
+#ifdef HAVE_X86_KERNELS
+    {"avx2", convert_avx2, split_avx2, cpu_has_avx2},
+    {"ssse3", convert_ssse3, split_ssse3, cpu_has_ssse3},
+#endif
+#ifdef HAVE_NEON_KERNELS
+    {"neon", convert_neon, split_neon, always_supported},
+#endif
+    {"scalar", convert_scalar, split_scalar, always_supported},
+};
+
+static const ConverterEntry *active_converter = nullptr;
+
+bool select_converter(const char *name)
+{
+    bool automatic = strcmp(name, "auto") == 0;
+    for (auto &entry : CONVERTERS)
+    {
+        if ((automatic || strcmp(name, entry.name) == 0) && entry.supported())
+        {
+            debug("Using %s colour conversion\n", entry.name);
+            active_converter = &entry;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char *converter_name()
+{
+    if (!active_converter)
+        select_converter("auto");
+    return active_converter->name;
+}
+
+void convert_rgb24_to_i420(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                           const int strides[3], const ColourTransform &colour)
+{
+    if (!active_converter)
+        select_converter("auto");
+    active_converter->convert(src, src_stride, width, height, planes, strides, colour);
+}
+
+void convert_rgb24_to_gbr(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                          const int strides[3], const ColourTransform &colour)
+{
+    if (!active_converter)
+        select_converter("auto");
+    active_converter->split(src, src_stride, width, height, planes, strides, colour);
+}
+
+// Adds a row of bytes onto 16 bit sums.
+static void accumulate_row(const uint8_t *src, int width, uint16_t *sums)
+{
+    int x = 0;
+#ifdef HAVE_X86_KERNELS
+    // SSE2 is part of x86-64 itself, so this needs no check.
+    const __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= width; x += 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(src + x));
+        __m128i low = _mm_loadu_si128((const __m128i *)(sums + x));
+        __m128i high = _mm_loadu_si128((const __m128i *)(sums + x + 8));
+        _mm_storeu_si128((__m128i *)(sums + x), _mm_add_epi16(low, _mm_unpacklo_epi8(bytes, zero)));
+        _mm_storeu_si128((__m128i *)(sums + x + 8), _mm_add_epi16(high, _mm_unpackhi_epi8(bytes, zero)));
+    }
+#endif
+    for (; x < width; ++x)
+        sums[x] += src[x];
+}
+
+// The largest shift past 16 bits that leaves the rounded up reciprocal of area within 16 bits.
+static constexpr int reciprocal_shift(int area)
+{
+    int shift = 0;
+    while (((1 << (17 + shift)) + area - 1) / area <= 65535)
+        ++shift;
+    return shift;
+}
+
+// Whether multiplying by the reciprocal and shifting divides every rounded sum of a block exactly.
+static constexpr bool reciprocal_is_exact(int area)
+{
+    unsigned reciprocal = ((1 << (16 + reciprocal_shift(area))) + area - 1) / area;
+    for (unsigned total = 0; total <= unsigned(area) * 255 + area / 2; ++total)
+    {
+        if ((total * reciprocal) >> (16 + reciprocal_shift(area)) != total / area)
+            return false;
+    }
+    return true;
+}
+
+// Averages FACTOR rows of source into one row of out_width pixels, by summing the rows column by
+// column and then the columns of each block. Dividing by the area is a multiply with a 16 bit
+// reciprocal and a shift, which every path does the same way. Rounding the reciprocal up to 16 bits
+// alone is not exact, sums of 7x7 blocks can come out one too high, so it is taken with as many
+// extra bits as fit, which is exact for every sum a block can have. sums needs room for 16 values
+// past the row.
+template <int FACTOR>
+static void average_blocks(const uint8_t *src, size_t src_stride, int out_width, uint16_t *sums, uint8_t *dest)
+{
+    const int area = FACTOR * FACTOR;
+    const int shift = reciprocal_shift(area);
+    const unsigned reciprocal = ((1 << (16 + shift)) + area - 1) / area;
+    static_assert(reciprocal_is_exact(FACTOR * FACTOR), "the reciprocal must divide every block sum exactly");
+    int width = out_width * FACTOR * 3;
+    memset(sums, 0, width * sizeof(*sums));
+    for (int row = 0; row < FACTOR; ++row)
+        accumulate_row(src + row * src_stride, width, sums);
+
+    int x = 0;
+#ifdef HAVE_X86_KERNELS
+    // Sum the run of FACTOR pixels starting at each of 16 positions with shifted loads, divide them
+    // all at once and keep the ones that start a block. Sums of at most 64 bytes stay below 2^14,
+    // so adding the rounding bias cannot overflow.
+    const __m128i bias = _mm_set1_epi16(area / 2);
+    const __m128i multiplier = _mm_set1_epi16(reciprocal);
+    alignas(16) uint8_t averages[16];
+    while (x < out_width)
+    {
+        const uint16_t *run = sums + x * FACTOR * 3;
+        __m128i low = _mm_loadu_si128((const __m128i *)run);
+        __m128i high = _mm_loadu_si128((const __m128i *)(run + 8));
+        for (int column = 1; column < FACTOR; ++column)
+        {
+            low = _mm_add_epi16(low, _mm_loadu_si128((const __m128i *)(run + column * 3)));
+            high = _mm_add_epi16(high, _mm_loadu_si128((const __m128i *)(run + column * 3 + 8)));
+        }
+        low = _mm_srli_epi16(_mm_mulhi_epu16(_mm_add_epi16(low, bias), multiplier), shift);
+        high = _mm_srli_epi16(_mm_mulhi_epu16(_mm_add_epi16(high, bias), multiplier), shift);
+        _mm_store_si128((__m128i *)averages, _mm_packus_epi16(low, high));
+        for (int offset = 0; offset + 3 <= 16 && x < out_width; offset += FACTOR * 3, ++x)
+        {
+            dest[x * 3] = averages[offset];
+            dest[x * 3 + 1] = averages[offset + 1];
+            dest[x * 3 + 2] = averages[offset + 2];
+        }
+    }
+#endif
+    for (; x < out_width; ++x)
+    {
+        const uint16_t *block = sums + x * FACTOR * 3;
+        for (int c = 0; c < 3; ++c)
+        {
+            unsigned total = 0;
+            for (int column = 0; column < FACTOR; ++column)
+                total += block[column * 3 + c];
+            dest[x * 3 + c] = ((total + area / 2) * reciprocal) >> (16 + shift);
+        }
+    }
+}
+
+typedef void (*BlockAverager)(const uint8_t *src, size_t src_stride, int out_width, uint16_t *sums, uint8_t *dest);
+
+static const BlockAverager BLOCK_AVERAGERS[MAX_DOWNSCALE + 1] = {
+    nullptr, nullptr, average_blocks<2>, average_blocks<3>, average_blocks<4>,
+    average_blocks<5>, average_blocks<6>, average_blocks<7>, average_blocks<8>,
+};
+
+// Unpacks a row of pixels into RGB 24 bit, for the block averaging.
+template <typename Pixels>
+static void unpack_row(const uint8_t *src, int width, uint8_t *dest)
+{
+    for (int x = 0; x < width; ++x)
+    {
+        int r, g, b;
+        Pixels::load(src + x * Pixels::SIZE, r, g, b);
+        dest[x * 3] = r;
+        dest[x * 3 + 1] = g;
+        dest[x * 3 + 2] = b;
+    }
+}
+
+typedef void (*RowUnpacker)(const uint8_t *src, int width, uint8_t *dest);
+
+int pixel_size(PixelFormat format)
+{
+    static const int SIZES[] = {RGB24Pixels::SIZE, BGRX32Pixels::SIZE, RGB565Pixels::SIZE};
+    return SIZES[format];
+}
+
+Converter find_converter(PixelFormat format, bool full_chroma, const ColourTransform &colour, int width)
+{
+    if (colour.matrix == MATRIX_GBR)
+    {
+        static const Converter SPLITTERS[] = {convert_rgb24_to_gbr, split_packed<BGRX32Pixels>,
+                                              split_packed<RGB565Pixels>};
+        return SPLITTERS[format];
+    }
+    switch (format)
+    {
+    case PIXEL_RGB24:
+        return full_chroma ? find_packed<RGB24Pixels, true>(colour, width) : convert_rgb24_to_i420;
+    case PIXEL_BGRX32:
+        return full_chroma ? find_packed<BGRX32Pixels, true>(colour, width) : find_packed<BGRX32Pixels, false>(colour, width);
+    case PIXEL_RGB565:
+        return full_chroma ? find_packed<RGB565Pixels, true>(colour, width) : find_packed<RGB565Pixels, false>(colour, width);
+    }
+    return nullptr;
+}
+
+void FrameConverter::select(PixelFormat format, bool full_chroma, const ColourTransform &colour, int width, int factor)
+{
+    if (direct && format == this->format && full_chroma == this->full_chroma && &colour == this->colour &&
+        width == this->width && factor == this->factor)
+        return;
+    static const char *const MATRIX_NAMES[] = {"BT.601", "BT.709", "GBR"};
+    debug("Converting %d bytes per pixel to %s in %s %s range, %d pixels wide and shrunk by %d\n", pixel_size(format),
+          full_chroma ? "I444" : "I420", MATRIX_NAMES[colour.matrix], colour.full_range ? "full" : "limited", width,
+          factor);
+    this->format = format;
+    this->full_chroma = full_chroma;
+    this->colour = &colour;
+    this->width = width;
+    this->factor = factor;
+    direct = find_converter(format, full_chroma, colour, width * factor);
+    shrunk = find_converter(PIXEL_RGB24, full_chroma, colour, width);
+}
+
+void FrameConverter::convert(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                             const int strides[3]) const
+{
+    if (factor == 1)
+    {
+        direct(src, src_stride, width, height, planes, strides, *colour);
+        return;
+    }
+
+    // Two averaged rows at a time go straight through the conversion kernel while they are still
+    // in the cache, so the shrunk frame never exists in full. Other formats are unpacked a block
+    // row at a time first.
+    static const RowUnpacker UNPACKERS[] = {nullptr, unpack_row<BGRX32Pixels>, unpack_row<RGB565Pixels>};
+    auto average = BLOCK_AVERAGERS[factor];
+    auto unpack = UNPACKERS[format];
+    int out_width = width / factor;
+    int out_height = height / factor;
+    size_t unpacked_stride = size_t(out_width) * factor * 3;
+    thread_local std::vector<uint8_t> rows;
+    thread_local std::vector<uint16_t> sums;
+    thread_local std::vector<uint8_t> unpacked;
+    rows.resize(out_width * 3 * 2);
+    sums.resize(out_width * factor * 3 + 16);
+    if (unpack)
+        unpacked.resize(unpacked_stride * factor);
+    for (int y = 0; y < out_height; y += 2)
+    {
+        int count = std::min(2, out_height - y);
+        for (int row = 0; row < count; ++row)
+        {
+            const uint8_t *block = src + (y + row) * factor * src_stride;
+            size_t block_stride = src_stride;
+            if (unpack)
+            {
+                for (int line = 0; line < factor; ++line)
+                    unpack(block + line * src_stride, out_width * factor, unpacked.data() + line * unpacked_stride);
+                block = unpacked.data();
+                block_stride = unpacked_stride;
+            }
+            average(block, block_stride, out_width, sums.data(), rows.data() + row * out_width * 3);
+        }
+        uint8_t *dest[3] = {planes[0] + y * strides[0], planes[1] + (full_chroma ? y : y / 2) * strides[1],
+                            planes[2] + (full_chroma ? y : y / 2) * strides[2]};
+        shrunk(rows.data(), out_width * 3, out_width, count, dest, strides, *colour);
+    }
+}
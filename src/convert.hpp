@@ -0,0 +1,123 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The matrices RGB is converted to YUV with. GBR is no conversion at all, the three planes of an
+// I444 image hold green, blue and red as they were captured, in full range.
+enum ColourMatrix
+{
+    MATRIX_BT601,
+    MATRIX_BT709,
+    MATRIX_GBR,
+};
+
+// The integer coefficients of a matrix in limited or full range, scaled by 256, for red, green and
+// blue. The tables hold the products of each coefficient with every byte value, with
+// the rounding bias and luma offset folded into the red ones, for the scalar code to add up. GBR
+// has neither and leaves them at zero.
+struct ColourTransform
+{
+    ColourMatrix matrix;
+    bool full_range;
+    int y[3];
+    int u[3];
+    int v[3];
+    int luma_offset;
+    int32_t y_table[3][256];
+    int32_t u_table[3][256];
+    int32_t v_table[3][256];
+};
+
+// The transform for matrix in full or limited range, built on first use.
+const ColourTransform &colour_transform(ColourMatrix matrix, bool full_range);
+
+// Converts a region of packed pixels, RGB 24 bit unless looked up for another format, into the Y, U
+// and V planes of an I420 or I444 image with colour. I420 chroma is the average of each 2x2 block,
+// with the last column or row repeated when the region is odd sized. The region may be any band or
+// tile of a larger frame as long as it starts on an even row and column of it.
+typedef void (*Converter)(const uint8_t *src, size_t src_stride, int width, int height,
+                          uint8_t *const planes[3], const int strides[3], const ColourTransform &colour);
+
+// A straightforward scalar conversion with separate passes for each plane. It is the reference
+// every kernel must match exactly, which make test checks.
+void convert_rgb24_to_i420_reference(const uint8_t *src, size_t src_stride, int width, int height,
+                                     uint8_t *const planes[3], const int strides[3], const ColourTransform &colour);
+
+// Picks the conversion kernel by name, "auto" chooses the best one the CPU supports. Returns false
+// if the kernel is unknown or not available on this machine.
+bool select_converter(const char *name);
+const char *converter_name();
+
+// Converts using the selected kernel.
+void convert_rgb24_to_i420(const uint8_t *src, size_t src_stride, int width, int height,
+                           uint8_t *const planes[3], const int strides[3], const ColourTransform &colour);
+
+// Splits RGB 24 bit into the G, B and R planes of an I444 image with the selected kernel's shuffle.
+// colour is not read.
+void convert_rgb24_to_gbr(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                          const int strides[3], const ColourTransform &colour);
+
+// How the pixels of a captured frame are packed.
+enum PixelFormat
+{
+    // Red, green and blue bytes, as in PPM screenshots.
+    PIXEL_RGB24,
+    // Blue, green and red bytes and one that is ignored, as framebuffers usually hold them.
+    PIXEL_BGRX32,
+    // 16 bit little endian words with 5 bits of red at the top, then 6 of green and 5 of blue.
+    PIXEL_RGB565,
+};
+
+// Bytes per pixel of format.
+int pixel_size(PixelFormat format);
+
+// Where the pixels of a frame are in its buffer.
+struct FrameLayout
+{
+    int width;
+    int height;
+    size_t offset;
+    size_t stride;
+    PixelFormat format;
+};
+
+// Finds the converter from pixels of format into an I420 image, or an I444 one with full_chroma,
+// with colour. Each is a template specialised on all three, with versions for the widths common for
+// displays that have the width built in and take regions exactly that wide, so that their loops
+// have constant bounds. Packed RGB 24 bit to I420 or GBR goes to the selected kernel. GBR needs
+// full_chroma.
+Converter find_converter(PixelFormat format, bool full_chroma, const ColourTransform &colour, int width);
+
+// The largest factor a FrameConverter shrinks by. The sums of a block stay within 16 bits.
+static const int MAX_DOWNSCALE = 8;
+
+// Converts the frames of a recording, with the converters for their format and size looked up
+// again only when those change.
+struct FrameConverter
+{
+    PixelFormat format;
+    bool full_chroma;
+    const ColourTransform *colour;
+    int width;
+    int factor;
+    // Converts the frame's pixels when it is not shrunk, and otherwise the RGB 24 bit rows averaged
+    // from them.
+    Converter direct;
+    Converter shrunk;
+
+    // Prepares for frames of format shrunk by factor into images width pixels wide.
+    void select(PixelFormat format, bool full_chroma, const ColourTransform &colour, int width, int factor);
+
+    // Converts a region width by height pixels of the frame, which must start on an even row and
+    // column of it, into planes width / factor by height / factor in size. When shrinking, each
+    // factor by factor block is averaged into one pixel and blocks cut short by the right or bottom
+    // edge are left out.
+    void convert(const uint8_t *src, size_t src_stride, int width, int height, uint8_t *const planes[3],
+                 const int strides[3]) const;
+
+    FrameConverter()
+        : format(PIXEL_RGB24), full_chroma(false), colour(nullptr), width(0), factor(0), direct(nullptr), shrunk(nullptr)
+    {
+    }
+};
@@ -0,0 +1,120 @@
+#include <algorithm>
+#include <cstring>
+#include "damage.hpp"
+
+using namespace std;
+
+static const uint64_t HASH_SEED = 0xCBF29CE484222325ULL;
+static const uint64_t HASH_MULTIPLIER = 0x9E3779B97F4A7C15ULL;
+
+// Every step is a bijection of the running hash, so a tile that differs in a single word from its
+// previous contents always hashes differently.
+static inline uint64_t hash_step(uint64_t hash, uint64_t word)
+{
+    hash = (hash ^ word) * HASH_MULTIPLIER;
+    return hash ^ (hash >> 32);
+}
+
+static uint64_t hash_bytes(uint64_t hash, const uint8_t *data, size_t size)
+{
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = hash_step(hash, word);
+    }
+    if (i < size)
+    {
+        uint64_t word = 0;
+        memcpy(&word, data + i, size - i);
+        hash = hash_step(hash, word);
+    }
+    return hash;
+}
+
+bool DamageTracker::resize(int width, int height)
+{
+    if (width == this->width && height == this->height)
+        return false;
+    this->width = width;
+    this->height = height;
+    columns = (width + TILE_WIDTH - 1) / TILE_WIDTH;
+    rows = (height + TILE_HEIGHT - 1) / TILE_HEIGHT;
+    hashes.assign(size_t(columns) * rows, 0);
+    changed_at.assign(size_t(columns) * rows, 0);
+    row_hashes.resize(columns);
+    return true;
+}
+
+size_t DamageTracker::update(const uint8_t *pixels, size_t stride, int pixel_size, int width, int height)
+{
+    ++serial;
+    bool resized = resize(width, height);
+
+    // The frame is read row by row, feeding each row's segments into its tile's running hash.
+    size_t changed = 0;
+    for (int row = 0; row < rows; ++row)
+    {
+        fill(row_hashes.begin(), row_hashes.end(), HASH_SEED);
+        int y_end = min((row + 1) * TILE_HEIGHT, height);
+        for (int y = row * TILE_HEIGHT; y < y_end; ++y)
+        {
+            const uint8_t *line = pixels + y * stride;
+            for (int column = 0; column < columns; ++column)
+            {
+                int x = column * TILE_WIDTH;
+                int w = min(TILE_WIDTH, width - x);
+                row_hashes[column] = hash_bytes(row_hashes[column], line + x * pixel_size, w * pixel_size);
+            }
+        }
+
+        for (int column = 0; column < columns; ++column)
+        {
+            auto tile = row * columns + column;
+            if (resized || hashes[tile] != row_hashes[column])
+            {
+                hashes[tile] = row_hashes[column];
+                changed_at[tile] = serial;
+                ++changed;
+            }
+        }
+    }
+    return changed;
+}
+
+size_t DamageTracker::mark(const vector<DirtyRect> &rects, int x, int y, int width, int height)
+{
+    ++serial;
+    if (resize(width, height))
+    {
+        fill(changed_at.begin(), changed_at.end(), serial);
+        return changed_at.size();
+    }
+
+    size_t changed = 0;
+    for (auto &rect : rects)
+    {
+        int left = max(rect.x - x, 0);
+        int top = max(rect.y - y, 0);
+        int right = min(rect.x - x + rect.width, width);
+        int bottom = min(rect.y - y + rect.height, height);
+        if (left >= right || top >= bottom)
+            continue;
+        for (int row = top / TILE_HEIGHT; row <= (bottom - 1) / TILE_HEIGHT; ++row)
+        {
+            for (int column = left / TILE_WIDTH; column <= (right - 1) / TILE_WIDTH; ++column)
+            {
+                auto tile = row * columns + column;
+                if (changed_at[tile] == serial)
+                    continue;
+                // The hash is forgotten, so that hashing a later frame cannot mistake the tile for
+                // unchanged.
+                hashes[tile] = 0;
+                changed_at[tile] = serial;
+                ++changed;
+            }
+        }
+    }
+    return changed;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A rectangle of a frame, in pixels.
+struct DirtyRect
+{
+    int x;
+    int y;
+    int width;
+    int height;
+};
+
+// Finds the parts of a screenshot that changed since the previous one by hashing it in tiles.
+// Every tile remembers the serial of the frame that last changed it, so a consumer holding an
+// image converted from an older frame can bring it up to date by redoing only those tiles.
+struct DamageTracker
+{
+    // Tiles start on even rows and columns so that they map onto whole I420 chroma samples.
+    static const int TILE_WIDTH = 64;
+    static const int TILE_HEIGHT = 16;
+
+    int width;
+    int height;
+    int columns;
+    int rows;
+    std::vector<uint64_t> hashes;
+    std::vector<uint64_t> changed_at;
+    std::vector<uint64_t> row_hashes;
+    uint64_t serial;
+
+    // Hashes a frame of packed pixels pixel_size bytes each and returns how many tiles differ from
+    // the previous frame. A change of resolution marks every tile as changed.
+    size_t update(const uint8_t *pixels, size_t stride, int pixel_size, int width, int height);
+
+    // Marks the tiles under rectangles that are already known to have changed instead of hashing
+    // the frame, for a capture that reports its own damage. The rectangles are in frame coordinates
+    // and the tracked area starts at x, y. Returns how many tiles they touch.
+    size_t mark(const std::vector<DirtyRect> &rects, int x, int y, int width, int height);
+
+    // Starts over at a new resolution, where every tile counts as changed. Returns false if the
+    // resolution is the same.
+    bool resize(int width, int height);
+
+    // Calls f(x, y, width, height) for each horizontal run of tiles changed after serial since.
+    template <typename F>
+    void for_each_dirty_run(uint64_t since, F f) const
+    {
+        for (int row = 0; row < rows; ++row)
+        {
+            int y = row * TILE_HEIGHT;
+            int h = std::min(TILE_HEIGHT, height - y);
+            for (int column = 0; column < columns;)
+            {
+                if (changed_at[row * columns + column] <= since)
+                {
+                    ++column;
+                    continue;
+                }
+                int first = column;
+                while (column < columns && changed_at[row * columns + column] > since)
+                    ++column;
+                int x = first * TILE_WIDTH;
+                f(x, y, std::min(column * TILE_WIDTH, width) - x, h);
+            }
+        }
+    }
+
+    DamageTracker() : width(0), height(0), columns(0), rows(0), serial(0)
+    {
+    }
+};
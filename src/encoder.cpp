@@ -0,0 +1,217 @@
+#include <algorithm>
+#include <thread>
+#include "encoder.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+int EncoderOptions::log2_tile_columns(int width) const
+{
+    if (tile_columns >= 0)
+        return tile_columns;
+    int log2 = 0;
+    while (log2 < MAX_LOG2_TILE_COLUMNS && (2 << log2) <= threads && (width >> (log2 + 1)) >= MIN_TILE_WIDTH)
+        ++log2;
+    return log2;
+}
+
+bool EncoderOptions::set_rate_control(const string &name)
+{
+    static const struct
+    {
+        const char *name;
+        vpx_rc_mode mode;
+    } MODES[] = {{"vbr", VPX_VBR}, {"cbr", VPX_CBR}, {"cq", VPX_CQ}, {"q", VPX_Q}};
+
+    lossless = name == "lossless";
+    if (lossless)
+        return true;
+    for (auto &mode : MODES)
+    {
+        if (name == mode.name)
+        {
+            rate_control = mode.mode;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool EncoderOptions::set_codec(const string &name)
+{
+    if (name != "vp9" && name != "av1")
+        return false;
+    codec = name;
+    return true;
+}
+
+bool EncoderOptions::set_backend(const string &name)
+{
+    if (name != "vpx" && name != "vaapi")
+        return false;
+    backend = name;
+    return true;
+}
+
+bool EncoderOptions::set_matrix(const string &name)
+{
+    static const struct
+    {
+        const char *name;
+        ColourMatrix matrix;
+    } MATRICES[] = {{"bt601", MATRIX_BT601}, {"bt709", MATRIX_BT709}, {"gbr", MATRIX_GBR}};
+
+    for (auto &entry : MATRICES)
+    {
+        if (name == entry.name)
+        {
+            matrix = entry.matrix;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool EncoderOptions::parse_option(const string &arg, const function<const char *()> &value)
+{
+    const string threads_option = "--threads";
+    const string tile_columns_option = "--tile-columns";
+    const string no_row_mt_option = "--no-row-mt";
+    const string cpu_used_option = "--cpu-used";
+    const string realtime_option = "--realtime";
+    const string rate_control_option = "--rate-control";
+    const string bitrate_option = "--bitrate";
+    const string cq_level_option = "--cq-level";
+    const string codec_option = "--codec";
+    const string chroma_option = "--chroma";
+    const string matrix_option = "--matrix";
+    const string full_range_option = "--full-range";
+    const string encoder_option = "--encoder";
+    const string vaapi_device_option = "--vaapi-device";
+    const string keyframe_interval_option = "--keyframe-interval";
+    const string keyframe_mode_option = "--keyframe-mode";
+
+    if (arg.substr(0, threads_option.size()) == threads_option)
+    {
+        threads = parse_int(threads_option.c_str(), value(), 1, 64);
+        threads_given = true;
+    }
+    else if (arg.substr(0, tile_columns_option.size()) == tile_columns_option)
+    {
+        tile_columns = parse_int(tile_columns_option.c_str(), value(), 0, MAX_LOG2_TILE_COLUMNS);
+    }
+    else if (arg.substr(0, no_row_mt_option.size()) == no_row_mt_option)
+    {
+        row_mt = false;
+    }
+    else if (arg.substr(0, cpu_used_option.size()) == cpu_used_option)
+    {
+        cpu_used = parse_int(cpu_used_option.c_str(), value(), -9, 9);
+        cpu_used_given = true;
+    }
+    else if (arg.substr(0, realtime_option.size()) == realtime_option)
+    {
+        realtime = true;
+    }
+    else if (arg.substr(0, rate_control_option.size()) == rate_control_option)
+    {
+        string mode = value();
+        if (!set_rate_control(mode))
+            fatal("Unknown rate control %s, expected lossless, vbr, cbr, cq or q\n", mode.c_str());
+    }
+    else if (arg.substr(0, bitrate_option.size()) == bitrate_option)
+    {
+        bitrate = parse_int(bitrate_option.c_str(), value(), 1, 1000000);
+    }
+    else if (arg.substr(0, cq_level_option.size()) == cq_level_option)
+    {
+        cq_level = parse_int(cq_level_option.c_str(), value(), 0, MAX_CQ_LEVEL);
+    }
+    else if (arg.substr(0, codec_option.size()) == codec_option)
+    {
+        string name = value();
+        if (!set_codec(name))
+            fatal("Unknown codec %s, expected vp9 or av1\n", name.c_str());
+        if (name == "av1" && !aom_available())
+            fatal("lvsc was built without AV1, rebuild it with make AOM=1\n");
+    }
+    else if (arg.substr(0, chroma_option.size()) == chroma_option)
+    {
+        string chroma = value();
+        if (chroma != "420" && chroma != "444")
+            fatal("Unknown chroma %s, expected 420 or 444\n", chroma.c_str());
+        full_chroma = chroma == "444";
+    }
+    else if (arg.substr(0, matrix_option.size()) == matrix_option)
+    {
+        string name = value();
+        if (!set_matrix(name))
+            fatal("Unknown colour matrix %s, expected bt601, bt709 or gbr\n", name.c_str());
+    }
+    else if (arg.substr(0, full_range_option.size()) == full_range_option)
+    {
+        full_range = true;
+    }
+    else if (arg.substr(0, encoder_option.size()) == encoder_option)
+    {
+        string name = value();
+        if (!set_backend(name))
+            fatal("Unknown encoder %s, expected vpx or vaapi\n", name.c_str());
+        if (name == "vaapi" && !vaapi_available())
+            fatal("lvsc was built without VAAPI, rebuild it with make VAAPI=1\n");
+    }
+    else if (arg.substr(0, vaapi_device_option.size()) == vaapi_device_option)
+    {
+        vaapi_device = value();
+    }
+    else if (arg.substr(0, keyframe_interval_option.size()) == keyframe_interval_option)
+    {
+        keyframe_interval = parse_int(keyframe_interval_option.c_str(), value(), 0, 100000);
+    }
+    else if (arg.substr(0, keyframe_mode_option.size()) == keyframe_mode_option)
+    {
+        string mode = value();
+        if (mode != "auto" && mode != "fixed")
+            fatal("Unknown keyframe mode %s, expected auto or fixed\n", mode.c_str());
+        auto_keyframes = mode == "auto";
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+void EncoderOptions::finalize()
+{
+    if (realtime && !cpu_used_given)
+        cpu_used = 8;
+    if (codec == "av1" && backend == "vaapi")
+        fatal("--encoder vaapi only encodes VP9\n");
+    threads = min(threads, 64);
+    // GBR keeps every pixel as it was captured, so it is always 4:4:4 and full range.
+    if (matrix == MATRIX_GBR)
+        full_chroma = full_range = true;
+}
+
+EncoderOptions::EncoderOptions()
+    : threads(max(1u, thread::hardware_concurrency())), tile_columns(-1), row_mt(true), cpu_used(0), realtime(false),
+      lossless(true), rate_control(VPX_VBR), bitrate(0), cq_level(DEFAULT_CQ_LEVEL),
+      keyframe_interval(DEFAULT_KEYFRAME_INTERVAL), auto_keyframes(true), codec("vp9"), full_chroma(false),
+      matrix(MATRIX_BT601), full_range(false), backend("vpx"), vaapi_device(DEFAULT_VAAPI_DEVICE),
+      threads_given(false), cpu_used_given(false)
+{
+}
+
+unique_ptr<Encoder> open_encoder(int width, int height, const EncoderOptions &options)
+{
+    if (options.codec == "av1")
+        return open_aom_encoder(width, height, options);
+    if (options.backend == "vaapi")
+    {
+        auto encoder = open_vaapi_encoder(width, height, options);
+        if (encoder)
+            return encoder;
+    }
+    return open_vpx_encoder(width, height, options);
+}
@@ -0,0 +1,168 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include <vpx/vpx_encoder.h>
+#include "convert.hpp"
+
+// VP9 info
+static const int VP9_FOURCC = 0x30395056;
+
+// Frames are stamped with their capture time in milliseconds.
+static const int TIMEBASE_NUMERATOR = 1;
+static const int TIMEBASE_DENOMINATOR = 1000;
+
+// Keyframes are at most this many encoded frames apart by default. Unchanged frames are never
+// encoded, so on a mostly static screen they are much further apart in time.
+static const int DEFAULT_KEYFRAME_INTERVAL = 150;
+
+// VP9 splits the frame into at most 64 tile columns that are each at least 256 pixels wide.
+static const int MIN_TILE_WIDTH = 256;
+static const int MAX_LOG2_TILE_COLUMNS = 6;
+
+// The default quality for the cq and q rate control modes, on the 0 to 63 quantizer scale.
+static const int DEFAULT_CQ_LEVEL = 32;
+static const int MAX_CQ_LEVEL = 63;
+
+// The render node VAAPI encodes on unless told otherwise.
+static const char *const DEFAULT_VAAPI_DEVICE = "/dev/dri/renderD128";
+
+// Encoder settings from the command line. A negative tile_columns picks it from the frame width.
+// Keyframes are at most keyframe_interval frames apart, placed by libvpx if auto_keyframes or
+// forced at exactly that interval otherwise, and a keyframe_interval of 0 leaves only the ones that
+// are asked for.
+// Unless lossless, frames are encoded with rate_control at bitrate kbit/s, or with the libvpx
+// default bitrate when it is 0, and tuned for screen content.
+// The codec is "vp9", or "av1" which libaom encodes with its screen content tools.
+// With full_chroma frames are I444 instead of I420, for colour that survives lossless encoding, in
+// VP9 profile 1 or the AV1 high profile.
+// RGB is converted with matrix in limited, or with full_range full, range, which the stream and
+// its container are marked with. MATRIX_GBR needs full_chroma and full_range.
+// The backend is "vpx" for libvpx, or "vaapi" to encode VP9 on the GPU at vaapi_device, which
+// falls back to libvpx when it cannot encode VP9 with these settings.
+// threads_given and cpu_used_given say whether those came from the command line.
+struct EncoderOptions
+{
+    int threads;
+    int tile_columns;
+    bool row_mt;
+    int cpu_used;
+    bool realtime;
+    bool lossless;
+    vpx_rc_mode rate_control;
+    int bitrate;
+    int cq_level;
+    int keyframe_interval;
+    bool auto_keyframes;
+    std::string codec;
+    bool full_chroma;
+    ColourMatrix matrix;
+    bool full_range;
+    std::string backend;
+    std::string vaapi_device;
+    bool threads_given;
+    bool cpu_used_given;
+
+    int log2_tile_columns(int width) const;
+
+    // Takes "lossless", "vbr", "cbr", "cq" or "q". Returns false for anything else.
+    bool set_rate_control(const std::string &name);
+
+    // Takes "vp9" or "av1". Returns false for anything else.
+    bool set_codec(const std::string &name);
+
+    // Takes "vpx" or "vaapi". Returns false for anything else.
+    bool set_backend(const std::string &name);
+
+    // Takes "bt601", "bt709" or "gbr". Returns false for anything else.
+    bool set_matrix(const std::string &name);
+
+    // Applies arg if it is one of the encoder options, calling value for the value it takes.
+    // Exits on a bad value and returns false for any other option.
+    bool parse_option(const std::string &arg, const std::function<const char *()> &value);
+
+    // Settles the options that depend on each other once they have all been parsed, exiting if
+    // they cannot be used together.
+    void finalize();
+
+    const ColourTransform &colour() const
+    {
+        return colour_transform(matrix, full_range);
+    }
+
+    // The layout of the images the encoder takes.
+    vpx_img_fmt_t image_format() const
+    {
+        return full_chroma ? VPX_IMG_FMT_I444 : VPX_IMG_FMT_I420;
+    }
+
+    EncoderOptions();
+};
+
+// A compressed frame. Its data is only valid until the encoder is next used.
+struct EncodedPacket
+{
+    const uint8_t *data;
+    size_t size;
+    int64_t pts;
+    int64_t duration;
+    bool keyframe;
+};
+
+// Compresses I420 or I444 frames for a VideoWriter. Frames go in with encode() and the packets that are
+// ready come out of next_packet() until it returns false, possibly some frames later if the
+// encoder holds frames back for lookahead.
+struct Encoder
+{
+    // What the containers are told the stream is, with the CodecPrivate of the WebM track if the
+    // codec has one.
+    uint32_t fourcc;
+    const char *codec_id;
+    std::vector<uint8_t> codec_private;
+
+    // Encodes img shown from pts for duration, as a keyframe if keyframe, or drains the encoder when
+    // img is null.
+    virtual void encode(const vpx_image_t *img, int64_t pts, int64_t duration, bool keyframe) = 0;
+
+    virtual bool next_packet(EncodedPacket &packet) = 0;
+
+    // Switches to frames of a new size. Returns false if the encoder cannot, in which case it must be
+    // drained and opened again at the new size.
+    virtual bool resize(int width, int height)
+    {
+        return false;
+    }
+
+    Encoder(uint32_t fourcc, const char *codec_id) : fourcc(fourcc), codec_id(codec_id)
+    {
+    }
+
+    virtual ~Encoder()
+    {
+    }
+
+    Encoder(const Encoder &o) = delete;
+};
+
+std::unique_ptr<Encoder> open_vpx_encoder(int width, int height, const EncoderOptions &options);
+
+// Returns null if lvsc was built without VAAPI, with make VAAPI=1, or the device cannot encode
+// VP9 with these options, after saying why.
+std::unique_ptr<Encoder> open_vaapi_encoder(int width, int height, const EncoderOptions &options);
+
+// Encodes AV1 with libaom. Only available when built with make AOM=1.
+std::unique_ptr<Encoder> open_aom_encoder(int width, int height, const EncoderOptions &options);
+
+// Whether lvsc was built with AV1 support, with make AOM=1.
+bool aom_available();
+
+// Whether lvsc was built with VAAPI support, with make VAAPI=1.
+bool vaapi_available();
+
+// Opens an encoder for the codec the options ask for, with their backend for VP9 or libvpx if that
+// is not available.
+std::unique_ptr<Encoder> open_encoder(int width, int height, const EncoderOptions &options);
@@ -0,0 +1,121 @@
+#include "container.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+// The raw IVF stream libvpx's own tools write: a 32 byte file header followed by each frame
+// behind a 12 byte header holding its size and pts. The frame count in the header is only filled in
+// on a seekable sink, where it is brought up to date at every keyframe so that a recording cut
+// short is nearly right; readers of a stream ignore it. Each segment of a segmented sink is a file of
+// its own with pts counted from the keyframe that opens it. After a resize the header takes the new
+// size with the frame count at the next keyframe, which is the one the new size starts on.
+struct IVFWriter : ContainerWriter
+{
+    StreamInfo info;
+    int frames_written;
+    int64_t origin_pts;
+    long written;
+
+    bool write(const void *data, size_t size)
+    {
+        written += size;
+        return sink->write(data, size);
+    }
+
+    void write_file_header()
+    {
+        debug("Writing file header\n");
+        char header[32];
+        header[0] = 'D';
+        header[1] = 'K';
+        header[2] = 'I';
+        header[3] = 'F';
+        mem_put_le16(header + 4, 0);                  // version
+        mem_put_le16(header + 6, 32);                 // header size
+        mem_put_le32(header + 8, info.fourcc);        // fourcc
+        mem_put_le16(header + 12, info.width);        // width
+        mem_put_le16(header + 14, info.height);       // height
+        mem_put_le32(header + 16, info.timebase_den); // rate
+        mem_put_le32(header + 20, info.timebase_num); // scale
+        mem_put_le32(header + 24, frames_written);    // length
+        mem_put_le32(header + 28, 0);                 // unused
+        if (written == 0)
+        {
+            write(header, 32);
+            sink->end_header();
+        }
+        else if (sink->seekable())
+        {
+            sink->patch(0, header, 32);
+        }
+    }
+
+    void write_ivf_frame_header(int64_t pts, uint32_t frame_size)
+    {
+        debug("Writing frame header\n");
+
+        char header[12];
+
+        mem_put_le32(header, (int)frame_size);
+        mem_put_le32(header + 4, (int)(pts & 0xFFFFFFFF));
+        mem_put_le32(header + 8, (int)(pts >> 32));
+        write(header, 12);
+    }
+
+    bool write_frame(const uint8_t *data, size_t size, int64_t pts, int64_t duration, bool keyframe) override
+    {
+        if (keyframe && sink->segment_due())
+        {
+            write_file_header();
+            if (sink->next_segment())
+            {
+                frames_written = 0;
+                written = 0;
+                origin_pts = pts;
+                write_file_header();
+            }
+        }
+        else if (keyframe && frames_written > 0)
+        {
+            write_file_header();
+        }
+        if (keyframe)
+            sink->sync_point();
+        write_ivf_frame_header(pts - origin_pts, size);
+        if (!write(data, size))
+            return false;
+        ++frames_written;
+        sink->flush();
+        return true;
+    }
+
+    void resize(const StreamInfo &info) override
+    {
+        this->info = info;
+    }
+
+    void finish() override
+    {
+        write_file_header();
+        sink->close();
+        sink = nullptr;
+    }
+
+    ~IVFWriter()
+    {
+        if (sink)
+            finish();
+    }
+
+    IVFWriter(Sink *sink, const StreamInfo &info) : ContainerWriter(sink), info(info), frames_written(0), origin_pts(0), written(0)
+    {
+        write_file_header();
+    }
+
+    IVFWriter(const IVFWriter &o) = delete;
+};
+
+unique_ptr<ContainerWriter> open_ivf_writer(Sink *sink, const StreamInfo &info)
+{
+    return make_unique<IVFWriter>(sink, info);
+}
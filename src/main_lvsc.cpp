@@ -3,320 +3,351 @@
 #include <cstdarg>
 #include <cstring>
 #include <unistd.h>
-#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <memory>
 #include <string>
+#include <thread>
+#include <vector>
 #include <libvirt/libvirt.h>
-#include <vpx/vpx_encoder.h>
-#include <vpx/vp8cx.h>
+#include "capture.hpp"
+#include "control.hpp"
+#include "convert.hpp"
+#include "recorder.hpp"
+#include "shutdown.hpp"
+#include "spool.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+#include "util.hpp"
+#include "video_writer.hpp"
 
 using namespace std;
 
-// A flag to store whether we are in the main record it and a signal handler to update it.
-static volatile sig_atomic_t capturing = 1;
+// Set by SIGUSR1 to save what every domain being pre-recorded holds.
+static volatile sig_atomic_t dump_requested = 0;
 
-static void signal_handler(int sig, siginfo_t *si, void *unused)
+static void dump_signal_handler(int sig)
 {
-    capturing = 0;
+    dump_requested = 1;
 }
 
-// Maths and endian routines.
-uint8_t clamp(ssize_t x)
+// Answers "dump" by saving every domain being pre-recorded, or "dump <domain>" by saving that one.
+static string control_command(void *context, const string &command)
 {
-    return max(min(x, ssize_t(255)), ssize_t(0));
-}
-
-static void mem_put_le16(void *vmem, int val)
-{
-    uint8_t *mem = (uint8_t *)vmem;
-
-    mem[0] = (uint8_t)((val >> 0) & 0xff);
-    mem[1] = (uint8_t)((val >> 8) & 0xff);
-}
-
-static void mem_put_le32(void *vmem, int val)
-{
-    uint8_t *mem = (uint8_t *)vmem;
-
-    mem[0] = (uint8_t)((val >> 0) & 0xff);
-    mem[1] = (uint8_t)((val >> 8) & 0xff);
-    mem[2] = (uint8_t)((val >> 16) & 0xff);
-    mem[3] = (uint8_t)((val >> 24) & 0xff);
-}
-
-// A buffer to hold the screenshot of about 24MB, the image MUST fit in this.
-const auto SIZE = 1024 * 768 * 3 * 10;
-uint8_t buffer[SIZE];
-
-// VP9 info
-static const int VP9_FOURCC = 0x30395056;
-
-// Statically chosen FPS setting
-static const int FPS_NUMERATOR = 1;
-static const int FPS_DENOMINATOR = 5;
-static const int KEYFRAME_INTERVAL = 10;
-
-// Output functions
-bool DEBUG = false;
-
-void perform_debug(const char *fmt, ...)
-{
-    if (DEBUG)
+    auto &recorders = *(vector<unique_ptr<Recorder>> *)context;
+    const string dump_command = "dump";
+    if (command.substr(0, dump_command.size()) != dump_command ||
+        (command.size() > dump_command.size() && command[dump_command.size()] != ' '))
+        return "unknown command " + command + ", expected dump [domain]";
+    auto domain = command.size() > dump_command.size() ? command.substr(dump_command.size() + 1) : "";
+    string dumped;
+    for (auto &recorder : recorders)
     {
-        va_list ap;
-        va_start(ap, fmt);
-        vfprintf(stderr, fmt, ap);
-        va_end(ap);
+        if (recorder->ring && (domain.empty() || recorder->name == domain) && recorder->ring->dump("on request"))
+            dumped += " " + recorder->name;
     }
-}
-
-#define XSTRINGIFY(x) #x
-#define STRINGIFY(x) XSTRINGIFY(x)
-#define debug(...) perform_debug("[" __FILE__ ":" STRINGIFY(__LINE__) "]: " __VA_ARGS__)
-
-void fatal(const char *fmt, ...)
-{
-    va_list ap;
-    va_start(ap, fmt);
-    vfprintf(stderr, fmt, ap);
-    va_end(ap);
-    exit(EXIT_FAILURE);
-}
-
-void output(const char *fmt, ...)
-{
-    va_list ap;
-    va_start(ap, fmt);
-    vfprintf(stdout, fmt, ap);
-    va_end(ap);
+    return dumped.empty() ? "nothing to dump" : "dumping" + dumped;
 }
 
 void usage_exit(const char *name)
 {
     fatal(
-        "Usage: %s <domain> <outfile> [--connect <connection_uri>] [--debug]\n"
-        "Takes screenshots of a domain and combines them into a WEBM file.\n"
-        "Can only manage about 2 fps and the output is sped up to 5 fps.\n",
-        name);
+        "Usage: %s <domain> <outfile> [options]\n"
+        "       %s --domains <pattern,...> <outfile_template> [options]\n"
+        "       %s encode <spool> <outfile> [options]\n"
+        "Options: [--connection <connection_uri>] [--converter <auto|scalar|ssse3|avx2|neon>]\n"
+        "         [--threads <n>] [--tile-columns <log2>] [--no-row-mt] [--cpu-used <-9..9>] [--realtime]\n"
+        "         [--rate-control <lossless|vbr|cbr|cq|q>] [--bitrate <kbit/s>] [--cq-level <0..63>]\n"
+        "         [--codec <vp9|av1>] [--encoder <vpx|vaapi>] [--vaapi-device <path>] [--chroma <420|444>]\n"
+        "         [--matrix <bt601|bt709|gbr>] [--full-range]\n"
+        "         [--live <tcp:<host>:<port>|unix:<path>|->]... [--fsync <never|close|seconds>] [--direct-io]\n"
+        "         [--io-uring] [--segment-time <seconds>] [--segment-size <MB>]\n"
+        "         [--keyframe-interval <frames>] [--keyframe-mode <auto|fixed>] [--scene-change <percent>]\n"
+        "         [--fps <n>] [--crop <WxH+X+Y>] [--downscale <1..8>] [--no-damage-tracking] [--workers <n>]\n"
+        "         [--capture-threads <n>] [--async-capture] [--vnc] [--convert-bands <n>] [--spool]\n"
+        "         [--prerecord <seconds>] [--prerecord-size <MB>] [--control <path>]\n"
+        "         [--shutdown-timeout <seconds>]\n"
+        "         [--huge-pages] [--stats <stderr|prometheus:<path>|unix:<path>>] [--stats-interval <seconds>] [--debug]\n"
+        "Takes screenshots of a domain and combines them into a WebM file, or an IVF file if outfile ends\n"
+        "in .ivf.\n"
+        "--live also streams the recording, from the same encode, to every viewer that connects to a TCP\n"
+        "or Unix socket, or to stdout for -, as live WebM or as IVF if the address ends in .ivf. Viewers\n"
+        "join at a keyframe, which is made as soon as one connects. An outfile of - streams to stdout.\n"
+        "Files are written behind the encoder by a thread of their own, in large blocks. They are synced\n"
+        "to disk as per --fsync, when closed by default, and their blocks can bypass the page cache with\n"
+        "--direct-io. --io-uring submits the writes through io_uring, if lvsc was built with it.\n"
+        "--segment-time and --segment-size split the recording into files that are each complete and\n"
+        "playable, starting a new one at the first keyframe after that long or that size, which is\n"
+        "forced when it is due. {segment} in outfile is replaced by the number of the segment, otherwise\n"
+        "it goes before the extension.\n"
+        "Keyframes are at most --keyframe-interval encoded frames apart, 150 by default or never for 0,\n"
+        "and placed by the encoder unless --keyframe-mode is fixed. A frame with --scene-change percent\n"
+        "of the screen changed, 60 by default or never for 0, starts with a keyframe, as do segments.\n"
+        "Unchanged screenshots are not encoded at all, so a static screen costs almost nothing.\n"
+        "With --domains every running domain matching one of the shell style patterns is recorded to the\n"
+        "template with {domain} replaced by its name. Conversion and encoding run on a pool of --workers\n"
+        "threads, one per core by default, and screenshots are taken by --capture-threads threads, at most\n"
+        "4 by default. Unless --threads is given the encoder threads are split between the domains.\n"
+        "Each frame is converted in --convert-bands horizontal bands at once, one per worker by default,\n"
+        "and only the bands with changes in them are converted.\n"
+        "--async-capture receives screenshots on libvirt's event loop so that many can be in flight at\n"
+        "once, which helps most over remote connections.\n"
+        "--vnc receives frames from the domain's VNC display instead, which libvirt only hands out over a\n"
+        "local connection. Only the rectangles that changed are sent, and they are all that is converted.\n"
+        "lvsc takes screenshots if the display cannot be used.\n"
+        "--spool writes the screenshots to outfile as they are instead of encoding them, through a shared\n"
+        "mapping of the file, so that capture never waits on the encoder. Only the tiles that changed are\n"
+        "kept of each, with the whole screen every --keyframe-interval frames, or 150 for 0, and at scene\n"
+        "changes. lvsc encode later encodes the spool in chunks that start at those whole screens, all at\n"
+        "once on the --workers with one encoder thread each unless --threads is given, and writes them\n"
+        "out in order. The encoder options, --crop and --downscale are given to lvsc encode.\n"
+        "--prerecord keeps only the last that many seconds of the recording in memory, and\n"
+        "--prerecord-size at most that many MB of it, in whole keyframe intervals. Nothing is written\n"
+        "until the domain crashes, sets off its watchdog or reboots, lvsc gets SIGUSR1 or a dump command\n"
+        "arrives, when what is held is saved to outfile with {time} replaced by the time, or the time\n"
+        "put before the extension, and recording carries on. --live outputs are streamed as usual.\n"
+        "--control takes commands on a Unix socket, a line per connection: dump saves every domain\n"
+        "being pre-recorded and dump <domain> only that one.\n"
+        "SIGINT and SIGTERM end the recording. The frames still being captured and encoded are finished\n"
+        "and the files completed within --shutdown-timeout seconds, 60 by default or no limit for 0,\n"
+        "after which the frames left are dropped so the files are never cut off mid-write. A second\n"
+        "signal drops them at once.\n"
+        "Frame buffers are allocated once per domain and reused. --huge-pages backs them with huge pages,\n"
+        "when the kernel has them reserved, and otherwise asks for transparent huge pages.\n"
+        "--stats exports screenshot, conversion and encode times, packet sizes, frame counts and queue\n"
+        "depths every --stats-interval seconds, 10 by default, as a line per domain on stderr or as a\n"
+        "Prometheus text file, or to whoever connects to a Unix socket.\n"
+        "Screenshots are taken at --fps, 5 by default, and stamped with the time they were taken so the\n"
+        "recording plays back in real time. When a screenshot overruns its frame the previous frame is\n"
+        "shown for longer.\n"
+        "The encoder uses one thread per core, as many tile columns as the width and thread count allow\n"
+        "and row based multi-threading. --realtime trades compression for speed and defaults --cpu-used\n"
+        "to 8 instead of 0.\n"
+        "Frames are encoded losslessly unless --rate-control picks a lossy mode, which is tuned for\n"
+        "screen content and takes a --bitrate, plus a --cq-level for cq and q. Lossy --realtime encoding\n"
+        "is far cheaper and smaller than lossless.\n"
+        "--codec av1 encodes AV1 with libaom instead of VP9, if lvsc was built with it, using its palette\n"
+        "mode and intra block copy, which compress text and desktops much better at a higher CPU cost.\n"
+        "--chroma 444 keeps colour at full resolution instead of sharing it between 2x2 blocks, so that\n"
+        "thin coloured text and lines keep their colour, in VP9 profile 1 or the AV1 high profile.\n"
+        "Colour is converted with the BT.601 --matrix in limited range by default. --matrix bt709 suits\n"
+        "HD players better and --full-range keeps all 256 levels, and the stream and the WebM track are\n"
+        "marked with both so that players show the colours as captured. --matrix gbr skips conversion\n"
+        "and encodes the green, blue and red of each pixel as they are, in VP9 profile 1 or the AV1 high\n"
+        "profile, so lossless recordings are exact copies of the screen. It implies --chroma 444 and\n"
+        "--full-range.\n"
+        "--encoder vaapi encodes on the GPU through VAAPI, if lvsc was built with it, at --vaapi-device,\n"
+        "/dev/dri/renderD128 by default. It is lossy only, so it needs a --rate-control, and a --bitrate\n"
+        "for vbr and cbr, without which it keeps to --cq-level. When the device cannot encode VP9 like\n"
+        "that, libvpx is used instead.\n"
+        "--crop records only that part of each screenshot and --downscale shrinks it by averaging blocks\n"
+        "of that many pixels each way, as it is converted, so discarded pixels cost nothing to encode.\n"
+        "Unchanged screenshots only extend the previous frame and changed ones are converted per tile,\n"
+        "unless --no-damage-tracking is given.\n",
+        name, name, name);
 }
 
-// A writer that can take in RGB 24 bit frames and save them out as a IVF VPX stream.
-struct IVFVPX9Writer
+int main(int argc, char **argv)
 {
-    FILE *outfile;
-    int width;
-    int height;
-    int frames_written;
-    int frames_encoded;
-    vpx_codec_ctx_t codec;
-    vpx_image_t img;
-
-    void write_file_header()
-    {
-        debug("Writing file header\n");
-        char header[32];
-        header[0] = 'D';
-        header[1] = 'K';
-        header[2] = 'I';
-        header[3] = 'F';
-        mem_put_le16(header + 4, 0);                // version
-        mem_put_le16(header + 6, 32);               // header size
-        mem_put_le32(header + 8, VP9_FOURCC);       // fourcc
-        mem_put_le16(header + 12, width);           // width
-        mem_put_le16(header + 14, height);          // height
-        mem_put_le32(header + 16, FPS_DENOMINATOR); // rate
-        mem_put_le32(header + 20, FPS_NUMERATOR);   // scale
-        mem_put_le32(header + 24, frames_written);  // length
-        mem_put_le32(header + 28, 0);               // unused
-        auto position = ftell(outfile);
-        rewind(outfile);
-        fwrite(header, 1, 32, outfile);
-        if (position >= 32)
-            fseek(outfile, position, SEEK_SET);
-    }
-
-    void write_ivf_frame_header(FILE *outfile, int64_t pts, uint32_t frame_size)
-    {
-        debug("Writing frame header\n");
-
-        char header[12];
-
-        mem_put_le32(header, (int)frame_size);
-        mem_put_le32(header + 4, (int)(pts & 0xFFFFFFFF));
-        mem_put_le32(header + 8, (int)(pts >> 32));
-        fwrite(header, 1, 12, outfile);
-    }
+    // Argument processing
+    string domain_name;
+    string output_file;
+    string connection_uri = "qemu:///system";
+    string converter = "auto";
+    EncoderOptions encoder_options;
+    bool damage_tracking = true;
+    vector<string> domain_patterns;
+    int workers = max(2, int(thread::hardware_concurrency()));
+    int capture_threads = 0;
+    int fps = 5;
+    bool async_capture = false;
+    bool vnc = false;
+    int convert_bands = 0;
+    CaptureArea area;
+    string stats_target;
+    int stats_interval = 10;
+    vector<string> outputs;
+    SinkOptions sink_options;
+    int scene_change = 60;
+    // Well within the 90 seconds systemd gives a service to stop by default.
+    int shutdown_timeout = 60;
+    bool spool = false;
+    int prerecord_seconds = 0;
+    long prerecord_bytes = 0;
+    string control_path;
+    // lvsc encode <spool> <outfile> compresses a spool instead of recording.
+    bool encode = argc > 1 && string(argv[1]) == "encode";
 
-    int vpx_video_writer_write_frame(const uint8_t *buffer, size_t size, int64_t pts)
-    {
-        debug("Writing frame\n");
-        write_ivf_frame_header(outfile, pts, size);
-        if (fwrite(buffer, 1, size, outfile) != size)
-            return 0;
-        ++frames_written;
-        return 1;
-    }
+    const string connection_option = "--connection";
+    const string converter_option = "--converter";
+    const string no_damage_tracking_option = "--no-damage-tracking";
+    const string live_option = "--live";
+    const string fsync_option = "--fsync";
+    const string direct_io_option = "--direct-io";
+    const string io_uring_option = "--io-uring";
+    const string scene_change_option = "--scene-change";
+    const string segment_time_option = "--segment-time";
+    const string segment_size_option = "--segment-size";
+    const string fps_option = "--fps";
+    const string crop_option = "--crop";
+    const string downscale_option = "--downscale";
+    const string domains_option = "--domains";
+    const string async_capture_option = "--async-capture";
+    const string vnc_option = "--vnc";
+    const string convert_bands_option = "--convert-bands";
+    const string spool_option = "--spool";
+    const string prerecord_size_option = "--prerecord-size";
+    const string prerecord_option = "--prerecord";
+    const string control_option = "--control";
+    const string stats_interval_option = "--stats-interval";
+    const string shutdown_timeout_option = "--shutdown-timeout";
+    const string stats_option = "--stats";
+    const string workers_option = "--workers";
+    const string capture_threads_option = "--capture-threads";
+    const string huge_pages_option = "--huge-pages";
+    const string debug_option = "--debug";
 
-    int encode_frame(bool flush = false)
+    for (int i = encode ? 2 : 1; i < argc; ++i)
     {
-        debug("Encoding frame with flush=%d\n", flush);
-        auto frame_index = !flush ? frames_encoded : -1;
-        int flags = frame_index % KEYFRAME_INTERVAL == 0 ? VPX_EFLAG_FORCE_KF : 0;
-        auto img = !flush ? &this->img : nullptr;
-        if (!flush)
-            ++frames_encoded;
-        int got_pkts = 0;
-        vpx_codec_iter_t iter = NULL;
-        const vpx_codec_cx_pkt_t *pkt = NULL;
-        const vpx_codec_err_t res =
-            vpx_codec_encode(&codec, img, frame_index, 1, flags, VPX_DL_GOOD_QUALITY);
-        if (res != VPX_CODEC_OK)
-            fatal("Failed to encode frame. %s\n", vpx_codec_error_detail(&codec));
-        while ((pkt = vpx_codec_get_cx_data(&codec, &iter)) != NULL)
-        {
-            got_pkts = 1;
-            if (pkt->kind == VPX_CODEC_CX_FRAME_PKT)
-            {
-                // const int keyframe = (pkt->data.frame.flags & VPX_FRAME_IS_KEY) != 0;
-                if (!vpx_video_writer_write_frame((const uint8_t *)pkt->data.frame.buf,
-                                                  pkt->data.frame.sz,
-                                                  pkt->data.frame.pts))
-                {
-                    fatal("Failed to write compressed frame. %s\n", vpx_codec_error_detail(&codec));
-                }
-                fflush(stdout);
-            }
+        string arg = argv[i];
+        auto value = [&]() -> const char * {
+            if (i + 1 >= argc)
+                usage_exit(argv[0]);
+            return argv[++i];
+        };
+        if (encoder_options.parse_option(arg, value))
+            continue;
+        if (arg.substr(0, connection_option.size()) == connection_option)
+        {
+            connection_uri = value();
         }
-        return got_pkts;
-    }
-
-    void update_image(uint8_t *buffer)
-    {
-        debug("Updating image\n");
-        size_t dst_pos = 0;
-        uint8_t *dest = img.planes[0];
-        for (int y = 0; y < height; ++y)
+        else if (arg.substr(0, converter_option.size()) == converter_option)
         {
-            for (int x = 0; x < width; ++x)
-            {
-                int o = (y * width + x) * 3;
-
-                ssize_t r = buffer[o];
-                ssize_t g = buffer[o + 1];
-                ssize_t b = buffer[o + 2];
-
-                ssize_t y = (66 * r + 129 * g + 25 * b + 128) / 256 + 16;
-                dest[dst_pos++] = clamp(y);
-            }
+            converter = value();
         }
-
-        dst_pos = 0;
-        dest = img.planes[1];
-        for (int y = 0; y < height; y += 2)
+        else if (arg.substr(0, no_damage_tracking_option.size()) == no_damage_tracking_option)
         {
-            for (int x = 0; x < width; x += 2)
-            {
-                int o = (y * width + x) * 3;
-
-                ssize_t r = buffer[o];
-                ssize_t g = buffer[o + 1];
-                ssize_t b = buffer[o + 2];
-
-                ssize_t u = (-38 * r - 74 * g + 112 * b + 128) / 256 + 128;
-                dest[dst_pos++] = clamp(u);
-            }
+            damage_tracking = false;
         }
-
-        dst_pos = 0;
-        dest = img.planes[2];
-        for (int y = 0; y < height; y += 2)
+        else if (arg.substr(0, live_option.size()) == live_option)
+        {
+            outputs.push_back(value());
+        }
+        else if (arg.substr(0, fsync_option.size()) == fsync_option)
+        {
+            string policy = value();
+            if (!sink_options.set_fsync_policy(policy))
+                fatal("Invalid value %s for %s, expected never, close or a number of seconds\n", policy.c_str(),
+                      fsync_option.c_str());
+        }
+        else if (arg.substr(0, direct_io_option.size()) == direct_io_option)
         {
-            for (int x = 0; x < width; x += 2)
+            sink_options.direct = true;
+        }
+        else if (arg.substr(0, huge_pages_option.size()) == huge_pages_option)
+        {
+            set_huge_pages(true);
+        }
+        else if (arg.substr(0, io_uring_option.size()) == io_uring_option)
+        {
+            if (!io_uring_available())
+                fatal("lvsc was built without io_uring, rebuild it with make IO_URING=1\n");
+            sink_options.io_uring = true;
+        }
+        else if (arg.substr(0, scene_change_option.size()) == scene_change_option)
+        {
+            scene_change = parse_int(scene_change_option.c_str(), value(), 0, 100);
+        }
+        else if (arg.substr(0, segment_time_option.size()) == segment_time_option)
+        {
+            sink_options.segment_seconds = parse_int(segment_time_option.c_str(), value(), 1, 7 * 24 * 3600);
+        }
+        else if (arg.substr(0, segment_size_option.size()) == segment_size_option)
+        {
+            sink_options.segment_bytes = long(parse_int(segment_size_option.c_str(), value(), 1, 1 << 20)) << 20;
+        }
+        else if (arg.substr(0, fps_option.size()) == fps_option)
+        {
+            fps = parse_int(fps_option.c_str(), value(), 1, 60);
+        }
+        else if (arg.substr(0, crop_option.size()) == crop_option)
+        {
+            auto crop = value();
+            int end = 0;
+            if (sscanf(crop, "%dx%d+%d+%d%n", &area.width, &area.height, &area.x, &area.y, &end) != 4 ||
+                crop[end] != '\0' || area.width <= 0 || area.height <= 0 || area.x < 0 || area.y < 0)
+                fatal("Invalid value %s for %s, expected WIDTHxHEIGHT+X+Y\n", crop, crop_option.c_str());
+        }
+        else if (arg.substr(0, downscale_option.size()) == downscale_option)
+        {
+            area.downscale = parse_int(downscale_option.c_str(), value(), 1, MAX_DOWNSCALE);
+        }
+        else if (arg.substr(0, domains_option.size()) == domains_option)
+        {
+            string patterns = value();
+            size_t start = 0;
+            while (start <= patterns.size())
             {
-                int o = (y * width + x) * 3;
-
-                ssize_t r = buffer[o];
-                ssize_t g = buffer[o + 1];
-                ssize_t b = buffer[o + 2];
-
-                ssize_t v = (112 * r - 94 * g - 18 * b + 128) / 256 + 128;
-                dest[dst_pos++] = clamp(v);
+                auto end = min(patterns.find(',', start), patterns.size());
+                if (end > start)
+                    domain_patterns.push_back(patterns.substr(start, end - start));
+                start = end + 1;
             }
         }
-    }
-
-    void flush()
-    {
-        debug("Flushing writer\n");
-
-        write_file_header();
-        // Flush encoder.
-        while (encode_frame(true))
+        else if (arg.substr(0, workers_option.size()) == workers_option)
         {
+            workers = parse_int(workers_option.c_str(), value(), 2, 256);
         }
-        fflush(outfile);
-    }
-
-    ~IVFVPX9Writer()
-    {
-        debug("Destroying writer\n");
-
-        flush();
-        fclose(outfile);
-        vpx_img_free(&img);
-        vpx_codec_destroy(&codec);
-    }
-
-    IVFVPX9Writer(const char *filename, int width, int height) : outfile(fopen(filename, "w")), width(width), height(height), frames_written(0), frames_encoded(0), codec(vpx_codec_ctx_t()), img(vpx_image_t())
-    {
-        debug("Creating writer for %s of size %dx%d\n", filename, width, height);
-
-        vpx_codec_enc_cfg_t cfg;
-        auto error = vpx_codec_enc_config_default(vpx_codec_vp9_cx(), &cfg, 0);
-        if (error)
-            fatal("Failed to get default codec config. %s\n", vpx_codec_error_detail(&codec));
-
-        cfg.g_w = width;
-        cfg.g_h = height;
-        cfg.g_timebase.num = FPS_NUMERATOR;
-        cfg.g_timebase.den = FPS_DENOMINATOR;
-        cfg.g_error_resilient = 0;
-
-        if (vpx_codec_enc_init(&codec, vpx_codec_vp9_cx(), &cfg, 0))
-            fatal("Failed to initialize encoder with VP9 codec. %s\n", vpx_codec_error_detail(&codec));
-
-        if (vpx_codec_control_(&codec, VP9E_SET_LOSSLESS, 1))
-            fatal("Failed to use lossless mode on VP9 codec. %s\n", vpx_codec_error_detail(&codec));
-
-        write_file_header();
-        vpx_img_alloc(&img, VPX_IMG_FMT_I420, width, height, 1);
-    }
-
-    IVFVPX9Writer(const IVFVPX9Writer &o) = delete;
-};
-
-int main(int argc, char **argv)
-{
-    // Argument processing
-    string domain_name;
-    string output_file;
-    string connection_uri = "qemu:///system";
-
-    const string connection_option = "--connection";
-    const string debug_option = "--debug";
-
-    for (int i = 1; i < argc; ++i)
-    {
-        string arg = argv[i];
-        if (arg.substr(0, connection_option.size()) == connection_option)
+        else if (arg.substr(0, capture_threads_option.size()) == capture_threads_option)
+        {
+            capture_threads = parse_int(capture_threads_option.c_str(), value(), 1, 64);
+        }
+        else if (arg.substr(0, async_capture_option.size()) == async_capture_option)
+        {
+            async_capture = true;
+        }
+        else if (arg.substr(0, convert_bands_option.size()) == convert_bands_option)
+        {
+            convert_bands = parse_int(convert_bands_option.c_str(), value(), 1, 256);
+        }
+        else if (arg.substr(0, vnc_option.size()) == vnc_option)
+        {
+            vnc = true;
+        }
+        else if (arg.substr(0, spool_option.size()) == spool_option)
+        {
+            spool = true;
+        }
+        else if (arg.substr(0, prerecord_size_option.size()) == prerecord_size_option)
+        {
+            prerecord_bytes = long(parse_int(prerecord_size_option.c_str(), value(), 1, 1 << 20)) << 20;
+        }
+        else if (arg.substr(0, prerecord_option.size()) == prerecord_option)
+        {
+            prerecord_seconds = parse_int(prerecord_option.c_str(), value(), 1, 7 * 24 * 3600);
+        }
+        else if (arg.substr(0, control_option.size()) == control_option)
+        {
+            control_path = value();
+        }
+        else if (arg.substr(0, shutdown_timeout_option.size()) == shutdown_timeout_option)
+        {
+            shutdown_timeout = parse_int(shutdown_timeout_option.c_str(), value(), 0, 24 * 3600);
+        }
+        else if (arg.substr(0, stats_interval_option.size()) == stats_interval_option)
+        {
+            stats_interval = parse_int(stats_interval_option.c_str(), value(), 1, 3600);
+        }
+        else if (arg.substr(0, stats_option.size()) == stats_option)
         {
-            connection_uri = argv[++i];
+            stats_target = value();
         }
         else if (arg.substr(0, debug_option.size()) == debug_option)
         {
             DEBUG = true;
         }
-        else if (domain_name.empty())
+        else if (domain_name.empty() && domain_patterns.empty())
         {
             domain_name = arg;
         }
@@ -329,119 +360,229 @@ int main(int argc, char **argv)
             usage_exit(argv[0]);
         }
     }
-    if (domain_name.empty() || output_file.empty())
+    // Without --domains the first positional argument is the domain and the second the output.
+    if (!domain_patterns.empty() && !domain_name.empty() && output_file.empty())
+        swap(domain_name, output_file);
+    if ((domain_name.empty() == domain_patterns.empty()) || output_file.empty())
     {
         usage_exit(argv[0]);
     }
+    bool prerecord = prerecord_seconds > 0 || prerecord_bytes > 0;
+    if (encode && (!domain_patterns.empty() || spool || prerecord))
+        usage_exit(argv[0]);
+    const string domain_placeholder = "{domain}";
+    if (!domain_patterns.empty() && output_file.find(domain_placeholder) == string::npos)
+        fatal("The output %s for --domains must contain %s\n", output_file.c_str(), domain_placeholder.c_str());
+    outputs.insert(outputs.begin(), output_file);
+    if (spool && outputs.size() > 1)
+        fatal("--live cannot be used with --spool, the spool is only encoded later\n");
+    if (spool && (area.width > 0 || area.downscale > 1))
+        fatal("--crop and --downscale are given to lvsc encode, a spool keeps whole screenshots\n");
+    if (prerecord && spool)
+        fatal("--prerecord cannot be used with --spool\n");
+    if (prerecord && encoder_options.keyframe_interval == 0)
+        fatal("--prerecord drops whole keyframe intervals, so --keyframe-interval cannot be 0\n");
+    // Messages move to stderr when the recording goes to stdout.
+    MESSAGES_TO_STDERR = find(outputs.begin(), outputs.end(), "-") != outputs.end();
+    encoder_options.finalize();
+    if (!select_converter(converter.c_str()))
+        fatal("Colour converter %s is not available on this machine\n", converter.c_str());
+    if (encode)
+    {
+        // The chunks already keep every worker busy.
+        if (!encoder_options.threads_given)
+            encoder_options.threads = 1;
+        auto start = chrono::steady_clock::now();
+        int frames = encode_spool(domain_name, outputs, sink_options, encoder_options, area, workers);
+        output("Encoded %d frames of %s in %.1f seconds\n", frames, domain_name.c_str(),
+               chrono::duration<double>(chrono::steady_clock::now() - start).count());
+        return 0;
+    }
 
-    string tmp_file = "/tmp/" + domain_name + ".webm";
-    unique_ptr<IVFVPX9Writer> video_stream;
+    // Set up the signal handlers
+    handle_stop_signals(shutdown_timeout);
+    signal(SIGUSR1, dump_signal_handler);
+    // A viewer closing its end of stdout shows up as a failed write instead.
+    signal(SIGPIPE, SIG_IGN);
 
-    // Set up the signal handler
-    struct sigaction sigact;
-    sigact.sa_sigaction = signal_handler;
-    sigact.sa_flags = SA_RESTART | SA_SIGINFO;
-    sigaction(SIGINT, &sigact, (struct sigaction *)NULL);
+    // Only the main thread should see SIGINT, SIGTERM and SIGUSR1, so they are blocked while any
+    // other thread is spawned.
+    sigset_t blocked, previous;
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGINT);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGUSR1);
 
-    // Initialize libVirt and set up some wrappers for the libvirt pointers
     virInitialize();
-
-    typedef unique_ptr<virConnect, function<void(virConnectPtr)>> Connection;
-    auto connect = [&](string name) -> auto
+    unique_ptr<EventLoop> event_loop;
+    // Domain events, which pre-recording dumps on, are only delivered on the event loop.
+    if (async_capture || prerecord)
     {
-        auto deleter = [&](virConnectPtr ptr) {
-            virConnectClose(ptr);
-        };
-        auto connection = Connection(virConnectOpen(name.c_str()), deleter);
-        if (!connection)
-            fatal("Could not connect to %s\n", name.c_str());
-        return connection;
-    };
+        pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+        event_loop = make_unique<EventLoop>();
+        pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+    }
+    auto connection = connect(connection_uri);
 
-    typedef unique_ptr<virDomain, function<void(virDomainPtr)>> Domain;
-    auto get_domain = [&](Connection & connection, string name) -> auto
+    // Pair every domain with its output file and live outputs.
+    vector<pair<string, vector<string>>> targets;
+    if (domain_patterns.empty())
     {
-        auto deleter = [&](virDomainPtr ptr) {
-            virDomainFree(ptr);
-        };
-        auto domain = Domain(virDomainLookupByName(connection.get(), name.c_str()), deleter);
-        if (!domain)
-            fatal("Could not find domain %s\n", name.c_str());
-        if (virDomainIsActive(domain.get()) != 1)
-            fatal("Domain must be running\n");
-        return domain;
-    };
-
-    typedef unique_ptr<virStream, function<void(virStreamPtr)>> Stream;
-    auto new_stream = [&](Connection & connection) -> auto
+        targets.emplace_back(domain_name, outputs);
+    }
+    else
     {
-        auto deleter = [&](virStreamPtr ptr) {
-            virStreamFree(ptr);
-        };
-        return Stream(virStreamNew(connection.get(), 0), deleter);
-    };
+        for (auto &name : find_domains(connection, domain_patterns))
+        {
+            vector<string> files;
+            for (auto file : outputs)
+            {
+                for (size_t at = file.find(domain_placeholder); at != string::npos; at = file.find(domain_placeholder, at + name.size()))
+                    file.replace(at, domain_placeholder.size(), name);
+                files.push_back(file);
+            }
+            targets.emplace_back(name, files);
+        }
+        if (targets.empty())
+            fatal("No running domain matches --domains\n");
+        for (auto &output : outputs)
+        {
+            if (targets.size() > 1 && output.find(domain_placeholder) == string::npos)
+                fatal("The output %s is shared by several domains and must contain %s\n", output.c_str(),
+                      domain_placeholder.c_str());
+        }
+    }
+    if (!encoder_options.threads_given)
+        encoder_options.threads = max(1, encoder_options.threads / int(targets.size()));
+    if (capture_threads == 0)
+        capture_threads = min(int(targets.size()), 4);
 
-    auto take_screenshot = [&](Domain &domain, Stream &stream, uint8_t *buffer, size_t len) -> ssize_t {
-        auto mimetype = virDomainScreenshot(domain.get(), stream.get(), 0, 0);
-        if (!mimetype)
-            return -1;
-        free(mimetype);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
 
-        auto base = buffer;
-        auto remaining_size = SIZE;
+    ThreadPool pool(workers);
+    RecorderOptions recorder_options = {encoder_options, damage_tracking, fps, async_capture, vnc, area, sink_options, scene_change, convert_bands, spool, prerecord_seconds, prerecord_bytes};
+    vector<unique_ptr<Recorder>> recorders;
+    for (auto &target : targets)
+    {
+        recorders.push_back(make_unique<Recorder>(pool, connection, target.first, target.second, recorder_options));
+        for (auto &output : target.second)
+            debug("Recording %s to %s\n", target.first.c_str(), output.c_str());
+    }
 
-        while (true)
+    // Capture threads wait for the domain due soonest that no other thread is on. A stop signal
+    // wakes them, and sleeps are kept short so that they notice a domain coming free.
+    const auto max_sleep = chrono::milliseconds(100);
+    atomic<int> finished_workers(0);
+    auto capture_loop = [&]() {
+        while (!stop_requested())
         {
-            auto res = virStreamRecv(stream.get(), (char *)base, remaining_size);
-            if (res < 0)
+            Recorder *next = nullptr;
+            for (auto &recorder : recorders)
             {
-                virStreamAbort(stream.get());
-                return -1;
+                if (!recorder->busy && (!next || recorder->scheduler.due() < next->scheduler.due()))
+                    next = recorder.get();
             }
-            else if (res == 0)
+            auto now = FrameScheduler::Clock::now();
+            if (!next)
             {
-                virStreamFinish(stream.get());
-                return base - buffer;
+                wait_for_stop(now + chrono::milliseconds(1));
+                continue;
             }
-            base += res;
-            remaining_size -= res;
+            if (next->scheduler.due() > now)
+            {
+                wait_for_stop(min(next->scheduler.due(), now + max_sleep));
+                continue;
+            }
+            if (next->busy.exchange(true))
+                continue;
+            next->capture();
         }
+        ++finished_workers;
     };
-
-    auto connection = connect(connection_uri.c_str());
-    auto domain = get_domain(connection, domain_name);
-    auto stream = new_stream(connection);
-
-    output("Starting capture. Press Ctrl+C or send SIGINT to end recording\n");
-    while (capturing)
+    unique_ptr<StatsExporter> stats_exporter;
+    if (!stats_target.empty())
     {
-        if (take_screenshot(domain, stream, buffer, SIZE) < 0)
-            continue;
-
-        int pwidth, pheight, pdepth, chars;
-        sscanf((char *)buffer, "P6 %d %d %d%n", &pwidth, &pheight, &pdepth, &chars);
-        ++chars;
-        if (!video_stream)
-            video_stream = make_unique<IVFVPX9Writer>((tmp_file).c_str(), pwidth, pheight);
-        video_stream->update_image(buffer + chars);
-        video_stream->encode_frame();
+        StatsSources sources;
+        for (auto &recorder : recorders)
+            sources.emplace_back(recorder->name, &recorder->stats);
+        stats_exporter = make_unique<StatsExporter>(sources, stats_target, stats_interval * 1000);
+    }
+    unique_ptr<ControlServer> control;
+    if (!control_path.empty())
+        control = make_unique<ControlServer>(control_path, control_command, &recorders);
+    vector<thread> capture_workers;
+    for (int i = 0; i < capture_threads; ++i)
+        capture_workers.emplace_back(capture_loop);
+    pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+
+    output("Starting capture of %zu domain%s. Press Ctrl+C or send SIGINT or SIGTERM to end recording\n", recorders.size(),
+           recorders.size() == 1 ? "" : "s");
+    // The main thread takes no screenshots itself, so that it is free to handle the stop however
+    // long libvirt takes to answer.
+    while (!wait_for_stop(chrono::steady_clock::now() + max_sleep))
+    {
+        if (dump_requested)
+        {
+            dump_requested = 0;
+            for (auto &recorder : recorders)
+            {
+                if (recorder->ring)
+                    recorder->ring->dump("on SIGUSR1");
+            }
+        }
     }
-    output("Ending capture. %d frames captured. Flushing streams and combining into webm\n", video_stream->frames_encoded);
 
-    if (video_stream)
-        video_stream->flush();
+    // Screenshots still being taken are given up on, and waited for only until the stop deadline,
+    // so a domain that never answers cannot keep the files from being completed. A capture thread
+    // still stuck in libvirt after that is left behind, and the process ends without it once the
+    // files are closed.
+    for (auto &recorder : recorders)
+        recorder->abort_capture();
+    while (finished_workers < int(capture_workers.size()) && !past_stop_deadline())
+        this_thread::sleep_for(chrono::milliseconds(1));
+    bool abandoned = finished_workers < int(capture_workers.size());
+    for (auto &worker : capture_workers)
+    {
+        if (abandoned)
+            worker.detach();
+        else
+            worker.join();
+    }
+    for (auto &recorder : recorders)
+    {
+        while (recorder->busy && !past_stop_deadline())
+            this_thread::sleep_for(chrono::milliseconds(1));
+        if (recorder->busy)
+            output("Gave up waiting for a screenshot of %s\n", recorder->name.c_str());
+    }
+    control.reset();
+    event_loop.reset();
+    pool.wait_idle();
+    stats_exporter.reset();
 
-    string merge_system_str = "mkvmerge -o ";
-    merge_system_str += output_file;
-    merge_system_str += " -w ";
-    merge_system_str += tmp_file;
-    debug("Shelling out to mkvmerge to create webm container: %s\n", merge_system_str.c_str());
-    if (system(merge_system_str.c_str()))
-        fatal("Failed to launch %s, check that mkvmerge is intalled.", merge_system_str.c_str());
-    if (unlink(tmp_file.c_str()) != 0)
+    for (auto &recorder : recorders)
     {
-        output("Failed to remove temporary file %s\n", tmp_file.c_str());
+        auto &video_stream = recorder->video_stream;
+        auto &stats = recorder->stats;
+        int frames = video_stream ? video_stream->frames_encoded : 0;
+        if (recorder->spool)
+            frames = recorder->spool->frames_written;
+        output("Ending capture of %s. %d frames captured, %d unchanged, %d dropped, %d late. Flushing streams\n",
+               recorder->name.c_str(), frames, int(stats.frames_unchanged),
+               int(stats.frames_dropped), int(stats.frames_late));
+        recorder->finish();
     }
 
+    if (abandoned)
+    {
+        for (auto &recorder : recorders)
+        {
+            for (auto &output : recorder->outputs)
+                output->close();
+            recorder->ring.reset();
+        }
+        fflush(nullptr);
+        _exit(0);
+    }
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,366 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <vpx/vpx_encoder.h>
+#include "convert.hpp"
+#include "memory.hpp"
+#include "ppm.hpp"
+#include "recorder.hpp"
+#include "util.hpp"
+#include "video_writer.hpp"
+
+using namespace std;
+
+typedef chrono::steady_clock Clock;
+
+static const char *const CONVERTER_NAMES[] = {"scalar", "ssse3", "avx2", "neon"};
+
+// Synthetic inputs cycle through this many distinct frames to keep memory bounded at 4K.
+static const int SYNTHETIC_FRAMES = 8;
+
+// Frames are spaced as if captured at 5 fps.
+static const int64_t FRAME_DURATION = 200;
+
+void usage_exit(const char *name)
+{
+    fatal(
+        "Usage: %s [ppm_file...] [--sizes <WxH,...>] [--frames <n>] [--converter <all|auto|scalar|ssse3|avx2|neon>]\n"
+        "          [--threads <n>] [--tile-columns <log2>] [--no-row-mt] [--cpu-used <-9..9>] [--realtime]\n"
+        "          [--rate-control <lossless|vbr|cbr|cq|q>] [--bitrate <kbit/s>] [--cq-level <0..63>]\n"
+        "          [--codec <vp9|av1>] [--encoder <vpx|vaapi>] [--vaapi-device <path>]\n"
+        "          [--keyframe-interval <frames>] [--keyframe-mode <auto|fixed>] [--downscale <1..8>] [--no-encode]\n"
+        "          [--pixel-format <rgb24|bgrx32|rgb565>] [--chroma <420|444>]\n"
+        "          [--matrix <bt601|bt709|gbr>] [--full-range]\n"
+        "Feeds frames through the colour conversion, the encoder and the IVF writer and reports\n"
+        "frames per second, conversion ns per pixel, encode latency percentiles and bytes per frame.\n"
+        "Without ppm files synthetic frames are used at each of --sizes, by default\n"
+        "640x480,1280x720,1920x1080,3840x2160. Consecutive ppm files of the same resolution are played\n"
+        "as one sequence. --converter all, the default, times every kernel the CPU supports and encodes\n"
+        "with the best one. --downscale shrinks the frames as they are converted. --pixel-format repacks\n"
+        "the frames first to time the converters for other captures, and --chroma 444 converts to and\n"
+        "encodes I444. --matrix and --full-range pick the colour matrix and range converted with,\n"
+        "and --matrix gbr only splits the pixels into planes.\n",
+        name);
+}
+
+// A sequence of frames of one resolution, repeated to make up the frame count. They are packed RGB
+// 24 bit until repacked.
+struct BenchInput
+{
+    string name;
+    int width;
+    int height;
+    vector<vector<uint8_t>> frames;
+    PixelFormat format;
+};
+
+// Desktop like frames: a fixed gradient background with a window whose contents scroll and a
+// cursor that moves, so that every frame differs from the last in part of the screen.
+static BenchInput synthetic_input(int width, int height)
+{
+    BenchInput input = {to_string(width) + "x" + to_string(height), width, height, {}, PIXEL_RGB24};
+    for (int n = 0; n < SYNTHETIC_FRAMES; ++n)
+    {
+        vector<uint8_t> frame(size_t(width) * height * 3);
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                auto p = &frame[(size_t(y) * width + x) * 3];
+                bool window = x >= width / 8 && x < width * 5 / 8 && y >= height / 8 && y < height * 6 / 8;
+                bool cursor = abs(x - n * width / SYNTHETIC_FRAMES) < 8 && abs(y - height / 2) < 12;
+                if (cursor)
+                {
+                    p[0] = p[1] = p[2] = 255;
+                }
+                else if (window)
+                {
+                    // Rows of text like noise scrolling up by a line each frame.
+                    uint32_t h = uint32_t(x / 6) * 2654435761u ^ uint32_t((y + n * 12) / 12) * 40503u;
+                    uint8_t ink = ((y + n * 12) % 12 < 9 && (h >> 7) % 3) ? ((x ^ y) & 1 ? 20 : 60) : 240;
+                    p[0] = p[1] = p[2] = ink;
+                }
+                else
+                {
+                    p[0] = x * 255 / width;
+                    p[1] = y * 255 / height;
+                    p[2] = 128;
+                }
+            }
+        }
+        input.frames.push_back(move(frame));
+    }
+    return input;
+}
+
+static vector<uint8_t> read_file(const string &filename)
+{
+    FILE *file = fopen(filename.c_str(), "rb");
+    if (!file)
+        fatal("Failed to open %s\n", filename.c_str());
+    vector<uint8_t> data;
+    uint8_t chunk[65536];
+    size_t read;
+    while ((read = fread(chunk, 1, sizeof(chunk), file)) > 0)
+        data.insert(data.end(), chunk, chunk + read);
+    fclose(file);
+    return data;
+}
+
+// Groups consecutive files of the same resolution into one input.
+static vector<BenchInput> recorded_inputs(const vector<string> &filenames)
+{
+    vector<BenchInput> inputs;
+    for (auto &filename : filenames)
+    {
+        auto data = read_file(filename);
+        PPMHeader header;
+        if (!parse_ppm_header(data.data(), data.size(), header) || data.size() < header.frame_size())
+            fatal("%s is not an 8 bit binary PPM\n", filename.c_str());
+        if (inputs.empty() || inputs.back().width != header.width || inputs.back().height != header.height)
+            inputs.push_back({filename, header.width, header.height, {}, PIXEL_RGB24});
+        inputs.back().frames.emplace_back(data.begin() + header.header_size, data.begin() + header.frame_size());
+    }
+    return inputs;
+}
+
+static double elapsed_ns(Clock::time_point start, Clock::time_point end)
+{
+    return chrono::duration<double, nano>(end - start).count();
+}
+
+static double percentile(const vector<double> &sorted, double p)
+{
+    return sorted[min(sorted.size() - 1, size_t(p * sorted.size()))];
+}
+
+// Packs the RGB 24 bit frames of input as format instead.
+static void repack_input(BenchInput &input, PixelFormat format)
+{
+    input.format = format;
+    if (format == PIXEL_RGB24)
+        return;
+    for (auto &frame : input.frames)
+    {
+        vector<uint8_t> packed(frame.size() / 3 * pixel_size(format));
+        for (size_t i = 0; i < frame.size() / 3; ++i)
+        {
+            auto p = &frame[i * 3];
+            if (format == PIXEL_BGRX32)
+            {
+                packed[i * 4] = p[2];
+                packed[i * 4 + 1] = p[1];
+                packed[i * 4 + 2] = p[0];
+            }
+            else
+            {
+                unsigned value = (p[0] >> 3) << 11 | (p[1] >> 2) << 5 | p[2] >> 3;
+                packed[i * 2] = value & 0xFF;
+                packed[i * 2 + 1] = value >> 8;
+            }
+        }
+        frame = move(packed);
+    }
+}
+
+static void convert_frame(vpx_image_t &img, const FrameConverter &converter, const BenchInput &input, int i)
+{
+    update_image(img, converter, input.frames[i % input.frames.size()].data(), input.width * pixel_size(input.format), 0,
+                 0, img.d_w, img.d_h);
+}
+
+static void bench_convert(const BenchInput &input, int frames, vpx_image_t &img, const FrameConverter &converter)
+{
+    // One untimed pass to fault in the image and warm the caches.
+    convert_frame(img, converter, input, 0);
+    auto start = Clock::now();
+    for (int i = 0; i < frames; ++i)
+        convert_frame(img, converter, input, i);
+    double ns = elapsed_ns(start, Clock::now());
+    // Only RGB 24 bit to I420 or GBR has kernels to choose from.
+    bool kernel = input.format == PIXEL_RGB24 &&
+                  (!converter.full_chroma || converter.colour->matrix == MATRIX_GBR);
+    output("convert %-20s %-6s %9.1f fps %7.3f ns/pixel\n", input.name.c_str(), kernel ? converter_name() : "packed",
+           frames * 1e9 / ns, ns / (double(frames) * input.width * input.height));
+}
+
+static void bench_encode(const BenchInput &input, int frames, vpx_image_t &img, const FrameConverter &converter,
+                         const EncoderOptions &options)
+{
+    char filename[] = "/tmp/lvsc_bench_XXXXXX.ivf";
+    int fd = mkstemps(filename, 4);
+    if (fd < 0)
+        fatal("Failed to create a temporary file for the encoder output\n");
+    close(fd);
+
+    vector<double> latencies;
+    auto start = Clock::now();
+    {
+        auto sink = open_sink(filename);
+        VideoWriter writer({sink.get()}, img.d_w, img.d_h, options);
+        for (int i = 0; i < frames; ++i)
+        {
+            convert_frame(img, converter, input, i);
+            auto encode_start = Clock::now();
+            writer.encode_frame(&img, i * FRAME_DURATION, FRAME_DURATION);
+            latencies.push_back(elapsed_ns(encode_start, Clock::now()));
+        }
+        writer.flush();
+    }
+    double ns = elapsed_ns(start, Clock::now());
+
+    struct stat info;
+    size_t bytes = stat(filename, &info) == 0 ? info.st_size : 0;
+    unlink(filename);
+
+    sort(latencies.begin(), latencies.end());
+    output("encode  %-20s %9.1f fps  latency ms p50 %.2f p90 %.2f p99 %.2f max %.2f  %zu bytes/frame\n",
+           input.name.c_str(), frames * 1e9 / ns, percentile(latencies, 0.5) / 1e6, percentile(latencies, 0.9) / 1e6,
+           percentile(latencies, 0.99) / 1e6, latencies.back() / 1e6, bytes / frames);
+}
+
+int main(int argc, char **argv)
+{
+    // Argument processing
+    vector<string> filenames;
+    string sizes = "640x480,1280x720,1920x1080,3840x2160";
+    string converter = "all";
+    int frames = 30;
+    bool encode = true;
+    int downscale = 1;
+    PixelFormat pixel_format = PIXEL_RGB24;
+    EncoderOptions encoder_options;
+
+    const string sizes_option = "--sizes";
+    const string frames_option = "--frames";
+    const string converter_option = "--converter";
+    const string no_encode_option = "--no-encode";
+    const string downscale_option = "--downscale";
+    const string pixel_format_option = "--pixel-format";
+
+    for (int i = 1; i < argc; ++i)
+    {
+        string arg = argv[i];
+        auto value = [&]() -> const char * {
+            if (i + 1 >= argc)
+                usage_exit(argv[0]);
+            return argv[++i];
+        };
+        if (encoder_options.parse_option(arg, value))
+            continue;
+        if (arg.substr(0, sizes_option.size()) == sizes_option)
+        {
+            sizes = value();
+        }
+        else if (arg.substr(0, frames_option.size()) == frames_option)
+        {
+            frames = parse_int(frames_option.c_str(), value(), 1, 100000);
+        }
+        else if (arg.substr(0, converter_option.size()) == converter_option)
+        {
+            converter = value();
+        }
+        else if (arg.substr(0, downscale_option.size()) == downscale_option)
+        {
+            downscale = parse_int(downscale_option.c_str(), value(), 1, MAX_DOWNSCALE);
+        }
+        else if (arg.substr(0, pixel_format_option.size()) == pixel_format_option)
+        {
+            string format = value();
+            if (format == "rgb24")
+                pixel_format = PIXEL_RGB24;
+            else if (format == "bgrx32")
+                pixel_format = PIXEL_BGRX32;
+            else if (format == "rgb565")
+                pixel_format = PIXEL_RGB565;
+            else
+                fatal("Unknown pixel format %s, expected rgb24, bgrx32 or rgb565\n", format.c_str());
+        }
+        else if (arg.substr(0, no_encode_option.size()) == no_encode_option)
+        {
+            encode = false;
+        }
+        else if (arg[0] == '-')
+        {
+            usage_exit(argv[0]);
+        }
+        else
+        {
+            filenames.push_back(arg);
+        }
+    }
+    encoder_options.finalize();
+
+    vector<string> converters;
+    if (converter == "all")
+    {
+        for (auto name : CONVERTER_NAMES)
+        {
+            if (select_converter(name))
+                converters.push_back(name);
+        }
+    }
+    else if (select_converter(converter.c_str()))
+    {
+        converters.push_back(converter);
+    }
+    else
+    {
+        fatal("Colour converter %s is not available on this machine\n", converter.c_str());
+    }
+
+    vector<BenchInput> inputs;
+    if (!filenames.empty())
+    {
+        inputs = recorded_inputs(filenames);
+    }
+    else
+    {
+        for (size_t start = 0; start < sizes.size();)
+        {
+            auto end = min(sizes.find(',', start), sizes.size());
+            int width, height;
+            auto size = sizes.substr(start, end - start);
+            if (sscanf(size.c_str(), "%dx%d", &width, &height) != 2 || width < 2 || height < 2 || width > 16384 || height > 16384)
+                fatal("Invalid size %s, expected WIDTHxHEIGHT\n", size.c_str());
+            inputs.push_back(synthetic_input(width, height));
+            start = end + 1;
+        }
+    }
+
+    output("%d frames per input, encoder with %d threads, cpu-used %d%s\n", frames, encoder_options.threads,
+           encoder_options.cpu_used, encoder_options.realtime ? ", realtime" : "");
+    // The planes are allocated as the recorder allocates them, and reused from one input to the next.
+    FrameBuffer planes;
+    for (auto &input : inputs)
+    {
+        int width = input.width / downscale;
+        int height = input.height / downscale;
+        if (width < 1 || height < 1)
+            fatal("%s is too small to downscale by %d\n", input.name.c_str(), downscale);
+        repack_input(input, pixel_format);
+        FrameConverter frame_converter;
+        frame_converter.select(pixel_format, encoder_options.full_chroma, encoder_options.colour(), width, downscale);
+        vpx_image_t img;
+        wrap_image(img, planes, encoder_options.image_format(), width, height);
+        for (auto &name : converters)
+        {
+            select_converter(name.c_str());
+            bench_convert(input, frames, img, frame_converter);
+            if (pixel_format != PIXEL_RGB24 || (encoder_options.full_chroma && encoder_options.matrix != MATRIX_GBR))
+                break;
+        }
+        if (encode)
+        {
+            select_converter(converter == "all" ? "auto" : converter.c_str());
+            bench_encode(input, frames, img, frame_converter, encoder_options);
+        }
+    }
+
+    return 0;
+}
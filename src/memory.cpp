@@ -0,0 +1,64 @@
+#include <cstdlib>
+#include <sys/mman.h>
+#include "memory.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+static bool HUGE_PAGES = false;
+
+void set_huge_pages(bool enabled)
+{
+    HUGE_PAGES = enabled;
+}
+
+static size_t round_up(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+void *allocate_buffer(size_t size)
+{
+    if (size < HUGE_PAGE_SIZE)
+    {
+        auto buffer = aligned_alloc(CACHE_LINE_SIZE, round_up(max(size, size_t(1)), CACHE_LINE_SIZE));
+        if (!buffer)
+            throw bad_alloc();
+        return buffer;
+    }
+
+    size = round_up(size, HUGE_PAGE_SIZE);
+    void *buffer = MAP_FAILED;
+    if (HUGE_PAGES)
+        buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (buffer == MAP_FAILED)
+    {
+        buffer = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buffer == MAP_FAILED)
+            throw bad_alloc();
+        if (HUGE_PAGES && madvise(buffer, size, MADV_HUGEPAGE) != 0)
+            debug("Transparent huge pages are not available for a buffer of %zu bytes\n", size);
+    }
+    return buffer;
+}
+
+void free_buffer(void *buffer, size_t size)
+{
+    if (!buffer)
+        return;
+    if (size < HUGE_PAGE_SIZE)
+        free(buffer);
+    else
+        munmap(buffer, round_up(size, HUGE_PAGE_SIZE));
+}
+
+void wrap_image(vpx_image_t &img, FrameBuffer &storage, vpx_img_fmt_t format, int width, int height)
+{
+    // vpx_img_wrap lays the planes out one after the other, the chroma ones of I420 at half the
+    // stride and height.
+    size_t stride = round_up(width, CACHE_LINE_SIZE * 2);
+    size_t rows = round_up(height, 2);
+    storage.resize(format == VPX_IMG_FMT_I444 ? stride * rows * 3 : stride * rows * 3 / 2);
+    if (!vpx_img_wrap(&img, format, width, height, CACHE_LINE_SIZE * 2, storage.data()))
+        fatal("Failed to set up an image of size %dx%d\n", width, height);
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+#include <vpx/vpx_image.h>
+
+// Rows and planes of frame buffers start on cache lines, which the SIMD converters rely on.
+static const size_t CACHE_LINE_SIZE = 64;
+
+// Buffers at least this large are mapped on their own and may be backed by huge pages.
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+// Backs the large buffers with huge pages from hugetlbfs if the system has them reserved, or asks
+// for transparent huge pages otherwise. Must be set before the first buffer is allocated.
+void set_huge_pages(bool enabled);
+
+// Allocates size bytes aligned to a cache line, or mapped pages for HUGE_PAGE_SIZE and above.
+void *allocate_buffer(size_t size);
+void free_buffer(void *buffer, size_t size);
+
+// Gives a vector cache aligned storage from allocate_buffer and leaves the elements uninitialised
+// when it grows, since frame buffers are always overwritten before they are read.
+template <typename T>
+struct BufferAllocator
+{
+    typedef T value_type;
+
+    T *allocate(size_t n)
+    {
+        return (T *)allocate_buffer(n * sizeof(T));
+    }
+
+    void deallocate(T *p, size_t n)
+    {
+        free_buffer(p, n * sizeof(T));
+    }
+
+    template <typename U>
+    void construct(U *p)
+    {
+        ::new ((void *)p) U;
+    }
+
+    template <typename U, typename... Args>
+    void construct(U *p, Args &&... args)
+    {
+        ::new ((void *)p) U(std::forward<Args>(args)...);
+    }
+
+    template <typename U>
+    struct rebind
+    {
+        typedef BufferAllocator<U> other;
+    };
+
+    BufferAllocator()
+    {
+    }
+
+    template <typename U>
+    BufferAllocator(const BufferAllocator<U> &o)
+    {
+    }
+
+    bool operator==(const BufferAllocator &o) const
+    {
+        return true;
+    }
+
+    bool operator!=(const BufferAllocator &o) const
+    {
+        return false;
+    }
+};
+
+// A screenshot or image buffer that is kept for as long as the resolution stays the same.
+typedef std::vector<uint8_t, BufferAllocator<uint8_t>> FrameBuffer;
+
+// Points img at planes in storage for an I420 or I444 image of the given size, with every row
+// starting on a cache line. storage only grows, so images are allocated once per resolution.
+void wrap_image(vpx_image_t &img, FrameBuffer &storage, vpx_img_fmt_t format, int width, int height);
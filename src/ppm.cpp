@@ -0,0 +1,64 @@
+#include <cstring>
+#include "ppm.hpp"
+
+static bool is_space(uint8_t c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+// Reads the next decimal field, skipping whitespace and comments before it.
+static bool read_field(const uint8_t *buffer, size_t size, size_t &pos, int &value)
+{
+    while (pos < size && (is_space(buffer[pos]) || buffer[pos] == '#'))
+    {
+        if (buffer[pos] == '#')
+        {
+            while (pos < size && buffer[pos] != '\n')
+                ++pos;
+        }
+        else
+        {
+            ++pos;
+        }
+    }
+
+    long result = 0;
+    size_t start = pos;
+    while (pos < size && buffer[pos] >= '0' && buffer[pos] <= '9' && pos - start < 9)
+        result = result * 10 + (buffer[pos++] - '0');
+    value = result;
+    return pos > start && pos < size;
+}
+
+bool parse_ppm_header(const uint8_t *buffer, size_t size, PPMHeader &header)
+{
+    if (size < 2 || buffer[0] != 'P' || buffer[1] != '6')
+        return false;
+
+    size_t pos = 2;
+    if (!read_field(buffer, size, pos, header.width) || !read_field(buffer, size, pos, header.height) ||
+        !read_field(buffer, size, pos, header.maxval))
+        return false;
+
+    // Exactly one whitespace character separates the header from the pixels.
+    if (!is_space(buffer[pos]))
+        return false;
+    header.header_size = pos + 1;
+    return header.width > 0 && header.height > 0 && header.maxval == 255;
+}
+
+const PPMHeader *PPMHeaderCache::parse(const uint8_t *buffer, size_t size, bool &changed)
+{
+    changed = false;
+    if (valid && size >= header.header_size && memcmp(buffer, bytes, header.header_size) == 0)
+        return &header;
+
+    PPMHeader parsed;
+    if (!parse_ppm_header(buffer, size < MAX_HEADER_SIZE ? size : MAX_HEADER_SIZE, parsed))
+        return nullptr;
+    changed = !valid || parsed.width != header.width || parsed.height != header.height;
+    header = parsed;
+    memcpy(bytes, buffer, header.header_size);
+    valid = true;
+    return &header;
+}
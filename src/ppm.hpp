@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// The geometry of a binary (P6) PPM screenshot. The pixels follow the header as packed RGB 24 bit.
+struct PPMHeader
+{
+    int width;
+    int height;
+    int maxval;
+    size_t header_size;
+
+    size_t pixels_size() const
+    {
+        return size_t(width) * height * 3;
+    }
+
+    size_t frame_size() const
+    {
+        return header_size + pixels_size();
+    }
+};
+
+// Parses the header at the start of buffer. Returns false if it is incomplete or not an 8 bit P6.
+bool parse_ppm_header(const uint8_t *buffer, size_t size, PPMHeader &header);
+
+// Screenshots of the same resolution carry byte for byte the same header, so it is only parsed
+// again when those bytes change.
+struct PPMHeaderCache
+{
+    static const size_t MAX_HEADER_SIZE = 64;
+
+    PPMHeader header;
+    uint8_t bytes[MAX_HEADER_SIZE];
+    bool valid;
+
+    // Returns the header of buffer, or null if it has none. changed is set when it differs from
+    // the previous one.
+    const PPMHeader *parse(const uint8_t *buffer, size_t size, bool &changed);
+
+    PPMHeaderCache() : header(PPMHeader()), valid(false)
+    {
+    }
+};
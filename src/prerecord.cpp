@@ -0,0 +1,143 @@
+#include <ctime>
+#include "prerecord.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+// Writes packets to a new file named after the current time, starting the recording at zero. The
+// container is told whenever the stream changes size from one group to the next.
+static void write_dump(const string &name, const SinkOptions &sink_options, const vector<PacketRing::Group> &groups,
+                       const vector<RingPacket> &packets, int64_t end_pts, const string &reason)
+{
+    auto &info = *groups.front().info;
+    char time_text[32];
+    time_t now = time(nullptr);
+    tm local;
+    strftime(time_text, sizeof(time_text), "%Y%m%d-%H%M%S", localtime_r(&now, &local));
+    auto file = fill_name(name, "{time}", time_text);
+    auto origin = packets.front().pts;
+    output("Saving the last %.1f seconds to %s %s\n",
+           double(end_pts - origin) * info.timebase_num / info.timebase_den, file.c_str(), reason.c_str());
+
+    auto sink = open_sink(file, sink_options);
+    auto container = open_container_writer(sink.get(), info);
+    bool written = true;
+    size_t next = 0;
+    for (size_t i = 0; i < groups.size() && written; ++i)
+    {
+        if (i > 0 && groups[i].info != groups[i - 1].info)
+            container->resize(*groups[i].info);
+        for (size_t end = next + groups[i].packets; next < end && written; ++next)
+        {
+            auto &packet = packets[next];
+            written = container->write_frame(packet.data->data(), packet.data->size(), packet.pts - origin,
+                                             packet.duration, packet.keyframe);
+        }
+    }
+    if (!written)
+        output("Failed to write %s\n", file.c_str());
+    container->extend(end_pts - origin);
+    container->finish();
+}
+
+void PacketRing::start(const StreamInfo &info)
+{
+    lock_guard<mutex> guard(lock);
+    this->info = make_shared<const StreamInfo>(info);
+}
+
+void PacketRing::add(const uint8_t *data, size_t size, int64_t pts, int64_t duration, bool keyframe)
+{
+    lock_guard<mutex> guard(lock);
+    // Frames before the first keyframe could not be decoded from a dump.
+    if (!info || (!keyframe && groups.empty()))
+        return;
+    shared_ptr<vector<uint8_t>> buffer;
+    if (!spare.empty())
+    {
+        buffer = move(spare.back());
+        spare.pop_back();
+    }
+    else
+    {
+        buffer = make_shared<vector<uint8_t>>();
+    }
+    buffer->assign(data, data + size);
+    packets.push_back(RingPacket{move(buffer), pts, duration, keyframe});
+    if (keyframe)
+        groups.push_back(Group{0, 0, pts, info});
+    ++groups.back().packets;
+    groups.back().bytes += size;
+    bytes += size;
+    end_pts = max(end_pts, pts + duration);
+    trim();
+}
+
+void PacketRing::extend(int64_t end_pts)
+{
+    lock_guard<mutex> guard(lock);
+    this->end_pts = max(this->end_pts, end_pts);
+}
+
+void PacketRing::trim()
+{
+    while (groups.size() > 1 && ((max_bytes > 0 && bytes > max_bytes) ||
+                                 (max_duration > 0 && end_pts - groups[1].pts >= max_duration)))
+    {
+        for (size_t i = 0; i < groups.front().packets; ++i)
+        {
+            // A dump that is still being written holds on to its packets.
+            if (packets.front().data.use_count() == 1)
+                spare.push_back(move(packets.front().data));
+            packets.pop_front();
+        }
+        bytes -= groups.front().bytes;
+        groups.pop_front();
+    }
+}
+
+bool PacketRing::dump(const string &reason)
+{
+    if (dumping.exchange(true))
+    {
+        debug("Not saving the recording %s, a dump is already being written\n", reason.c_str());
+        return false;
+    }
+    vector<RingPacket> snapshot;
+    vector<Group> snapshot_groups;
+    int64_t snapshot_end;
+    {
+        lock_guard<mutex> guard(lock);
+        snapshot.assign(packets.begin(), packets.end());
+        snapshot_groups.assign(groups.begin(), groups.end());
+        snapshot_end = end_pts;
+    }
+    if (snapshot.empty())
+    {
+        debug("Not saving the recording %s, nothing has been encoded yet\n", reason.c_str());
+        dumping = false;
+        return false;
+    }
+    if (dumper.joinable())
+        dumper.join();
+    dumper = thread([this, snapshot = move(snapshot), snapshot_groups = move(snapshot_groups), snapshot_end,
+                     reason]() {
+        write_dump(name, sink_options, snapshot_groups, snapshot, snapshot_end, reason);
+        dumping = false;
+    });
+    return true;
+}
+
+PacketRing::PacketRing(const string &name, const SinkOptions &sink_options, int64_t max_duration, size_t max_bytes)
+    : name(name), sink_options(sink_options), max_duration(max_duration), max_bytes(max_bytes), bytes(0), end_pts(0), dumping(false)
+{
+    // A dump is a single file however the recording would be split.
+    this->sink_options.segment_seconds = 0;
+    this->sink_options.segment_bytes = 0;
+}
+
+PacketRing::~PacketRing()
+{
+    if (dumper.joinable())
+        dumper.join();
+}
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "container.hpp"
+#include "sink.hpp"
+
+// An encoded frame held by a PacketRing. Dumps share the bytes with the ring, which reuses them
+// once nothing else holds them.
+struct RingPacket
+{
+    std::shared_ptr<std::vector<uint8_t>> data;
+    int64_t pts;
+    int64_t duration;
+    bool keyframe;
+};
+
+// Keeps the last stretch of a recording in memory instead of on disk, in whole groups of pictures
+// that each start on a keyframe, and writes it to a file when something goes wrong. The oldest
+// group is dropped once the rest cover max_duration, in pts units, or hold more than max_bytes,
+// where 0 is no limit, but the group being written is always kept. Packets go in from the encoder
+// and dumps can be asked for from any thread.
+struct PacketRing
+{
+    // A file name with {time} for the time of the dump, or where it goes before the extension.
+    std::string name;
+    SinkOptions sink_options;
+    int64_t max_duration;
+    size_t max_bytes;
+
+    std::mutex lock;
+    // What the groups from the next keyframe on are encoded as, null until the stream is opened.
+    std::shared_ptr<const StreamInfo> info;
+    std::deque<RingPacket> packets;
+    // The number of packets and bytes in each group, oldest first, where each starts and the
+    // stream it belongs to.
+    struct Group
+    {
+        size_t packets;
+        size_t bytes;
+        int64_t pts;
+        std::shared_ptr<const StreamInfo> info;
+    };
+    std::deque<Group> groups;
+    size_t bytes;
+    int64_t end_pts;
+    std::vector<std::shared_ptr<std::vector<uint8_t>>> spare;
+
+    std::thread dumper;
+    std::atomic<bool> dumping;
+
+    // Called when the stream is opened, with what a container needs to know about it, and again
+    // whenever it changes size. The change takes effect at the next keyframe.
+    void start(const StreamInfo &info);
+
+    void add(const uint8_t *data, size_t size, int64_t pts, int64_t duration, bool keyframe);
+
+    // Stretches the last frame so that it is shown until end_pts.
+    void extend(int64_t end_pts);
+
+    // Starts writing what the ring holds to a new file, on a thread of its own, saying it was
+    // because of reason. Returns false if there is nothing to write or a dump is already running.
+    bool dump(const std::string &reason);
+
+    PacketRing(const std::string &name, const SinkOptions &sink_options, int64_t max_duration, size_t max_bytes);
+    ~PacketRing();
+
+    PacketRing(const PacketRing &o) = delete;
+
+private:
+    void trim();
+};
@@ -0,0 +1,445 @@
+#include "convert.hpp"
+#include "recorder.hpp"
+#include "shutdown.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+// Bands are at least this many rows, fewer would cost more to schedule than they save.
+static const int MIN_BAND_ROWS = 32;
+
+static uint64_t elapsed_ns(FrameScheduler::Clock::time_point start)
+{
+    return chrono::duration_cast<chrono::nanoseconds>(FrameScheduler::Clock::now() - start).count();
+}
+
+void update_image(vpx_image_t &img, const uint8_t *buffer)
+{
+    TRACE_SCOPE(convert, 0, 0, img.d_w, img.d_h);
+    debug("Updating image\n");
+    convert_rgb24_to_i420(buffer, img.d_w * 3, img.d_w, img.d_h, img.planes, img.stride,
+                          colour_transform(MATRIX_BT601, false));
+}
+
+void update_image(vpx_image_t &img, const FrameConverter &converter, const uint8_t *buffer, size_t stride, int x, int y,
+                  int width, int height)
+{
+    TRACE_SCOPE(convert, x, y, width, height);
+    int cx = x >> img.x_chroma_shift;
+    int cy = y >> img.y_chroma_shift;
+    uint8_t *planes[3] = {img.planes[0] + y * img.stride[0] + x, img.planes[1] + cy * img.stride[1] + cx,
+                          img.planes[2] + cy * img.stride[2] + cx};
+    int factor = converter.factor;
+    converter.convert(buffer + y * factor * stride + x * factor * pixel_size(converter.format), stride, width * factor,
+                      height * factor, planes, img.stride);
+}
+
+bool CaptureArea::clip(int screen_width, int screen_height, CaptureArea &clipped) const
+{
+    clipped = *this;
+    if (width == 0 || height == 0)
+    {
+        clipped.x = clipped.y = 0;
+        clipped.width = screen_width;
+        clipped.height = screen_height;
+    }
+    clipped.width = min(clipped.width, screen_width - clipped.x);
+    clipped.height = min(clipped.height, screen_height - clipped.y);
+    return clipped.width >= downscale && clipped.height >= downscale;
+}
+
+bool CaptureArea::image_part(const DirtyRect &rect, DirtyRect &part) const
+{
+    int image_width = width / downscale;
+    int image_height = height / downscale;
+    int left = (max(rect.x, 0) / downscale) & ~1;
+    int top = (max(rect.y, 0) / downscale) & ~1;
+    int right = min(image_width, ((min(rect.x + rect.width, width) + downscale - 1) / downscale + 1) & ~1);
+    int bottom = min(image_height, ((min(rect.y + rect.height, height) + downscale - 1) / downscale + 1) & ~1);
+    part = DirtyRect{left, top, right - left, bottom - top};
+    return left < right && top < bottom;
+}
+
+void Recorder::capture()
+{
+    FrameSlot *slot;
+    // A frame that was never converted leaves what it changed to this one.
+    bool keep_damage = false;
+    if (!free_slots.try_pop(slot))
+    {
+        if (captured_slots.try_pop(slot))
+        {
+            keep_damage = slot->damage_known;
+        }
+        else
+        {
+            if (!converted_slots.try_pop(slot))
+            {
+                busy = false;
+                return;
+            }
+            // The damage tracker has already moved past a converted frame, so the next one is
+            // encoded even if it matches, or what this one changed would not show until the screen
+            // changed again.
+            if (!slot->repeat)
+                resync = true;
+        }
+        ++stats.frames_dropped;
+    }
+
+    capture_started = FrameScheduler::Clock::now();
+    slot->pts = scheduler.claim(capture_started);
+    stats.frames_late = scheduler.frames_late;
+    if (!keep_damage)
+        slot->damage.clear();
+    slot->damage_known = vnc != nullptr;
+    slot->layout_known = vnc != nullptr;
+    if (vnc)
+    {
+        auto size = vnc->take_frame(slot->data, slot->damage, slot->layout);
+        if (size < 0 && !stop_requested())
+        {
+            output("Lost the VNC connection to %s, reconnecting\n", name.c_str());
+            open_vnc();
+        }
+        captured(slot, size);
+        return;
+    }
+    if (!options.async_capture)
+    {
+        // A stop that came in since the capture loop looked would not abort this screenshot.
+        if (stop_requested())
+        {
+            captured(slot, -1);
+            return;
+        }
+        captured(slot, take_screenshot(domain, stream, slot->data, last_screenshot_size));
+        return;
+    }
+
+    pending.buffer = &slot->data;
+    pending_slot = slot;
+    if (!begin_screenshot(*connection, domain, pending))
+        captured(slot, -1);
+}
+
+void Recorder::abort_capture()
+{
+    if (busy && !options.async_capture)
+        virStreamAbort(stream.get());
+}
+
+void Recorder::open_vnc()
+{
+    vnc = make_unique<VncClient>();
+    auto error = vnc->open(domain);
+    if (!error.empty())
+    {
+        output("Cannot capture %s over VNC, %s. Taking screenshots instead\n", name.c_str(), error.c_str());
+        vnc.reset();
+    }
+}
+
+void Recorder::captured(FrameSlot *slot, ssize_t size)
+{
+    if (size < 0)
+    {
+        free_slots.push(slot);
+    }
+    else
+    {
+        stats.screenshot_ns.record(elapsed_ns(capture_started));
+        stats.screenshot_bytes += size;
+        ++stats.frames_captured;
+        slot->size = size;
+        captured_slots.push(slot);
+        stats.captured_depth = captured_slots.size();
+        convert_strand.kick();
+    }
+    busy = false;
+}
+
+void Recorder::convert(FrameSlot *slot)
+{
+    auto start = FrameScheduler::Clock::now();
+    FrameLayout layout = slot->layout;
+    if (!slot->layout_known)
+    {
+        bool changed;
+        auto header = headers.parse(slot->data.data(), slot->size, changed);
+        if (!header || slot->size < header->frame_size())
+        {
+            debug("Dropping malformed or truncated screenshot of %zu bytes from %s\n", slot->size, name.c_str());
+            free_slots.push(slot);
+            return;
+        }
+        if (changed)
+            debug("Screenshots of %s are %dx%d\n", name.c_str(), header->width, header->height);
+        layout = FrameLayout{header->width, header->height, header->header_size, size_t(header->width) * 3, PIXEL_RGB24};
+    }
+    if (spool)
+    {
+        spool_frame(slot, layout);
+        return;
+    }
+
+    // Only the pixels inside the area are hashed and converted.
+    CaptureArea area;
+    if (!options.area.clip(layout.width, layout.height, area))
+    {
+        debug("Dropping screenshot of %s, %dx%d leaves nothing to record\n", name.c_str(), layout.width, layout.height);
+        free_slots.push(slot);
+        return;
+    }
+    int factor = area.downscale;
+    int pwidth = area.width / factor;
+    int pheight = area.height / factor;
+    size_t stride = layout.stride;
+    int bytes_per_pixel = pixel_size(layout.format);
+    auto pixels = slot->data.data() + layout.offset + area.y * stride + area.x * bytes_per_pixel;
+    converter.select(layout.format, options.encoder.full_chroma, options.encoder.colour(), pwidth, factor);
+
+    slot->repeat = false;
+    slot->scene_change = false;
+    bool resync_now = resync.exchange(false);
+    size_t changed_tiles = 0;
+    if (options.damage_tracking && slot->damage_known)
+        changed_tiles = damage.mark(slot->damage, area.x, area.y, pwidth * factor, pheight * factor);
+    else if (options.damage_tracking)
+        changed_tiles = damage.update(pixels, stride, bytes_per_pixel, pwidth * factor, pheight * factor);
+    if (options.damage_tracking && options.scene_change > 0)
+    {
+        // Only the first of a run of such frames counts, so that continuous motion such as video
+        // is left to the keyframe interval.
+        bool changed_most = changed_tiles * 100 >= size_t(options.scene_change) * damage.columns * damage.rows;
+        slot->scene_change = changed_most && !last_changed_most;
+        last_changed_most = changed_most;
+    }
+    if (options.damage_tracking && changed_tiles == 0 && !resync_now)
+    {
+        ++stats.frames_unchanged;
+        slot->repeat = true;
+    }
+    else
+    {
+        if (!slot->img_allocated || int(slot->img.d_w) != pwidth || int(slot->img.d_h) != pheight)
+        {
+            wrap_image(slot->img, slot->planes, options.encoder.image_format(), pwidth, pheight);
+            slot->img_allocated = true;
+            slot->converted_serial = 0;
+        }
+
+        convert_parts.clear();
+        if (options.damage_tracking)
+        {
+            // Map each run of changed tiles onto the blocks of the image it touches.
+            damage.for_each_dirty_run(slot->converted_serial, [&](int x, int y, int w, int h) {
+                DirtyRect part;
+                if (area.image_part(DirtyRect{x, y, w, h}, part))
+                    convert_parts.push_back(part);
+            });
+            slot->converted_serial = damage.serial;
+        }
+        else
+        {
+            convert_parts.push_back(DirtyRect{0, 0, pwidth, pheight});
+        }
+        convert_parts_in_bands(slot, pixels, stride);
+    }
+    stats.convert_ns.record(elapsed_ns(start));
+    converted_slots.push(slot);
+    stats.converted_depth = converted_slots.size();
+    encode_strand.kick();
+}
+
+// One frame being converted in bands, for the pool to run.
+struct BandConversion
+{
+    Recorder *recorder;
+    FrameSlot *slot;
+    const uint8_t *pixels;
+    size_t stride;
+    int band_rows;
+
+    // Converts the rows of every part that fall in the band, which covers whole chroma rows as
+    // bands start on even rows.
+    static void run(void *arg, size_t index)
+    {
+        auto conversion = (BandConversion *)arg;
+        int top = conversion->recorder->dirty_bands[index] * conversion->band_rows;
+        int bottom = top + conversion->band_rows;
+        for (auto &part : conversion->recorder->convert_parts)
+        {
+            int first = max(part.y, top);
+            int last = min(part.y + part.height, bottom);
+            if (first < last)
+                update_image(conversion->slot->img, conversion->recorder->converter, conversion->pixels,
+                             conversion->stride, part.x, first, part.width, last - first);
+        }
+    }
+};
+
+void Recorder::convert_parts_in_bands(FrameSlot *slot, const uint8_t *pixels, size_t stride)
+{
+    int height = slot->img.d_h;
+    int bands = options.convert_bands > 0 ? options.convert_bands : int(pool->size());
+    int band_rows = max(MIN_BAND_ROWS, ((height + bands - 1) / bands + 1) & ~1);
+    dirty_bands.clear();
+    for (int band = 0; band * band_rows < height; ++band)
+    {
+        for (auto &part : convert_parts)
+        {
+            if (part.y < (band + 1) * band_rows && part.y + part.height > band * band_rows)
+            {
+                dirty_bands.push_back(band);
+                break;
+            }
+        }
+    }
+    BandConversion conversion = {this, slot, pixels, stride, band_rows};
+    pool->parallel_for(dirty_bands.size(), BandConversion::run, &conversion);
+}
+
+void Recorder::encode(FrameSlot *slot)
+{
+    // Once the recording has run out of time to stop, the frames still queued are left out.
+    if (past_stop_deadline())
+    {
+        ++stats.frames_dropped;
+    }
+    else if (slot->repeat)
+    {
+        if (video_stream)
+        {
+            video_stream->extend(slot->pts + scheduler.frame_duration());
+            if (video_stream->keyframe_wanted())
+                resync = true;
+        }
+    }
+    else
+    {
+        if (!video_stream)
+        {
+            vector<Sink *> sinks;
+            for (auto &output : outputs)
+                sinks.push_back(output.get());
+            video_stream = make_unique<VideoWriter>(sinks, slot->img.d_w, slot->img.d_h, options.encoder);
+            video_stream->packet_sizes = &stats.packet_bytes;
+            if (ring)
+            {
+                video_stream->ring = ring.get();
+                ring->start(video_stream->info);
+            }
+        }
+        else if (int(slot->img.d_w) != video_stream->width || int(slot->img.d_h) != video_stream->height)
+        {
+            video_stream->resize(slot->img.d_w, slot->img.d_h);
+        }
+        if (slot->scene_change)
+            video_stream->scene_change();
+        auto start = FrameScheduler::Clock::now();
+        video_stream->encode_frame(&slot->img, slot->pts, scheduler.frame_duration());
+        stats.encode_ns.record(elapsed_ns(start));
+    }
+    free_slots.push(slot);
+}
+
+void Recorder::spool_frame(FrameSlot *slot, const FrameLayout &layout)
+{
+    auto start = FrameScheduler::Clock::now();
+    auto pixels = slot->data.data() + layout.offset;
+    int64_t duration = scheduler.frame_duration();
+    bool resized = layout.width != spool->width || layout.height != spool->height || layout.format != spool->format;
+    size_t changed_tiles = 0;
+    if (options.damage_tracking && slot->damage_known)
+        changed_tiles = damage.mark(slot->damage, 0, 0, layout.width, layout.height);
+    else if (options.damage_tracking)
+        changed_tiles = damage.update(pixels, layout.stride, pixel_size(layout.format), layout.width, layout.height);
+
+    // The encode splits the spool at full frames, so there is one at least every keyframe interval
+    // even when keyframes are only made on request, and one at every scene change.
+    int interval = options.encoder.keyframe_interval > 0 ? options.encoder.keyframe_interval : DEFAULT_KEYFRAME_INTERVAL;
+    bool scene_change = false;
+    if (options.damage_tracking && options.scene_change > 0)
+    {
+        bool changed_most = changed_tiles * 100 >= size_t(options.scene_change) * damage.columns * damage.rows;
+        scene_change = changed_most && !last_changed_most && spool->frames_since_full >= MIN_SCENE_CHANGE_DISTANCE;
+        last_changed_most = changed_most;
+    }
+    if (options.damage_tracking && changed_tiles == 0 && !resized)
+    {
+        ++stats.frames_unchanged;
+        spool->write_repeat(slot->pts, duration);
+    }
+    else if (!options.damage_tracking || resized || scene_change || spool->frames_since_full >= interval)
+    {
+        spool->write_full(pixels, layout, slot->pts, duration);
+    }
+    else
+    {
+        convert_parts.clear();
+        damage.for_each_dirty_run(spooled_serial,
+                                  [&](int x, int y, int w, int h) { convert_parts.push_back(DirtyRect{x, y, w, h}); });
+        spool->write_delta(pixels, layout, convert_parts, slot->pts, duration);
+    }
+    spooled_serial = damage.serial;
+    stats.convert_ns.record(elapsed_ns(start));
+    free_slots.push(slot);
+}
+
+void Recorder::finish()
+{
+    if (spool)
+        spool->finish(scheduler.pts_at(FrameScheduler::Clock::now()));
+    if (!video_stream)
+        return;
+    video_stream->extend(scheduler.pts_at(FrameScheduler::Clock::now()));
+    video_stream->flush(stop_deadline());
+}
+
+Recorder::Recorder(ThreadPool &pool, Connection &connection, const string &name, const vector<string> &outputs,
+                   const RecorderOptions &options)
+    : name(name), options(options), pool(&pool),
+      connection(&connection), domain(get_domain(connection, name)), stream(new_stream(connection)), last_screenshot_size(0),
+      busy(false), pending(PendingScreenshot()), pending_slot(nullptr), scheduler(options.fps),
+      free_slots(PIPELINE_SLOTS), captured_slots(PIPELINE_SLOTS), converted_slots(PIPELINE_SLOTS),
+      convert_strand(&pool, &captured_slots, [](void *r, FrameSlot *slot) { ((Recorder *)r)->convert(slot); }, this),
+      encode_strand(&pool, &converted_slots, [](void *r, FrameSlot *slot) { ((Recorder *)r)->encode(slot); }, this),
+      spooled_serial(0), resync(false), last_changed_most(false)
+{
+    if (options.spool)
+    {
+        spool = make_unique<SpoolWriter>(outputs.front());
+    }
+    else if (options.prerecord_seconds > 0 || options.prerecord_bytes > 0)
+    {
+        // The output file is only written by dumps, the live outputs are served as usual.
+        int64_t duration = int64_t(options.prerecord_seconds) * TIMEBASE_DENOMINATOR / TIMEBASE_NUMERATOR;
+        ring = make_unique<PacketRing>(outputs.front(), options.sink, duration, options.prerecord_bytes);
+        watch = make_unique<DomainWatch>(connection, domain, [](void *r, const char *what) {
+            auto recorder = (Recorder *)r;
+            recorder->ring->dump("because " + recorder->name + " " + what);
+        }, this);
+        for (size_t i = 1; i < outputs.size(); ++i)
+            this->outputs.push_back(open_sink(outputs[i], options.sink));
+    }
+    else
+    {
+        for (auto &output : outputs)
+            this->outputs.push_back(open_sink(output, options.sink));
+    }
+    if (options.vnc)
+        open_vnc();
+    pending.last_size = &last_screenshot_size;
+    pending.done = [](void *r, ssize_t size) {
+        auto recorder = (Recorder *)r;
+        recorder->captured(recorder->pending_slot, size);
+    };
+    pending.context = this;
+    for (int i = 0; i < PIPELINE_SLOTS; ++i)
+    {
+        slots.push_back(make_unique<FrameSlot>());
+        free_slots.push(slots.back().get());
+    }
+}
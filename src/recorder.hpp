@@ -0,0 +1,194 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+#include "capture.hpp"
+#include "convert.hpp"
+#include "damage.hpp"
+#include "memory.hpp"
+#include "ppm.hpp"
+#include "prerecord.hpp"
+#include "ring_buffer.hpp"
+#include "scheduler.hpp"
+#include "sink.hpp"
+#include "spool.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+#include "video_writer.hpp"
+#include "vnc.hpp"
+
+// Number of frame slots cycling through the capture, conversion and encoding stages of a domain.
+static const int PIPELINE_SLOTS = 4;
+
+// Converts a packed RGB 24 bit buffer into the planes of an I420 image of the same size.
+void update_image(vpx_image_t &img, const uint8_t *buffer);
+
+// Converts only the region of img at x, y, which must start on an even row and column, from a
+// buffer with rows stride bytes apart that converter shrinks to the size of img.
+void update_image(vpx_image_t &img, const FrameConverter &converter, const uint8_t *buffer, size_t stride, int x, int y,
+                  int width, int height);
+
+// The part of each screenshot that is recorded and how much it is shrunk by. An empty crop takes
+// the whole screenshot, and one reaching past its edges is cut to fit.
+struct CaptureArea
+{
+    int x;
+    int y;
+    int width;
+    int height;
+    int downscale;
+
+    // Cuts the crop down to a screenshot of the given size. Returns false if nothing is left.
+    bool clip(int screen_width, int screen_height, CaptureArea &clipped) const;
+
+    // The part of the shrunk image that a rectangle of the clipped area covers, widened to even
+    // rows and columns so that it holds whole chroma blocks. Returns false if it covers nothing.
+    bool image_part(const DirtyRect &rect, DirtyRect &part) const;
+
+    CaptureArea() : x(0), y(0), width(0), height(0), downscale(1)
+    {
+    }
+};
+
+// How a domain is recorded.
+struct RecorderOptions
+{
+    EncoderOptions encoder;
+    bool damage_tracking;
+    int fps;
+    // Screenshots arrive on the event loop instead of the capture thread.
+    bool async_capture;
+    // Frames come from the domain's VNC display instead of screenshots, when libvirt can hand it
+    // out.
+    bool vnc;
+    CaptureArea area;
+    SinkOptions sink;
+    // A frame with at least this percentage of its tiles changed is a scene change and starts with
+    // a keyframe; 0 turns this off. Needs damage tracking.
+    int scene_change;
+    // Conversion is split into this many horizontal bands that run on the pool at once, 0 for one
+    // per worker.
+    int convert_bands;
+    // Whole screenshots are written to a spool, for `lvsc encode`, instead of being converted and
+    // encoded. Only what changed is kept of each, and a full one every keyframe interval.
+    bool spool;
+    // When either is set the recording is kept in memory, for at most this many seconds and bytes,
+    // and only written to the output file when something goes wrong.
+    int prerecord_seconds;
+    long prerecord_bytes;
+};
+
+// A slot carries one frame through the pipeline: the raw PPM screenshot filled in by the capture
+// stage, or pixels in another layout, and the I420 or I444 image the conversion stage produces from
+// it for the encoding stage. Both buffers are allocated once per resolution and recycled, so a
+// recording at a steady resolution allocates nothing per frame. The image is kept between uses and
+// holds the frame with serial converted_serial, so only the tiles that changed since then need
+// converting. A repeat is a frame identical to the one before it and a scene change one that
+// differs from it almost everywhere, after one that did not.
+struct FrameSlot
+{
+    FrameBuffer data;
+    size_t size;
+    FrameBuffer planes;
+    vpx_image_t img;
+    bool img_allocated;
+    uint64_t converted_serial;
+    int64_t pts;
+    bool repeat;
+    bool scene_change;
+    // What changed since the previous frame, when the capture reports it.
+    std::vector<DirtyRect> damage;
+    bool damage_known;
+    // Where the pixels are, when the capture says so instead of sending a PPM.
+    FrameLayout layout;
+    bool layout_known;
+
+    FrameSlot() : size(0), img(vpx_image_t()), img_allocated(false), converted_serial(0), pts(0), repeat(false), scene_change(false), damage_known(false), layout(FrameLayout()), layout_known(false)
+    {
+    }
+
+    FrameSlot(const FrameSlot &o) = delete;
+};
+
+// Records one domain into its own file, and to any live outputs. Capture threads call capture()
+// whenever the scheduler says a screenshot is due, while the conversion and encoding of the frames
+// run on the shared pool as two strands, so each stage sees the domain's frames in order and a
+// domain never holds more than one worker per stage.
+struct Recorder
+{
+    std::string name;
+    // Opened up front, so viewers can connect before the first frame, and written by video_stream.
+    std::vector<std::unique_ptr<Sink>> outputs;
+    RecorderOptions options;
+    ThreadPool *pool;
+    Connection *connection;
+    Domain domain;
+    Stream stream;
+    size_t last_screenshot_size;
+    // Set by the capture thread working on this domain, until its screenshot has arrived.
+    std::atomic<bool> busy;
+    PendingScreenshot pending;
+    FrameSlot *pending_slot;
+    // Set when frames come over VNC.
+    std::unique_ptr<VncClient> vnc;
+    FrameScheduler scheduler;
+
+    std::vector<std::unique_ptr<FrameSlot>> slots;
+    RingBuffer<FrameSlot *> free_slots;
+    RingBuffer<FrameSlot *> captured_slots;
+    RingBuffer<FrameSlot *> converted_slots;
+    Strand<FrameSlot *> convert_strand;
+    Strand<FrameSlot *> encode_strand;
+
+    PPMHeaderCache headers;
+    FrameConverter converter;
+    DamageTracker damage;
+    // The parts of the image that the frame being converted changes, and the bands they touch.
+    std::vector<DirtyRect> convert_parts;
+    std::vector<int> dirty_bands;
+    std::unique_ptr<VideoWriter> video_stream;
+    // Set instead of video_stream when spooling, with the damage serial of the last frame spooled.
+    std::unique_ptr<SpoolWriter> spool;
+    uint64_t spooled_serial;
+    // Set when pre-recording, along with the watch on the domain that dumps it.
+    std::unique_ptr<PacketRing> ring;
+    std::unique_ptr<DomainWatch> watch;
+    // Set when a viewer is waiting to join while the screen is not changing, or when a converted
+    // frame was dropped before it was encoded, so that the next screenshot is encoded even if it is
+    // unchanged.
+    std::atomic<bool> resync;
+    // Whether the last screenshot converted was mostly changed.
+    bool last_changed_most;
+    PipelineStats stats;
+    FrameScheduler::Clock::time_point capture_started;
+
+    // Takes one screenshot and queues it for conversion, then clears busy. It never waits on the
+    // encoder: if every slot is busy, it reuses the oldest frame still queued. With async capture
+    // it returns once the screenshot is requested and the rest happens on the event loop.
+    void capture();
+    void captured(FrameSlot *slot, ssize_t size);
+    // Makes a capture thread waiting on libvirt for a screenshot give up on it, once the recording
+    // is stopped. Screenshots received on the event loop are left to finish there.
+    void abort_capture();
+    // Connects to the domain's VNC display, or leaves vnc unset so that screenshots are taken.
+    void open_vnc();
+
+    void convert(FrameSlot *slot);
+    // Converts convert_parts of the screenshot pixels into the slot's image, only scheduling the
+    // bands that have parts in them.
+    void convert_parts_in_bands(FrameSlot *slot, const uint8_t *pixels, size_t stride);
+    void encode(FrameSlot *slot);
+    // Writes the screenshot to the spool instead of converting it, and gives the slot back.
+    void spool_frame(FrameSlot *slot, const FrameLayout &layout);
+
+    // Shows the last frame until now, drains the encoder and completes the file, once nothing is
+    // left in the pipeline. Draining stops at the stop deadline.
+    void finish();
+
+    Recorder(ThreadPool &pool, Connection &connection, const std::string &name, const std::vector<std::string> &outputs,
+             const RecorderOptions &options);
+
+    Recorder(const Recorder &o) = delete;
+};
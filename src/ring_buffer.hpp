@@ -0,0 +1,79 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+// A bounded FIFO used to hand frame slots from one pipeline stage to the next. Pushing never blocks
+// on a full ring, instead it fails so that the producer can decide what to drop. Closing the ring
+// wakes every waiter, after which pops keep draining what is left before reporting failure.
+template <typename T>
+struct RingBuffer
+{
+    std::vector<T> items;
+    size_t head;
+    size_t count;
+    bool closed;
+    std::mutex lock;
+    std::condition_variable not_empty;
+
+    bool push(T item)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (closed || count == items.size())
+                return false;
+            items[(head + count) % items.size()] = item;
+            ++count;
+        }
+        not_empty.notify_one();
+        return true;
+    }
+
+    // Blocks until an item is available or the ring is closed and empty.
+    bool pop(T &item)
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        not_empty.wait(guard, [&] { return count > 0 || closed; });
+        return take(item);
+    }
+
+    bool try_pop(T &item)
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return take(item);
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            closed = true;
+        }
+        not_empty.notify_all();
+    }
+
+    size_t size()
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        return count;
+    }
+
+    explicit RingBuffer(size_t capacity) : items(capacity), head(0), count(0), closed(false)
+    {
+    }
+
+    RingBuffer(const RingBuffer &o) = delete;
+
+private:
+    bool take(T &item)
+    {
+        if (count == 0)
+            return false;
+        item = items[head];
+        head = (head + 1) % items.size();
+        --count;
+        return true;
+    }
+};
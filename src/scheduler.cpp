@@ -0,0 +1,31 @@
+#include <algorithm>
+#include "scheduler.hpp"
+
+using namespace std;
+
+int64_t FrameScheduler::frame_duration() const
+{
+    return max<int64_t>(1, chrono::duration_cast<chrono::milliseconds>(interval).count());
+}
+
+int64_t FrameScheduler::claim(Clock::time_point now)
+{
+    int64_t tick = max<int64_t>(next_tick, (now - start) / interval);
+    frames_late += tick - next_tick;
+    next_tick = tick + 1;
+
+    // Timestamps must keep increasing even if two captures land in the same millisecond.
+    last_pts = max(last_pts + 1, pts_at(now));
+    return last_pts;
+}
+
+int64_t FrameScheduler::pts_at(Clock::time_point now) const
+{
+    return chrono::duration_cast<chrono::milliseconds>(now - start).count();
+}
+
+FrameScheduler::FrameScheduler(int fps)
+    : start(Clock::now()), interval(chrono::duration_cast<Clock::duration>(chrono::duration<double>(1.0 / fps))),
+      next_tick(0), last_pts(-1), frames_late(0)
+{
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Paces the screenshots of a domain at a target rate on the monotonic clock and stamps each with
+// the time it was taken, in milliseconds since the recording began. Captures start on ticks 1/fps
+// apart. One that overruns its tick skips the ticks it missed, and the previous frame is shown in
+// their place, so a slow guest costs frames rather than making the capture loop spin.
+struct FrameScheduler
+{
+    typedef std::chrono::steady_clock Clock;
+
+    Clock::time_point start;
+    Clock::duration interval;
+    std::atomic<int64_t> next_tick;
+    int64_t last_pts;
+    int frames_late;
+
+    // When the next capture is due. Safe to call from any thread.
+    Clock::time_point due() const
+    {
+        return start + next_tick.load() * interval;
+    }
+
+    // Nominal display time of a frame in milliseconds.
+    int64_t frame_duration() const;
+
+    // Claims the tick for a capture starting at now and returns the capture's pts.
+    int64_t claim(Clock::time_point now);
+
+    // The pts of now, for ending the last frame.
+    int64_t pts_at(Clock::time_point now) const;
+
+    explicit FrameScheduler(int fps);
+
+    FrameScheduler(const FrameScheduler &o) = delete;
+};
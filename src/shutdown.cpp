@@ -0,0 +1,96 @@
+#include <atomic>
+#include <cerrno>
+#include <csignal>
+#include <ctime>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+#include "shutdown.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+// Becomes readable for good when the first stop signal arrives.
+static int stop_fd = -1;
+static atomic<int> stop_signals(0);
+// The monotonic time of the first signal, which steady_clock reads too.
+static atomic<int64_t> stopped_at_ns(0);
+static int64_t drain_ns = 0;
+
+static void stop_handler(int sig)
+{
+    int saved_errno = errno;
+    // The time goes first, so that nobody sees the stop without it.
+    if (stop_signals == 0)
+    {
+        timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        stopped_at_ns = int64_t(now.tv_sec) * 1000000000 + now.tv_nsec;
+    }
+    ++stop_signals;
+    uint64_t one = 1;
+    // The counter never fills up this far, and the stop is seen either way.
+    auto written = write(stop_fd, &one, sizeof(one));
+    errno = saved_errno;
+}
+
+void handle_stop_signals(int drain_seconds)
+{
+    drain_ns = int64_t(drain_seconds) * 1000000000;
+    stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (stop_fd < 0)
+        fatal("Could not create an eventfd for stop signals\n");
+    struct sigaction sigact = {};
+    sigact.sa_handler = stop_handler;
+    sigact.sa_flags = SA_RESTART;
+    sigemptyset(&sigact.sa_mask);
+    sigaddset(&sigact.sa_mask, SIGINT);
+    sigaddset(&sigact.sa_mask, SIGTERM);
+    sigaction(SIGINT, &sigact, nullptr);
+    sigaction(SIGTERM, &sigact, nullptr);
+}
+
+bool stop_requested()
+{
+    return stop_signals > 0;
+}
+
+bool wait_for_stop(chrono::steady_clock::time_point until)
+{
+    auto wait = until - chrono::steady_clock::now();
+    if (stop_requested() || wait <= wait.zero())
+        return stop_requested();
+    auto seconds = chrono::duration_cast<chrono::seconds>(wait);
+    timespec timeout = {time_t(seconds.count()), long(chrono::nanoseconds(wait - seconds).count())};
+    pollfd ready = {stop_fd, POLLIN, 0};
+    ppoll(&ready, 1, &timeout, nullptr);
+    return stop_requested();
+}
+
+bool wait_readable(int fd, int timeout_ms)
+{
+    pollfd ready[2] = {{fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+    while (!stop_requested())
+    {
+        auto res = poll(ready, 2, timeout_ms);
+        if (res < 0 && errno == EINTR)
+            continue;
+        return res > 0 && ready[0].revents != 0 && !stop_requested();
+    }
+    return false;
+}
+
+chrono::steady_clock::time_point stop_deadline()
+{
+    if (!stop_requested())
+        return chrono::steady_clock::time_point::max();
+    chrono::steady_clock::time_point stopped_at(chrono::nanoseconds(stopped_at_ns.load()));
+    if (stop_signals > 1)
+        return stopped_at;
+    return drain_ns == 0 ? chrono::steady_clock::time_point::max() : stopped_at + chrono::nanoseconds(drain_ns);
+}
+
+bool past_stop_deadline()
+{
+    return chrono::steady_clock::now() >= stop_deadline();
+}
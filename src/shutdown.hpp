@@ -0,0 +1,26 @@
+#pragma once
+
+#include <chrono>
+
+// Ends the recording on SIGINT or SIGTERM. The handlers only note the time and write to an eventfd,
+// so every thread waiting in wait_for_stop wakes at once rather than at its next timeout. Once
+// stopped, the frames still in the pipeline are encoded and the files completed within
+// drain_seconds of the signal, 0 for no limit, and whatever is left after that is dropped. A
+// second signal drops it straight away.
+void handle_stop_signals(int drain_seconds);
+
+bool stop_requested();
+
+// Sleeps until until or the recording is stopped, whichever comes first. Returns whether it was
+// stopped.
+bool wait_for_stop(std::chrono::steady_clock::time_point until);
+
+// Waits up to timeout_ms, or for ever if it is negative, for fd to become readable. Returns false
+// if it did not or the recording was stopped first, so that a read never holds up the stop.
+bool wait_readable(int fd, int timeout_ms);
+
+// When the pipeline has to be drained by, which is the end of time until the recording is stopped
+// or if there is no limit.
+std::chrono::steady_clock::time_point stop_deadline();
+
+bool past_stop_deadline();
@@ -0,0 +1,756 @@
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef LVSC_IO_URING
+#include <liburing.h>
+#endif
+#include "sink.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+static const string TCP_PREFIX = "tcp:";
+static const string UNIX_PREFIX = "unix:";
+
+// How often the broadcast thread checks whether it should stop.
+static const int POLL_INTERVAL_MS = 100;
+
+// Files are handed to the I/O thread in blocks of this size, or every WRITE_INTERVAL_MS when less
+// has been written, so a recording killed part way loses at most that much.
+static const size_t WRITE_BLOCK_SIZE = 4 << 20;
+static const int WRITE_INTERVAL_MS = 1000;
+
+// How much may wait for the disk before writing blocks the encoder.
+static const size_t MAX_WRITE_BACKLOG = 256 << 20;
+
+// O_DIRECT needs buffers, offsets and sizes that are multiples of the logical block size.
+static const size_t DIRECT_ALIGNMENT = 4096;
+
+#ifdef LVSC_IO_URING
+static const unsigned RING_ENTRIES = 32;
+#endif
+
+bool SinkOptions::set_fsync_policy(const string &policy)
+{
+    if (policy == "never")
+        fsync_interval = -1;
+    else if (policy == "close")
+        fsync_interval = 0;
+    else if (!policy.empty() && policy.find_first_not_of("0123456789") == string::npos && policy.size() < 6)
+        fsync_interval = max(1, stoi(policy));
+    else
+        return false;
+    return true;
+}
+
+bool io_uring_available()
+{
+#ifdef LVSC_IO_URING
+    return true;
+#else
+    return false;
+#endif
+}
+
+// A growable byte buffer aligned for O_DIRECT.
+struct AlignedBuffer
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+
+    void append(const void *bytes, size_t count)
+    {
+        if (size + count > capacity)
+        {
+            auto grown = max(capacity * 2, (size + count + DIRECT_ALIGNMENT - 1) / DIRECT_ALIGNMENT * DIRECT_ALIGNMENT);
+            auto replacement = (uint8_t *)aligned_alloc(DIRECT_ALIGNMENT, grown);
+            if (!replacement)
+                fatal("Failed to allocate %zu bytes for writing\n", grown);
+            if (size)
+                memcpy(replacement, data, size);
+            free(data);
+            data = replacement;
+            capacity = grown;
+        }
+        memcpy(data + size, bytes, count);
+        size += count;
+    }
+
+    void swap(AlignedBuffer &o)
+    {
+        std::swap(data, o.data);
+        std::swap(size, o.size);
+        std::swap(capacity, o.capacity);
+    }
+
+    AlignedBuffer() : data(nullptr), size(0), capacity(0)
+    {
+    }
+
+    ~AlignedBuffer()
+    {
+        free(data);
+    }
+
+    AlignedBuffer(const AlignedBuffer &o) = delete;
+};
+
+// Where size bytes from offset in a buffer of patches go in the file.
+struct PatchRange
+{
+    long position;
+    size_t offset;
+    size_t size;
+};
+
+// One write for the I/O thread. Offsets are ignored on a pipe.
+struct WriteOp
+{
+    int fd;
+    const uint8_t *data;
+    size_t size;
+    off_t offset;
+};
+
+static bool write_fully(const WriteOp &op, bool seekable)
+{
+    for (size_t done = 0; done < op.size;)
+    {
+        auto res = seekable ? pwrite(op.fd, op.data + done, op.size - done, op.offset + done)
+                            : ::write(op.fd, op.data + done, op.size - done);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+        done += res;
+    }
+    return true;
+}
+
+// A file, or stdout, which is only seekable when it has been redirected to a file. Writes are
+// gathered in memory and written behind the encoder by a thread of its own, in large blocks on a
+// file or as soon as a frame is complete on a pipe, so a slow disk never holds up encoding until
+// MAX_WRITE_BACKLOG is waiting. Patches to bytes still in memory are made in place and the rest are
+// written after the blocks they land in. With O_DIRECT only whole aligned blocks bypass the page
+// cache, the tail and the patches go through a second, buffered descriptor.
+struct FileSink : Sink
+{
+    SinkOptions options;
+    int fd;
+    int direct_fd;
+    bool is_seekable;
+    off_t base;
+    std::thread thread;
+    mutex lock;
+    condition_variable wake;
+    condition_variable room;
+    // The bytes from pending_offset on that the I/O thread has yet to take.
+    AlignedBuffer pending;
+    long pending_offset;
+    // The patches to bytes already taken, each a range of patch_bytes to write at a position. They
+    // are swapped with the I/O thread's copies, so both keep their capacity from one block to the next.
+    vector<PatchRange> patches;
+    vector<uint8_t> patch_bytes;
+    bool flush_requested;
+    bool closing;
+    atomic<bool> failed;
+#ifdef LVSC_IO_URING
+    io_uring ring;
+    bool ring_ready;
+#endif
+
+    bool write(const void *data, size_t size) override
+    {
+        unique_lock<mutex> guard(lock);
+        room.wait(guard, [&]() { return pending.size < MAX_WRITE_BACKLOG || failed; });
+        if (failed)
+            return false;
+        pending.append(data, size);
+        if (pending.size >= WRITE_BLOCK_SIZE)
+            wake.notify_one();
+        return true;
+    }
+
+    bool seekable() const override
+    {
+        return is_seekable;
+    }
+
+    bool patch(long position, const void *data, size_t size) override
+    {
+        auto bytes = (const uint8_t *)data;
+        lock_guard<mutex> guard(lock);
+        if (position < 0 || position + long(size) > pending_offset + long(pending.size))
+            return false;
+        // What the I/O thread has already taken is overwritten on disk, the rest in memory.
+        auto taken = size_t(max(0L, min(long(size), pending_offset - position)));
+        if (taken)
+        {
+            // Earlier patches the new one overlaps, such as the IVF header patched at every
+            // keyframe, are brought up to date with it, so that the order their writes land in
+            // does not matter. One to the same range is simply replaced.
+            bool replaced = false;
+            for (auto &earlier : patches)
+            {
+                long start = max(earlier.position, position);
+                long end = min(earlier.position + long(earlier.size), position + long(taken));
+                if (start < end)
+                    memcpy(patch_bytes.data() + earlier.offset + (start - earlier.position), bytes + (start - position),
+                           end - start);
+                replaced = replaced || (earlier.position == position && earlier.size >= taken);
+            }
+            if (!replaced)
+            {
+                patches.push_back(PatchRange{position, patch_bytes.size(), taken});
+                patch_bytes.insert(patch_bytes.end(), bytes, bytes + taken);
+            }
+        }
+        if (taken < size)
+            memcpy(pending.data + (position + taken - pending_offset), bytes + taken, size - taken);
+        return !failed;
+    }
+
+    void flush() override
+    {
+        if (is_seekable)
+            return;
+        lock_guard<mutex> guard(lock);
+        flush_requested = true;
+        wake.notify_one();
+    }
+
+    bool submit(vector<WriteOp> &ops)
+    {
+#ifdef LVSC_IO_URING
+        if (ring_ready)
+        {
+            // The blocks never overlap each other or the patches, and overlapping patches hold the
+            // same bytes where they overlap, so the writes can all be in flight at once.
+            for (size_t first = 0; first < ops.size(); first += RING_ENTRIES)
+            {
+                auto count = min(ops.size() - first, size_t(RING_ENTRIES));
+                for (size_t i = first; i < first + count; ++i)
+                {
+                    auto sqe = io_uring_get_sqe(&ring);
+                    io_uring_prep_write(sqe, ops[i].fd, ops[i].data, ops[i].size, ops[i].offset);
+                    io_uring_sqe_set_data(sqe, &ops[i]);
+                }
+                if (io_uring_submit_and_wait(&ring, count) < 0)
+                    return false;
+                bool ok = true;
+                for (size_t i = 0; i < count; ++i)
+                {
+                    io_uring_cqe *cqe;
+                    if (io_uring_wait_cqe(&ring, &cqe) < 0)
+                        return false;
+                    auto op = *(WriteOp *)io_uring_cqe_get_data(cqe);
+                    auto res = cqe->res;
+                    io_uring_cqe_seen(&ring, cqe);
+                    if (res < 0)
+                    {
+                        ok = false;
+                        continue;
+                    }
+                    // The buffered descriptor takes the rest of a short write whatever its alignment.
+                    op.fd = fd;
+                    op.data += res;
+                    op.size -= res;
+                    op.offset += res;
+                    ok = write_fully(op, true) && ok;
+                }
+                if (!ok)
+                    return false;
+            }
+            return true;
+        }
+#endif
+        for (auto &op : ops)
+        {
+            if (!write_fully(op, is_seekable))
+                return false;
+        }
+        return true;
+    }
+
+    void run()
+    {
+        AlignedBuffer chunk;
+        vector<PatchRange> chunk_patches;
+        vector<uint8_t> chunk_patch_bytes;
+        vector<WriteOp> ops;
+        auto last_sync = chrono::steady_clock::now();
+        bool unsynced = false;
+        unique_lock<mutex> guard(lock);
+        while (true)
+        {
+            wake.wait_for(guard, chrono::milliseconds(WRITE_INTERVAL_MS),
+                          [&]() { return closing || flush_requested || pending.size >= WRITE_BLOCK_SIZE; });
+            bool final = closing;
+            flush_requested = false;
+
+            // Between blocks O_DIRECT can only take whole aligned blocks, the rest waits for more.
+            size_t take = pending.size;
+            if (direct_fd >= 0 && !final)
+                take -= take % DIRECT_ALIGNMENT;
+            chunk.size = 0;
+            chunk.swap(pending);
+            pending.append(chunk.data + take, chunk.size - take);
+            chunk.size = take;
+            long offset = pending_offset;
+            pending_offset += take;
+            chunk_patches.clear();
+            chunk_patches.swap(patches);
+            chunk_patch_bytes.clear();
+            chunk_patch_bytes.swap(patch_bytes);
+            room.notify_all();
+            guard.unlock();
+
+            ops.clear();
+            size_t direct = direct_fd >= 0 ? take - take % DIRECT_ALIGNMENT : 0;
+            if (direct)
+                ops.push_back(WriteOp{direct_fd, chunk.data, direct, base + offset});
+            if (take > direct)
+                ops.push_back(WriteOp{fd, chunk.data + direct, take - direct, off_t(base + offset + direct)});
+            for (auto &patch : chunk_patches)
+                ops.push_back(WriteOp{fd, chunk_patch_bytes.data() + patch.offset, patch.size, off_t(base + patch.position)});
+            if (!ops.empty() && !submit(ops) && !failed.exchange(true))
+                output("Failed to write %s\n", name.c_str());
+            unsynced = unsynced || !ops.empty();
+
+            auto now = chrono::steady_clock::now();
+            if (is_seekable && unsynced && options.fsync_interval >= 0 &&
+                (final || (options.fsync_interval > 0 && now - last_sync >= chrono::seconds(options.fsync_interval))))
+            {
+                if (fdatasync(fd) != 0 && !failed.exchange(true))
+                    output("Failed to sync %s to disk\n", name.c_str());
+                last_sync = now;
+                unsynced = false;
+            }
+
+            guard.lock();
+            if (final)
+                break;
+        }
+        room.notify_all();
+    }
+
+    void close() override
+    {
+        if (fd < 0)
+            return;
+        {
+            lock_guard<mutex> guard(lock);
+            closing = true;
+            wake.notify_one();
+        }
+        thread.join();
+#ifdef LVSC_IO_URING
+        if (ring_ready)
+            io_uring_queue_exit(&ring);
+        ring_ready = false;
+#endif
+        if (direct_fd >= 0)
+            ::close(direct_fd);
+        if (fd != STDOUT_FILENO)
+            ::close(fd);
+        fd = direct_fd = -1;
+    }
+
+    FileSink(const string &name, int fd, const SinkOptions &options)
+        : Sink(name), options(options), fd(fd), direct_fd(-1), base(lseek(fd, 0, SEEK_CUR)), pending_offset(0),
+          flush_requested(false), closing(false), failed(false)
+    {
+        is_seekable = base >= 0;
+        base = max(base, off_t(0));
+        // O_DIRECT is only used from the start of a file, where the blocks line up with the disk's.
+        if (options.direct && is_seekable && base == 0 && fd != STDOUT_FILENO)
+        {
+            direct_fd = open(name.c_str(), O_WRONLY | O_DIRECT | O_CLOEXEC);
+            if (direct_fd < 0)
+                debug("Writing %s without O_DIRECT, the filesystem does not support it\n", name.c_str());
+        }
+#ifdef LVSC_IO_URING
+        ring_ready = options.io_uring && is_seekable && io_uring_queue_init(RING_ENTRIES, &ring, 0) == 0;
+        if (options.io_uring && is_seekable && !ring_ready)
+            debug("Writing %s without io_uring, the kernel does not support it\n", name.c_str());
+#endif
+        thread = std::thread([this]() { run(); });
+    }
+
+    ~FileSink()
+    {
+        close();
+    }
+};
+
+static unique_ptr<Sink> open_file(const string &name, const SinkOptions &options)
+{
+    int fd = open(name.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        fatal("Could not open %s for writing\n", name.c_str());
+    return make_unique<FileSink>(name, fd, options);
+}
+
+// Splits a file into segments, each a file of its own that the container completes before starting
+// the next. A finished segment is closed on a thread of its own, so that its last writes and sync
+// never hold up the encoder.
+struct SegmentedSink : Sink
+{
+    SinkOptions options;
+    unique_ptr<Sink> current;
+    int segment;
+    long segment_written;
+    chrono::steady_clock::time_point segment_started;
+    bool requested;
+    std::thread closer;
+
+    void open_segment()
+    {
+        current = open_file(segment_name(name, segment), options);
+        debug("Recording segment %s\n", current->name.c_str());
+        segment_written = 0;
+        segment_started = chrono::steady_clock::now();
+        requested = false;
+    }
+
+    bool write(const void *data, size_t size) override
+    {
+        segment_written += size;
+        return current->write(data, size);
+    }
+
+    bool seekable() const override
+    {
+        return current->seekable();
+    }
+
+    bool patch(long position, const void *data, size_t size) override
+    {
+        return current->patch(position, data, size);
+    }
+
+    void flush() override
+    {
+        current->flush();
+    }
+
+    bool segment_due() const override
+    {
+        return (options.segment_bytes > 0 && segment_written >= options.segment_bytes) ||
+               (options.segment_seconds > 0 &&
+                chrono::steady_clock::now() - segment_started >= chrono::seconds(options.segment_seconds));
+    }
+
+    bool wants_keyframe() override
+    {
+        if (requested || !segment_due())
+            return false;
+        requested = true;
+        return true;
+    }
+
+    bool next_segment() override
+    {
+        if (closer.joinable())
+            closer.join();
+        closer = std::thread([finished = move(current)]() { finished->close(); });
+        ++segment;
+        open_segment();
+        return true;
+    }
+
+    void close() override
+    {
+        if (current)
+            current->close();
+        if (closer.joinable())
+            closer.join();
+    }
+
+    SegmentedSink(const string &name, const SinkOptions &options) : Sink(name), options(options), segment(1)
+    {
+        open_segment();
+    }
+
+    ~SegmentedSink()
+    {
+        close();
+    }
+};
+
+bool ivf_name(const string &name)
+{
+    return name.size() >= 4 && name.compare(name.size() - 4, 4, ".ivf") == 0;
+}
+
+string fill_name(const string &name, const string &placeholder, const string &value)
+{
+    auto result = name;
+    auto at = result.find(placeholder);
+    if (at != string::npos)
+        return result.replace(at, placeholder.size(), value);
+    auto slash = result.rfind('/');
+    auto dot = result.rfind('.');
+    if (dot == string::npos || (slash != string::npos && dot < slash))
+        dot = result.size();
+    return result.insert(dot, "-" + value);
+}
+
+string segment_name(const string &name, int segment)
+{
+    char number[16];
+    snprintf(number, sizeof(number), "%05d", segment);
+    return fill_name(name, "{segment}", number);
+}
+
+// A viewer connected to a BroadcastSink, with the bytes it has yet to be sent. It is only sent
+// frames once it has joined at a keyframe.
+struct Subscriber
+{
+    int fd;
+    vector<uint8_t> pending;
+    size_t sent;
+    bool joined;
+};
+
+// Serves one stream to every viewer that connects to a TCP or Unix socket. Each is sent the header
+// and then follows the stream from the next keyframe on, so all of them share one encode. Writing
+// never blocks: a thread sends what the viewers have room for, and one that falls too far behind is
+// disconnected.
+struct BroadcastSink : Sink
+{
+    // How far a viewer may fall behind before it is dropped.
+    static const size_t MAX_BACKLOG = 32 << 20;
+
+    int listener;
+    string unix_path;
+    std::thread thread;
+    atomic<bool> running;
+    mutex lock;
+    vector<uint8_t> header;
+    bool header_complete;
+    vector<Subscriber> subscribers;
+    atomic<int> waiting;
+    atomic<bool> requested;
+
+    // Sends as much as the socket takes without blocking. Returns false once the viewer has gone.
+    bool send_pending(Subscriber &subscriber)
+    {
+        while (subscriber.sent < subscriber.pending.size())
+        {
+            auto res = send(subscriber.fd, subscriber.pending.data() + subscriber.sent,
+                            subscriber.pending.size() - subscriber.sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (res < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            subscriber.sent += res;
+        }
+        subscriber.pending.clear();
+        subscriber.sent = 0;
+        return true;
+    }
+
+    void drop(size_t index)
+    {
+        debug("Viewer of %s disconnected\n", name.c_str());
+        if (!subscribers[index].joined)
+            --waiting;
+        ::close(subscribers[index].fd);
+        subscribers.erase(subscribers.begin() + index);
+    }
+
+    bool write(const void *data, size_t size) override
+    {
+        auto bytes = (const uint8_t *)data;
+        lock_guard<mutex> guard(lock);
+        if (!header_complete)
+            header.insert(header.end(), bytes, bytes + size);
+        for (size_t i = subscribers.size(); i-- > 0;)
+        {
+            // Viewers that connect before the header is complete are sent the rest of it as it comes.
+            auto &subscriber = subscribers[i];
+            if (!subscriber.joined && header_complete)
+                continue;
+            if (subscriber.pending.size() - subscriber.sent + size > MAX_BACKLOG)
+            {
+                output("Viewer of %s fell too far behind and was disconnected\n", name.c_str());
+                drop(i);
+                continue;
+            }
+            subscriber.pending.insert(subscriber.pending.end(), bytes, bytes + size);
+        }
+        return true;
+    }
+
+    void flush() override
+    {
+        lock_guard<mutex> guard(lock);
+        for (size_t i = subscribers.size(); i-- > 0;)
+        {
+            if (!send_pending(subscribers[i]))
+                drop(i);
+        }
+    }
+
+    void end_header() override
+    {
+        lock_guard<mutex> guard(lock);
+        header_complete = true;
+    }
+
+    void sync_point() override
+    {
+        lock_guard<mutex> guard(lock);
+        for (auto &subscriber : subscribers)
+        {
+            if (!subscriber.joined)
+                debug("Viewer of %s joined\n", name.c_str());
+            subscriber.joined = true;
+        }
+        waiting = 0;
+        requested = false;
+    }
+
+    bool wants_keyframe() override
+    {
+        return waiting > 0 && !requested.exchange(true);
+    }
+
+    void run()
+    {
+        vector<pollfd> fds;
+        while (running)
+        {
+            fds.assign(1, pollfd{listener, POLLIN, 0});
+            {
+                lock_guard<mutex> guard(lock);
+                for (auto &subscriber : subscribers)
+                    fds.push_back(pollfd{subscriber.fd, short(subscriber.pending.empty() ? 0 : POLLOUT), 0});
+            }
+            if (poll(fds.data(), fds.size(), POLL_INTERVAL_MS) <= 0)
+                continue;
+
+            lock_guard<mutex> guard(lock);
+            // Viewers only leave under the lock, so the ones polled are still at the front.
+            for (size_t i = min(fds.size() - 1, subscribers.size()); i-- > 0;)
+            {
+                auto events = fds[i + 1].revents;
+                if (events == 0 || subscribers[i].fd != fds[i + 1].fd)
+                    continue;
+                if ((events & (POLLERR | POLLHUP)) || !send_pending(subscribers[i]))
+                    drop(i);
+            }
+            if (fds[0].revents & POLLIN)
+            {
+                int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+                if (client < 0)
+                    continue;
+                debug("Viewer of %s connected, waiting for a keyframe\n", name.c_str());
+                subscribers.push_back(Subscriber{client, header, 0, false});
+                ++waiting;
+            }
+        }
+    }
+
+    void close() override
+    {
+        if (listener < 0)
+            return;
+        running = false;
+        thread.join();
+        // Give the viewers what is left of the stream before hanging up.
+        flush();
+        for (auto &subscriber : subscribers)
+            ::close(subscriber.fd);
+        subscribers.clear();
+        ::close(listener);
+        listener = -1;
+        if (!unix_path.empty())
+            unlink(unix_path.c_str());
+    }
+
+    BroadcastSink(const string &name, int listener, const string &unix_path)
+        : Sink(name), listener(listener), unix_path(unix_path), running(true), header_complete(false), waiting(0), requested(false)
+    {
+        thread = std::thread([this]() { run(); });
+    }
+
+    ~BroadcastSink()
+    {
+        close();
+    }
+};
+
+static int listen_tcp(const string &address)
+{
+    // The port follows the last colon, and an empty host listens on every interface.
+    auto colon = address.rfind(':');
+    if (colon == string::npos)
+        return -1;
+    auto host = address.substr(0, colon);
+    auto port = address.substr(colon + 1);
+    if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+        host = host.substr(1, host.size() - 2);
+
+    addrinfo hints = addrinfo();
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo *addresses;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &addresses) != 0)
+        return -1;
+    int listener = -1;
+    for (auto ai = addresses; ai && listener < 0; ai = ai->ai_next)
+    {
+        listener = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (listener < 0)
+            continue;
+        int reuse = 1;
+        setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+        if (bind(listener, ai->ai_addr, ai->ai_addrlen) < 0 || listen(listener, 16) < 0)
+        {
+            ::close(listener);
+            listener = -1;
+        }
+    }
+    freeaddrinfo(addresses);
+    return listener;
+}
+
+unique_ptr<Sink> open_sink(const string &name, const SinkOptions &options)
+{
+    if (name == "-")
+        return make_unique<FileSink>(name, STDOUT_FILENO, options);
+    if (name.substr(0, TCP_PREFIX.size()) == TCP_PREFIX)
+    {
+        // The extension that picks the container is not part of the port.
+        auto address = name.substr(TCP_PREFIX.size(), name.size() - TCP_PREFIX.size() - (ivf_name(name) ? 4 : 0));
+        int listener = listen_tcp(address);
+        if (listener < 0)
+            fatal("Could not listen for viewers on %s\n", name.c_str());
+        return make_unique<BroadcastSink>(name, listener, "");
+    }
+    if (name.substr(0, UNIX_PREFIX.size()) == UNIX_PREFIX)
+    {
+        auto path = name.substr(UNIX_PREFIX.size());
+        int listener = listen_unix(path);
+        if (listener < 0)
+            fatal("Could not listen for viewers on %s\n", name.c_str());
+        return make_unique<BroadcastSink>(name, listener, path);
+    }
+    if (options.segment_seconds > 0 || options.segment_bytes > 0)
+        return make_unique<SegmentedSink>(name, options);
+    return open_file(name, options);
+}
@@ -0,0 +1,118 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+// Where a container's bytes go. A seekable sink lets the container patch sizes and indexes in place
+// once they are known. Anything else gets a stream that is complete as it is written, for live
+// viewing, and may have several subscribers that join it part way through.
+struct Sink
+{
+    // The file name or address, whose extension picks the container.
+    std::string name;
+
+    virtual bool write(const void *data, size_t size) = 0;
+
+    virtual bool seekable() const
+    {
+        return false;
+    }
+
+    // Overwrites size bytes written earlier, from position on. Only called on seekable sinks.
+    virtual bool patch(long position, const void *data, size_t size)
+    {
+        return false;
+    }
+
+    // Called after each frame, so that a stream is not held back in buffers.
+    virtual void flush()
+    {
+    }
+
+    // Everything written so far is the stream header, which every subscriber is sent first.
+    virtual void end_header()
+    {
+    }
+
+    // What is written next starts with a keyframe, so a waiting subscriber can join here.
+    virtual void sync_point()
+    {
+    }
+
+    // True once each time subscribers start waiting for a keyframe to join at, so that the encoder
+    // only forces one however many frames it holds back.
+    virtual bool wants_keyframe()
+    {
+        return false;
+    }
+
+    // True when the sink wants to move on to a new file at the next keyframe.
+    virtual bool segment_due() const
+    {
+        return false;
+    }
+
+    // Completes the current file and starts the next, which the container then fills from its
+    // header on as if it were new. Only called at a keyframe and when segment_due().
+    virtual bool next_segment()
+    {
+        return false;
+    }
+
+    virtual void close()
+    {
+    }
+
+    explicit Sink(const std::string &name) : name(name)
+    {
+    }
+
+    virtual ~Sink()
+    {
+    }
+
+    Sink(const Sink &o) = delete;
+};
+
+// How files are written. They are buffered in memory and written behind the encoder in large
+// blocks by a thread of their own, with O_DIRECT if direct and through io_uring if io_uring, and
+// flushed to disk every fsync_interval seconds, only when closed if it is 0 or never if negative.
+// A file is split into segments at the first keyframe after segment_seconds or segment_bytes, when
+// they are set.
+struct SinkOptions
+{
+    bool direct;
+    bool io_uring;
+    int fsync_interval;
+    int segment_seconds;
+    long segment_bytes;
+
+    // Takes "never", "close" or a number of seconds. Returns false for anything else.
+    bool set_fsync_policy(const std::string &policy);
+
+    SinkOptions() : direct(false), io_uring(false), fsync_interval(0), segment_seconds(0), segment_bytes(0)
+    {
+    }
+};
+
+// Replaces placeholder in name with value, or puts value before the extension after a dash if name
+// has no placeholder.
+std::string fill_name(const std::string &name, const std::string &placeholder, const std::string &value);
+
+// The file name of a segment: {segment} in the name is replaced by its number, or the number is put
+// before the extension if there is no {segment}.
+std::string segment_name(const std::string &name, int segment);
+
+// Whether the file or address name is written as IVF rather than WebM, which it is when it ends in
+// .ivf. On a TCP address the extension follows the port.
+bool ivf_name(const std::string &name);
+
+// Whether lvsc was built with io_uring support, with make IO_URING=1.
+bool io_uring_available();
+
+// Opens an output: "tcp:<host>:<port>" and "unix:<path>", either with .ivf after it, listen for
+// viewers, "-" streams to stdout and anything else is a file, which is segmented if the options say
+// so.
+std::unique_ptr<Sink> open_sink(const std::string &name, const SinkOptions &options = SinkOptions());
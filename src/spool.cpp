@@ -0,0 +1,438 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "encoder.hpp"
+#include "recorder.hpp"
+#include "spool.hpp"
+#include "thread_pool.hpp"
+#include "util.hpp"
+#include "video_writer.hpp"
+
+using namespace std;
+
+// Chunks are encoded at most this many per worker ahead of the one being written, which bounds the
+// packets held in memory when an early chunk is slow.
+static const size_t CHUNKS_AHEAD_PER_WORKER = 2;
+
+void SpoolWriter::write_full(const uint8_t *pixels, const FrameLayout &layout, int64_t pts, int64_t duration)
+{
+    uint64_t size = uint64_t(layout.width) * layout.height * pixel_size(layout.format);
+    SpoolRecord record = {SPOOL_FULL, uint32_t(layout.format), layout.width, layout.height, pts, duration, 0, 0, size};
+    write(&record, sizeof(record));
+    write_rect(pixels, layout, DirtyRect{0, 0, layout.width, layout.height});
+    format = layout.format;
+    width = layout.width;
+    height = layout.height;
+    ++frames_written;
+    frames_since_full = 1;
+    end_pts = pts + duration;
+}
+
+void SpoolWriter::write_delta(const uint8_t *pixels, const FrameLayout &layout, const vector<DirtyRect> &rects,
+                              int64_t pts, int64_t duration)
+{
+    uint64_t size = rects.size() * sizeof(DirtyRect);
+    for (auto &rect : rects)
+        size += uint64_t(rect.width) * rect.height * pixel_size(layout.format);
+    SpoolRecord record = {SPOOL_DELTA, uint32_t(layout.format), layout.width, layout.height, pts, duration,
+                          uint32_t(rects.size()), 0, size};
+    write(&record, sizeof(record));
+    write(rects.data(), rects.size() * sizeof(DirtyRect));
+    for (auto &rect : rects)
+        write_rect(pixels, layout, rect);
+    ++frames_written;
+    ++frames_since_full;
+    end_pts = pts + duration;
+}
+
+void SpoolWriter::write_repeat(int64_t pts, int64_t duration)
+{
+    SpoolRecord record = {SPOOL_REPEAT, uint32_t(format), width, height, pts, duration, 0, 0, 0};
+    write(&record, sizeof(record));
+    end_pts = pts + duration;
+}
+
+void SpoolWriter::finish(int64_t end_pts)
+{
+    if (fd < 0)
+        return;
+    SpoolRecord record = {SPOOL_END, uint32_t(format), width, height, end_pts, 0, 0, 0, 0};
+    write(&record, sizeof(record));
+    munmap(window, SPOOL_EXTENT_SIZE);
+    window = nullptr;
+    if (ftruncate(fd, position) != 0 || ::close(fd) != 0)
+        fatal("Failed to complete %s\n", name.c_str());
+    fd = -1;
+    debug("Spooled %d frames to %s in %zu bytes\n", frames_written, name.c_str(), position);
+}
+
+void SpoolWriter::write(const void *data, size_t size)
+{
+    auto bytes = (const uint8_t *)data;
+    while (size > 0)
+    {
+        if (position == window_start + SPOOL_EXTENT_SIZE)
+            map_window(position);
+        size_t length = min(size, window_start + SPOOL_EXTENT_SIZE - position);
+        memcpy(window + (position - window_start), bytes, length);
+        position += length;
+        bytes += length;
+        size -= length;
+    }
+}
+
+void SpoolWriter::write_rect(const uint8_t *pixels, const FrameLayout &layout, const DirtyRect &rect)
+{
+    size_t bytes_per_pixel = pixel_size(layout.format);
+    size_t row_size = rect.width * bytes_per_pixel;
+    auto row = pixels + rect.y * layout.stride + rect.x * bytes_per_pixel;
+    // Whole rows of a tightly packed frame go in one copy.
+    if (row_size == layout.stride)
+    {
+        write(row, row_size * rect.height);
+        return;
+    }
+    for (int y = 0; y < rect.height; ++y, row += layout.stride)
+        write(row, row_size);
+}
+
+void SpoolWriter::map_window(size_t start)
+{
+    if (window)
+    {
+        munmap(window, SPOOL_EXTENT_SIZE);
+        // The extent is complete, so it can go to disk while the next one fills.
+        sync_file_range(fd, window_start, SPOOL_EXTENT_SIZE, SYNC_FILE_RANGE_WRITE);
+    }
+    int error = posix_fallocate(fd, start, SPOOL_EXTENT_SIZE);
+    if (error != 0)
+        fatal("Could not grow %s to %zu bytes: %s\n", name.c_str(), start + SPOOL_EXTENT_SIZE, strerror(error));
+    auto mapped = mmap(nullptr, SPOOL_EXTENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, start);
+    if (mapped == MAP_FAILED)
+        fatal("Could not map %s for writing\n", name.c_str());
+    madvise(mapped, SPOOL_EXTENT_SIZE, MADV_SEQUENTIAL);
+    window = (uint8_t *)mapped;
+    window_start = start;
+}
+
+SpoolWriter::~SpoolWriter()
+{
+    finish(end_pts);
+}
+
+SpoolWriter::SpoolWriter(const string &name) : name(name), fd(-1), window(nullptr), window_start(0), position(0), format(PIXEL_RGB24), width(0), height(0), frames_written(0), frames_since_full(0), end_pts(0)
+{
+    fd = open(name.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        fatal("Could not open %s for writing\n", name.c_str());
+    map_window(0);
+    write(SPOOL_MAGIC, sizeof(SPOOL_MAGIC));
+}
+
+// Whether the pixels of a record fit the size it claims and its rectangles are inside the frame.
+static bool valid_record(const SpoolRecord &record, const uint8_t *payload)
+{
+    if (record.format > PIXEL_RGB565 || record.width <= 0 || record.height <= 0)
+        return false;
+    uint64_t bytes_per_pixel = pixel_size(PixelFormat(record.format));
+    if (record.type == SPOOL_FULL)
+        return record.size == uint64_t(record.width) * record.height * bytes_per_pixel;
+    if (record.type != SPOOL_DELTA)
+        return record.size == 0;
+    uint64_t size = uint64_t(record.rects) * sizeof(DirtyRect);
+    if (size > record.size)
+        return false;
+    for (uint32_t i = 0; i < record.rects; ++i)
+    {
+        DirtyRect rect;
+        memcpy(&rect, payload + i * sizeof(DirtyRect), sizeof(rect));
+        if (rect.x < 0 || rect.y < 0 || rect.width <= 0 || rect.height <= 0 || rect.x + rect.width > record.width ||
+            rect.y + rect.height > record.height)
+            return false;
+        size += uint64_t(rect.width) * rect.height * bytes_per_pixel;
+    }
+    return size == record.size;
+}
+
+SpoolReader::~SpoolReader()
+{
+    if (data)
+        munmap((void *)data, size);
+}
+
+SpoolReader::SpoolReader(const string &name) : name(name), data(nullptr), size(0), end_pts(0)
+{
+    int fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0)
+        fatal("Could not open %s for reading\n", name.c_str());
+    size = info.st_size;
+    if (size < sizeof(SPOOL_MAGIC))
+        fatal("%s is not a spool\n", name.c_str());
+    auto mapped = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED)
+        fatal("Could not map %s for reading\n", name.c_str());
+    data = (const uint8_t *)mapped;
+    if (memcmp(data, SPOOL_MAGIC, sizeof(SPOOL_MAGIC)) != 0)
+        fatal("%s is not a spool\n", name.c_str());
+
+    // Deltas are only read after the full record they apply to and at the same size.
+    size_t position = sizeof(SPOOL_MAGIC);
+    SpoolRecord full = SpoolRecord();
+    bool ended = false;
+    while (position + sizeof(SpoolRecord) <= size)
+    {
+        SpoolFrame frame;
+        memcpy(&frame.record, data + position, sizeof(SpoolRecord));
+        auto &record = frame.record;
+        frame.payload = data + position + sizeof(SpoolRecord);
+        if (record.type == SPOOL_END)
+        {
+            ended = true;
+            end_pts = record.pts;
+            break;
+        }
+        if (record.type < SPOOL_FULL || record.type > SPOOL_REPEAT ||
+            record.size > size - position - sizeof(SpoolRecord) || !valid_record(record, frame.payload))
+            break;
+        if (record.type != SPOOL_FULL &&
+            (full.type != SPOOL_FULL || record.format != full.format || record.width != full.width ||
+             record.height != full.height))
+            break;
+        position += sizeof(SpoolRecord) + record.size;
+        frames.push_back(frame);
+        if (record.type == SPOOL_FULL)
+            full = record;
+        end_pts = record.pts + record.duration;
+    }
+    if (!ended)
+        output("%s ends after %zu records without being finished, encoding what was written\n", name.c_str(),
+               frames.size());
+    debug("Read %zu records from %s\n", frames.size(), name.c_str());
+}
+
+struct SpoolEncode;
+
+// A packet of a chunk, whose bytes are at offset in its data, or where the last frame is shown
+// until, when extend.
+struct ChunkEvent
+{
+    size_t offset;
+    size_t size;
+    int64_t pts;
+    int64_t duration;
+    bool keyframe;
+    bool extend;
+};
+
+// The records from one full record up to the next, and the packets they were encoded into.
+struct SpoolChunk
+{
+    SpoolEncode *job;
+    size_t first;
+    size_t last;
+    vector<uint8_t> data;
+    vector<ChunkEvent> events;
+    int frames_encoded;
+    // What the containers are told about the stream, when the chunk had anything to encode.
+    StreamInfo info;
+    bool encoded;
+    bool done;
+};
+
+struct SpoolEncode
+{
+    const SpoolReader *spool;
+    const EncoderOptions *options;
+    const CaptureArea *area;
+    vector<SpoolChunk> chunks;
+    mutex lock;
+    condition_variable chunk_done;
+};
+
+// Copies the rectangles of a delta record into the frame, and adds the parts of the image they
+// touch to parts.
+static void apply_delta(const SpoolFrame &frame, uint8_t *pixels, size_t stride, const CaptureArea &area,
+                        vector<DirtyRect> &parts)
+{
+    auto &record = frame.record;
+    size_t bytes_per_pixel = pixel_size(PixelFormat(record.format));
+    auto source = frame.payload + record.rects * sizeof(DirtyRect);
+    for (uint32_t i = 0; i < record.rects; ++i)
+    {
+        DirtyRect rect;
+        memcpy(&rect, frame.payload + i * sizeof(DirtyRect), sizeof(rect));
+        size_t row_size = rect.width * bytes_per_pixel;
+        for (int y = 0; y < rect.height; ++y, source += row_size)
+            memcpy(pixels + (rect.y + y) * stride + rect.x * bytes_per_pixel, source, row_size);
+        DirtyRect part;
+        if (area.image_part(DirtyRect{rect.x - area.x, rect.y - area.y, rect.width, rect.height}, part))
+            parts.push_back(part);
+    }
+}
+
+// Encodes a chunk from its full record on, with an encoder of its own that starts on a keyframe.
+static void encode_chunk(void *arg)
+{
+    auto chunk = (SpoolChunk *)arg;
+    auto &job = *chunk->job;
+    auto &options = *job.options;
+    FrameBuffer pixels;
+    FrameBuffer planes;
+    vpx_image_t img = vpx_image_t();
+    FrameConverter converter;
+    unique_ptr<Encoder> encoder;
+    CaptureArea area;
+    size_t stride = 0;
+    vector<DirtyRect> parts;
+    auto drain = [&]() {
+        bool got_packets = false;
+        EncodedPacket packet;
+        while (encoder->next_packet(packet))
+        {
+            got_packets = true;
+            chunk->events.push_back(ChunkEvent{chunk->data.size(), packet.size, packet.pts, packet.duration,
+                                               packet.keyframe, false});
+            chunk->data.insert(chunk->data.end(), packet.data, packet.data + packet.size);
+        }
+        return got_packets;
+    };
+
+    for (size_t i = chunk->first; i < chunk->last; ++i)
+    {
+        auto &frame = job.spool->frames[i];
+        auto &record = frame.record;
+        if (record.type == SPOOL_REPEAT)
+        {
+            if (encoder)
+                chunk->events.push_back(ChunkEvent{0, 0, record.pts + record.duration, 0, false, true});
+            continue;
+        }
+        parts.clear();
+        if (record.type == SPOOL_FULL)
+        {
+            if (!job.area->clip(record.width, record.height, area))
+            {
+                debug("Skipping frames of %dx%d, which leave nothing to encode\n", record.width, record.height);
+                break;
+            }
+            stride = size_t(record.width) * pixel_size(PixelFormat(record.format));
+            pixels.resize(stride * record.height);
+            memcpy(pixels.data(), frame.payload, pixels.size());
+            int pwidth = area.width / area.downscale;
+            int pheight = area.height / area.downscale;
+            wrap_image(img, planes, options.image_format(), pwidth, pheight);
+            converter.select(PixelFormat(record.format), options.full_chroma, options.colour(), pwidth,
+                             area.downscale);
+            encoder = open_encoder(pwidth, pheight, options);
+            chunk->info = stream_info(*encoder, pwidth, pheight, options);
+            chunk->encoded = true;
+            parts.push_back(DirtyRect{0, 0, pwidth, pheight});
+        }
+        else
+        {
+            apply_delta(frame, pixels.data(), stride, area, parts);
+        }
+
+        auto origin = pixels.data() + area.y * stride + area.x * pixel_size(converter.format);
+        for (auto &part : parts)
+            update_image(img, converter, origin, stride, part.x, part.y, part.width, part.height);
+        bool periodic = !options.auto_keyframes && options.keyframe_interval > 0 &&
+                        chunk->frames_encoded % options.keyframe_interval == 0;
+        encoder->encode(&img, record.pts, record.duration, chunk->frames_encoded == 0 || periodic);
+        ++chunk->frames_encoded;
+        drain();
+    }
+    if (encoder)
+    {
+        do
+            encoder->encode(nullptr, 0, 1, false);
+        while (drain());
+    }
+
+    lock_guard<mutex> guard(job.lock);
+    chunk->done = true;
+    job.chunk_done.notify_all();
+}
+
+int encode_spool(const string &name, const vector<string> &outputs, const SinkOptions &sink_options,
+                 const EncoderOptions &options, const CaptureArea &area, int workers)
+{
+    SpoolReader spool(name);
+    SpoolEncode job;
+    job.spool = &spool;
+    job.options = &options;
+    job.area = &area;
+    for (size_t i = 0; i < spool.frames.size(); ++i)
+    {
+        if (spool.frames[i].record.type == SPOOL_FULL)
+            job.chunks.push_back(SpoolChunk{&job, i, i, {}, {}, 0, StreamInfo(), false, false});
+        if (!job.chunks.empty())
+            job.chunks.back().last = i + 1;
+    }
+    if (job.chunks.empty())
+        fatal("%s has no frames to encode\n", name.c_str());
+    debug("Encoding %zu records of %s in %zu chunks\n", spool.frames.size(), name.c_str(), job.chunks.size());
+
+    vector<unique_ptr<Sink>> sinks;
+    for (auto &output : outputs)
+        sinks.push_back(open_sink(output, sink_options));
+    vector<unique_ptr<ContainerWriter>> containers;
+    // What the containers were last told about the stream, which each chunk encodes afresh.
+    StreamInfo info = StreamInfo();
+    ThreadPool pool(workers);
+    size_t ahead = pool.size() * CHUNKS_AHEAD_PER_WORKER;
+    size_t submitted = 0;
+    int frames = 0;
+    for (auto &chunk : job.chunks)
+    {
+        for (; submitted < job.chunks.size() && submitted < size_t(&chunk - job.chunks.data()) + ahead; ++submitted)
+            pool.submit(encode_chunk, &job.chunks[submitted]);
+        {
+            unique_lock<mutex> guard(job.lock);
+            job.chunk_done.wait(guard, [&] { return chunk.done; });
+        }
+        if (containers.empty() && chunk.encoded)
+        {
+            for (auto &sink : sinks)
+                containers.push_back(open_container_writer(sink.get(), chunk.info));
+        }
+        else if (chunk.encoded && (chunk.info.width != info.width || chunk.info.height != info.height ||
+                                   chunk.info.codec_private != info.codec_private))
+        {
+            for (auto &container : containers)
+                container->resize(chunk.info);
+        }
+        if (chunk.encoded)
+            info = chunk.info;
+        for (auto &event : chunk.events)
+        {
+            for (auto &container : containers)
+            {
+                if (event.extend)
+                    container->extend(event.pts);
+                else if (!container->write_frame(chunk.data.data() + event.offset, event.size, event.pts,
+                                                 event.duration, event.keyframe))
+                    fatal("Failed to write compressed frame to %s\n", container->sink->name.c_str());
+            }
+        }
+        frames += chunk.frames_encoded;
+        vector<uint8_t>().swap(chunk.data);
+        vector<ChunkEvent>().swap(chunk.events);
+    }
+    if (containers.empty())
+        fatal("No frame of %s leaves anything to encode\n", name.c_str());
+    for (auto &container : containers)
+    {
+        container->extend(spool.end_pts);
+        container->finish();
+    }
+    return frames;
+}
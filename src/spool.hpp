@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "convert.hpp"
+#include "damage.hpp"
+#include "sink.hpp"
+
+struct CaptureArea;
+struct EncoderOptions;
+
+// A spool holds a recording as it was captured, so that capture never waits on the encoder and
+// `lvsc encode` compresses it later. It starts with SPOOL_MAGIC and is followed by records, each a
+// SpoolRecord and then its pixels, packed tightly row after row in the format it was captured in.
+// A full record is the whole screen, a delta record only the rectangles that changed, listed
+// before their pixels, and a repeat record has no pixels. Every change of resolution or format
+// starts with a full record, and so does every chunk of frames the encode can work on on its own.
+// Records are in the byte order of the machine that wrote them.
+static const char SPOOL_MAGIC[8] = {'L', 'V', 'S', 'C', 'S', 'P', 'L', '1'};
+
+// The space after a spool is grown by this much at a time, and mapped a window at a time.
+static const size_t SPOOL_EXTENT_SIZE = 64 << 20;
+
+// A zero type marks the end of what was written, when the recording was not finished.
+enum SpoolRecordType : uint32_t
+{
+    SPOOL_FULL = 1,
+    SPOOL_DELTA = 2,
+    SPOOL_REPEAT = 3,
+    SPOOL_END = 4,
+};
+
+struct SpoolRecord
+{
+    uint32_t type;
+    uint32_t format;
+    int32_t width;
+    int32_t height;
+    int64_t pts;
+    int64_t duration;
+    uint32_t rects;
+    uint32_t reserved;
+    // The bytes that follow the record.
+    uint64_t size;
+};
+
+// Writes the frames of one recording into a spool through a shared mapping of the file, which
+// grows in extents that are allocated up front so that a full disk fails here rather than on a
+// page fault. Each extent is handed to writeback once it is filled.
+struct SpoolWriter
+{
+    std::string name;
+    int fd;
+    uint8_t *window;
+    size_t window_start;
+    size_t position;
+    PixelFormat format;
+    int width;
+    int height;
+    int frames_written;
+    int frames_since_full;
+    // Where the last frame written ends.
+    int64_t end_pts;
+
+    // Adds a frame of layout, whose pixels start at pixels, as a full record.
+    void write_full(const uint8_t *pixels, const FrameLayout &layout, int64_t pts, int64_t duration);
+
+    // Adds only the rectangles of the frame that changed since the last record.
+    void write_delta(const uint8_t *pixels, const FrameLayout &layout, const std::vector<DirtyRect> &rects,
+                     int64_t pts, int64_t duration);
+
+    // Shows the last frame for another frame from pts.
+    void write_repeat(int64_t pts, int64_t duration);
+
+    // Ends the spool with the last frame shown until end_pts, and cuts the file down to what was
+    // written.
+    void finish(int64_t end_pts);
+
+    ~SpoolWriter();
+
+    explicit SpoolWriter(const std::string &name);
+
+    SpoolWriter(const SpoolWriter &o) = delete;
+
+private:
+    void write(const void *data, size_t size);
+    void write_rect(const uint8_t *pixels, const FrameLayout &layout, const DirtyRect &rect);
+    void map_window(size_t start);
+};
+
+// One record of a spool and where its pixels are in the mapping.
+struct SpoolFrame
+{
+    SpoolRecord record;
+    const uint8_t *payload;
+};
+
+// Maps a spool and indexes its records. A spool whose recording was cut short ends at its last
+// complete record.
+struct SpoolReader
+{
+    std::string name;
+    const uint8_t *data;
+    size_t size;
+    std::vector<SpoolFrame> frames;
+    int64_t end_pts;
+
+    ~SpoolReader();
+
+    explicit SpoolReader(const std::string &name);
+
+    SpoolReader(const SpoolReader &o) = delete;
+};
+
+// Encodes the spool at name into outputs. The spool is split at its full records into chunks that
+// each start with a keyframe and are encoded at once on the pool, each with an encoder of its own,
+// and their packets are written to the outputs in order as they complete. area is cropped and
+// downscaled from every frame. Returns the number of frames encoded.
+int encode_spool(const std::string &name, const std::vector<std::string> &outputs, const SinkOptions &sink_options,
+                 const EncoderOptions &options, const CaptureArea &area, int workers);
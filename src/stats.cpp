@@ -0,0 +1,246 @@
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "stats.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+static const string UNIX_PREFIX = "unix:";
+static const string PROMETHEUS_PREFIX = "prometheus:";
+
+// How often the exporter thread checks whether it should stop.
+static const int POLL_INTERVAL_MS = 100;
+
+// The buckets written out for Prometheus, from 1us to about a minute of time and from a few bytes
+// to a gigabyte of data.
+static const int MIN_TIME_BUCKET = 10;
+static const int MAX_TIME_BUCKET = 36;
+static const int MIN_SIZE_BUCKET = 6;
+static const int MAX_SIZE_BUCKET = 30;
+
+uint64_t Histogram::percentile(double p) const
+{
+    uint64_t total = count.load(memory_order_relaxed);
+    if (total == 0)
+        return 0;
+    uint64_t wanted = max<uint64_t>(1, ceil(p * total));
+    uint64_t seen = 0;
+    for (int bucket = 0; bucket < BUCKETS; ++bucket)
+    {
+        seen += buckets[bucket].load(memory_order_relaxed);
+        if (seen >= wanted)
+            return bucket >= 64 ? UINT64_MAX : uint64_t(1) << bucket;
+    }
+    return UINT64_MAX;
+}
+
+Histogram::Histogram() : count(0), sum(0)
+{
+    for (auto &bucket : buckets)
+        bucket = 0;
+}
+
+PipelineStats::PipelineStats()
+    : screenshot_bytes(0), frames_captured(0), frames_unchanged(0), frames_dropped(0), frames_late(0),
+      captured_depth(0), converted_depth(0)
+{
+}
+
+static double to_ms(uint64_t ns)
+{
+    return ns / 1e6;
+}
+
+static double mean(const Histogram &histogram)
+{
+    uint64_t count = histogram.count.load(memory_order_relaxed);
+    return count ? double(histogram.sum.load(memory_order_relaxed)) / count : 0;
+}
+
+string format_stats_line(const string &name, const PipelineStats &stats)
+{
+    char line[512];
+    snprintf(line, sizeof(line),
+             "stats %s: screenshot p50 %.1fms p99 %.1fms %.1fMB, convert p50 %.1fms p99 %.1fms, "
+             "encode p50 %.1fms p99 %.1fms, packets %.0fB avg, frames %llu captured %llu unchanged %llu dropped "
+             "%llu late, queues %llu/%llu\n",
+             name.c_str(), to_ms(stats.screenshot_ns.percentile(0.5)), to_ms(stats.screenshot_ns.percentile(0.99)),
+             stats.screenshot_bytes / 1e6, to_ms(stats.convert_ns.percentile(0.5)), to_ms(stats.convert_ns.percentile(0.99)),
+             to_ms(stats.encode_ns.percentile(0.5)), to_ms(stats.encode_ns.percentile(0.99)), mean(stats.packet_bytes),
+             (unsigned long long)stats.frames_captured, (unsigned long long)stats.frames_unchanged,
+             (unsigned long long)stats.frames_dropped, (unsigned long long)stats.frames_late,
+             (unsigned long long)stats.captured_depth, (unsigned long long)stats.converted_depth);
+    return line;
+}
+
+// Label values may not contain an unescaped quote, backslash or newline.
+static string label(const string &name)
+{
+    string escaped;
+    for (char c : name)
+    {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        escaped += c == '\n' ? 'n' : c;
+    }
+    return "domain=\"" + escaped + "\"";
+}
+
+static void append(string &out, const char *fmt, ...)
+{
+    char line[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    out += line;
+}
+
+static void append_histogram(string &out, const char *metric, const char *help, double scale, int min_bucket,
+                             int max_bucket, const StatsSources &sources, const Histogram PipelineStats::*field)
+{
+    append(out, "# HELP %s %s\n# TYPE %s histogram\n", metric, help, metric);
+    for (auto &source : sources)
+    {
+        auto &histogram = source.second->*field;
+        auto labels = label(source.first);
+        uint64_t cumulative = 0;
+        for (int bucket = 0; bucket <= max_bucket; ++bucket)
+        {
+            cumulative += histogram.buckets[bucket].load(memory_order_relaxed);
+            if (bucket >= min_bucket)
+                append(out, "%s_bucket{%s,le=\"%.9g\"} %llu\n", metric, labels.c_str(), ldexp(1.0, bucket) * scale,
+                       (unsigned long long)cumulative);
+        }
+        append(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", metric, labels.c_str(), (unsigned long long)histogram.count);
+        append(out, "%s_sum{%s} %g\n", metric, labels.c_str(), histogram.sum * scale);
+        append(out, "%s_count{%s} %llu\n", metric, labels.c_str(), (unsigned long long)histogram.count);
+    }
+}
+
+string format_prometheus(const StatsSources &sources)
+{
+    string out;
+    append_histogram(out, "lvsc_screenshot_seconds", "Time to take and receive a screenshot.", 1e-9,
+                     MIN_TIME_BUCKET, MAX_TIME_BUCKET, sources, &PipelineStats::screenshot_ns);
+    append_histogram(out, "lvsc_convert_seconds", "Time to convert a screenshot to I420.", 1e-9,
+                     MIN_TIME_BUCKET, MAX_TIME_BUCKET, sources, &PipelineStats::convert_ns);
+    append_histogram(out, "lvsc_encode_seconds", "Time to encode a frame.", 1e-9,
+                     MIN_TIME_BUCKET, MAX_TIME_BUCKET, sources, &PipelineStats::encode_ns);
+    append_histogram(out, "lvsc_packet_bytes", "Size of the compressed packets.", 1,
+                     MIN_SIZE_BUCKET, MAX_SIZE_BUCKET, sources, &PipelineStats::packet_bytes);
+
+    out += "# HELP lvsc_screenshot_bytes_total Screenshot data received from libvirt.\n"
+           "# TYPE lvsc_screenshot_bytes_total counter\n";
+    for (auto &source : sources)
+        append(out, "lvsc_screenshot_bytes_total{%s} %llu\n", label(source.first).c_str(),
+               (unsigned long long)source.second->screenshot_bytes);
+
+    out += "# HELP lvsc_frames_total Screenshots by what became of them.\n"
+           "# TYPE lvsc_frames_total counter\n";
+    for (auto &source : sources)
+    {
+        auto labels = label(source.first);
+        auto &stats = *source.second;
+        append(out, "lvsc_frames_total{%s,result=\"captured\"} %llu\n", labels.c_str(), (unsigned long long)stats.frames_captured);
+        append(out, "lvsc_frames_total{%s,result=\"unchanged\"} %llu\n", labels.c_str(), (unsigned long long)stats.frames_unchanged);
+        append(out, "lvsc_frames_total{%s,result=\"dropped\"} %llu\n", labels.c_str(), (unsigned long long)stats.frames_dropped);
+        append(out, "lvsc_frames_total{%s,result=\"late\"} %llu\n", labels.c_str(), (unsigned long long)stats.frames_late);
+    }
+
+    out += "# HELP lvsc_queue_depth Frames waiting for the next stage.\n"
+           "# TYPE lvsc_queue_depth gauge\n";
+    for (auto &source : sources)
+    {
+        auto labels = label(source.first);
+        append(out, "lvsc_queue_depth{%s,queue=\"captured\"} %llu\n", labels.c_str(), (unsigned long long)source.second->captured_depth);
+        append(out, "lvsc_queue_depth{%s,queue=\"converted\"} %llu\n", labels.c_str(), (unsigned long long)source.second->converted_depth);
+    }
+    return out;
+}
+
+// Replaces the file in one step so that a collector never reads half of it.
+static void write_prometheus_file(const string &path, const string &text)
+{
+    auto temporary = path + ".tmp";
+    FILE *file = fopen(temporary.c_str(), "w");
+    if (!file)
+    {
+        debug("Failed to write statistics to %s\n", temporary.c_str());
+        return;
+    }
+    fwrite(text.data(), 1, text.size(), file);
+    if (fclose(file) != 0 || rename(temporary.c_str(), path.c_str()) != 0)
+        debug("Failed to write statistics to %s\n", path.c_str());
+}
+
+void StatsExporter::run()
+{
+    auto next_export = chrono::steady_clock::now() + chrono::milliseconds(interval_ms);
+    while (running)
+    {
+        if (listener >= 0)
+        {
+            int client = accept_client(listener, POLL_INTERVAL_MS);
+            if (client >= 0)
+            {
+                auto text = format_prometheus(sources);
+                for (size_t sent = 0; sent < text.size();)
+                {
+                    auto res = send(client, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+                    if (res <= 0)
+                        break;
+                    sent += res;
+                }
+                close(client);
+            }
+            continue;
+        }
+
+        this_thread::sleep_for(chrono::milliseconds(POLL_INTERVAL_MS));
+        if (chrono::steady_clock::now() < next_export)
+            continue;
+        next_export += chrono::milliseconds(interval_ms);
+        if (target.substr(0, PROMETHEUS_PREFIX.size()) == PROMETHEUS_PREFIX)
+        {
+            write_prometheus_file(target.substr(PROMETHEUS_PREFIX.size()), format_prometheus(sources));
+        }
+        else
+        {
+            for (auto &source : sources)
+                fputs(format_stats_line(source.first, *source.second).c_str(), stderr);
+        }
+    }
+}
+
+StatsExporter::StatsExporter(const StatsSources &sources, const string &target, int interval_ms)
+    : sources(sources), target(target), interval_ms(interval_ms), running(true), listener(-1)
+{
+    if (target.substr(0, UNIX_PREFIX.size()) == UNIX_PREFIX)
+    {
+        auto path = target.substr(UNIX_PREFIX.size());
+        listener = listen_unix(path);
+        if (listener < 0)
+            fatal("Could not listen for statistics on %s\n", path.c_str());
+    }
+    else if (target != "stderr" && target.substr(0, PROMETHEUS_PREFIX.size()) != PROMETHEUS_PREFIX)
+    {
+        fatal("Unknown statistics target %s, expected stderr, prometheus:<path> or unix:<path>\n", target.c_str());
+    }
+    thread = std::thread([this]() { run(); });
+}
+
+StatsExporter::~StatsExporter()
+{
+    running = false;
+    thread.join();
+    if (listener >= 0)
+    {
+        close(listener);
+        unlink(target.substr(UNIX_PREFIX.size()).c_str());
+    }
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+// A histogram with a bucket per power of two, so recording is a couple of relaxed atomic adds and
+// can stay on in production. Bucket b holds the values from 2^(b-1) + 1 up to 2^b.
+struct Histogram
+{
+    static const int BUCKETS = 65;
+
+    std::atomic<uint64_t> buckets[BUCKETS];
+    std::atomic<uint64_t> count;
+    std::atomic<uint64_t> sum;
+
+    void record(uint64_t value)
+    {
+        int bucket = value <= 1 ? 0 : 64 - __builtin_clzll(value - 1);
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    // An upper bound on the p quantile, within a factor of two of the true value.
+    uint64_t percentile(double p) const;
+
+    Histogram();
+
+    Histogram(const Histogram &o) = delete;
+};
+
+// What one domain's pipeline is doing: how long each stage takes, how much data moves through it
+// and how many frames it loses. Times are in nanoseconds.
+struct PipelineStats
+{
+    Histogram screenshot_ns;
+    Histogram convert_ns;
+    Histogram encode_ns;
+    Histogram packet_bytes;
+    std::atomic<uint64_t> screenshot_bytes;
+    std::atomic<uint64_t> frames_captured;
+    std::atomic<uint64_t> frames_unchanged;
+    std::atomic<uint64_t> frames_dropped;
+    std::atomic<uint64_t> frames_late;
+    // Queue depths as of the last push.
+    std::atomic<uint64_t> captured_depth;
+    std::atomic<uint64_t> converted_depth;
+
+    PipelineStats();
+
+    PipelineStats(const PipelineStats &o) = delete;
+};
+
+typedef std::vector<std::pair<std::string, const PipelineStats *>> StatsSources;
+
+// A one line summary of a domain for the log.
+std::string format_stats_line(const std::string &name, const PipelineStats &stats);
+
+// Every domain's statistics in the Prometheus text exposition format.
+std::string format_prometheus(const StatsSources &sources);
+
+// Exports the statistics from a thread of its own, either as a line per domain on stderr every
+// interval, to a Prometheus text file rewritten every interval, or to whoever connects to a Unix
+// socket. The target is "stderr", "prometheus:<path>" or "unix:<path>".
+struct StatsExporter
+{
+    StatsSources sources;
+    std::string target;
+    int interval_ms;
+    std::thread thread;
+    std::atomic<bool> running;
+    int listener;
+
+    StatsExporter(const StatsSources &sources, const std::string &target, int interval_ms);
+    ~StatsExporter();
+
+    StatsExporter(const StatsExporter &o) = delete;
+
+private:
+    void run();
+};
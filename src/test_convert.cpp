@@ -0,0 +1,357 @@
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+#include "convert.hpp"
+#include "damage.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+// Checks that every conversion kernel and packed format matches convert_rgb24_to_i420_reference
+// bit for bit, on regions of odd sizes that start part way into a larger frame, and that images
+// brought up to date from the damage tracker end up the same as ones converted in full.
+
+static int failures = 0;
+
+static void fail(const string &what)
+{
+    output("FAILED %s\n", what.c_str());
+    ++failures;
+}
+
+// Random bytes, a quarter of them 0 and a quarter 255, where the largest sums and the clamping are.
+static vector<uint8_t> random_bytes(size_t size, mt19937 &random)
+{
+    vector<uint8_t> bytes(size);
+    for (auto &byte : bytes)
+    {
+        auto value = random();
+        byte = value % 4 == 0 ? 0 : value % 4 == 1 ? 255 : uint8_t(value >> 8);
+    }
+    return bytes;
+}
+
+// The three planes of an image, with odd strides and a row of padding either side, all filled with
+// the same byte so that comparing two images also catches writes outside them.
+struct TestImage
+{
+    int strides[3];
+    vector<uint8_t> data[3];
+    uint8_t *planes[3];
+
+    TestImage(int width, int height, bool full_chroma)
+    {
+        for (int i = 0; i < 3; ++i)
+        {
+            int plane_width = i == 0 || full_chroma ? width : (width + 1) / 2;
+            int plane_height = i == 0 || full_chroma ? height : (height + 1) / 2;
+            strides[i] = plane_width + 7;
+            data[i].assign(size_t(strides[i]) * (plane_height + 2), 0xA5);
+            planes[i] = data[i].data() + strides[i];
+        }
+    }
+
+    bool operator==(const TestImage &o) const
+    {
+        return data[0] == o.data[0] && data[1] == o.data[1] && data[2] == o.data[2];
+    }
+
+    TestImage(const TestImage &o) = delete;
+};
+
+// Unpacks pixels of format into RGB 24 bit, as the converters read them.
+static vector<uint8_t> to_rgb24(const uint8_t *src, size_t src_stride, int width, int height, PixelFormat format)
+{
+    vector<uint8_t> rgb(size_t(width) * height * 3);
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            const uint8_t *p = src + y * src_stride + x * pixel_size(format);
+            uint8_t *out = &rgb[(size_t(y) * width + x) * 3];
+            if (format == PIXEL_RGB24)
+            {
+                memcpy(out, p, 3);
+            }
+            else if (format == PIXEL_BGRX32)
+            {
+                out[0] = p[2];
+                out[1] = p[1];
+                out[2] = p[0];
+            }
+            else
+            {
+                unsigned value = p[0] | p[1] << 8;
+                unsigned r5 = value >> 11, g6 = (value >> 5) & 0x3F, b5 = value & 0x1F;
+                out[0] = r5 << 3 | r5 >> 2;
+                out[1] = g6 << 2 | g6 >> 4;
+                out[2] = b5 << 3 | b5 >> 2;
+            }
+        }
+    }
+    return rgb;
+}
+
+// What any converter must produce from RGB 24 bit. I444 comes from the reference run on the pixels
+// doubled in both directions, where every 2x2 block averages to the pixel it came from.
+static void expected_image(const vector<uint8_t> &rgb, int width, int height, bool full_chroma,
+                           const ColourTransform &colour, TestImage &image)
+{
+    if (colour.matrix == MATRIX_GBR)
+    {
+        for (int y = 0; y < height; ++y)
+        {
+            for (int x = 0; x < width; ++x)
+            {
+                const uint8_t *p = &rgb[(size_t(y) * width + x) * 3];
+                image.planes[0][y * image.strides[0] + x] = p[1];
+                image.planes[1][y * image.strides[1] + x] = p[2];
+                image.planes[2][y * image.strides[2] + x] = p[0];
+            }
+        }
+        return;
+    }
+    if (!full_chroma)
+    {
+        convert_rgb24_to_i420_reference(rgb.data(), size_t(width) * 3, width, height, image.planes, image.strides,
+                                        colour);
+        return;
+    }
+    vector<uint8_t> doubled(size_t(width) * height * 12);
+    for (int y = 0; y < height * 2; ++y)
+    {
+        for (int x = 0; x < width * 2; ++x)
+            memcpy(&doubled[(size_t(y) * width * 2 + x) * 3], &rgb[(size_t(y / 2) * width + x / 2) * 3], 3);
+    }
+    TestImage large(width * 2, height * 2, false);
+    convert_rgb24_to_i420_reference(doubled.data(), size_t(width) * 6, width * 2, height * 2, large.planes,
+                                    large.strides, colour);
+    for (int y = 0; y < height; ++y)
+    {
+        for (int x = 0; x < width; ++x)
+        {
+            image.planes[0][y * image.strides[0] + x] = large.planes[0][y * 2 * large.strides[0] + x * 2];
+            image.planes[1][y * image.strides[1] + x] = large.planes[1][y * large.strides[1] + x];
+            image.planes[2][y * image.strides[2] + x] = large.planes[2][y * large.strides[2] + x];
+        }
+    }
+}
+
+static const char *const MATRIX_NAMES[] = {"BT.601", "BT.709", "GBR"};
+static const char *const FORMAT_NAMES[] = {"RGB24", "BGRX32", "RGB565"};
+
+// Converts regions of a random frame of format with converter and compares them with the
+// reference. Widths the packed converters have versions of their own for are tried too.
+static void check_converter(const string &kernel, PixelFormat format, bool full_chroma, const ColourTransform &colour,
+                            mt19937 &random)
+{
+    static const int WIDTHS[] = {1, 2, 3, 15, 16, 17, 31, 32, 33, 47, 63, 65, 101, 640, 1366};
+    static const int HEIGHTS[] = {1, 2, 3, 5};
+    static const int OFFSETS[] = {0, 2, 6};
+    const int frame_width = 1366 + 6;
+    const int frame_height = 5 + 6;
+    size_t frame_stride = size_t(frame_width) * pixel_size(format) + 5;
+    auto frame = random_bytes(frame_stride * frame_height, random);
+    for (int width : WIDTHS)
+    {
+        auto converter = find_converter(format, full_chroma, colour, width);
+        for (int height : HEIGHTS)
+        {
+            for (int offset : OFFSETS)
+            {
+                if (width + offset > frame_width)
+                    continue;
+                const uint8_t *src = frame.data() + offset * frame_stride + offset * pixel_size(format);
+                TestImage actual(width, height, full_chroma);
+                TestImage expected(width, height, full_chroma);
+                converter(src, frame_stride, width, height, actual.planes, actual.strides, colour);
+                expected_image(to_rgb24(src, frame_stride, width, height, format), width, height, full_chroma,
+                               colour, expected);
+                if (!(actual == expected))
+                    fail(kernel + " " + FORMAT_NAMES[format] + (full_chroma ? " I444 " : " I420 ") +
+                         MATRIX_NAMES[colour.matrix] + (colour.full_range ? " full " : " limited ") +
+                         to_string(width) + "x" + to_string(height) + " at " + to_string(offset));
+            }
+        }
+    }
+}
+
+static void check_kernels(mt19937 &random)
+{
+    static const char *const KERNELS[] = {"scalar", "ssse3", "avx2", "neon"};
+    for (auto kernel : KERNELS)
+    {
+        if (!select_converter(kernel))
+        {
+            output("Skipping the %s kernel, which this machine does not have\n", kernel);
+            continue;
+        }
+        for (bool full_range : {false, true})
+        {
+            for (auto matrix : {MATRIX_BT601, MATRIX_BT709})
+                check_converter(kernel, PIXEL_RGB24, false, colour_transform(matrix, full_range), random);
+        }
+        check_converter(kernel, PIXEL_RGB24, true, colour_transform(MATRIX_GBR, true), random);
+    }
+    select_converter("auto");
+}
+
+// The packed formats other than RGB 24 bit to I420 do not go through the kernels.
+static void check_packed_formats(mt19937 &random)
+{
+    for (auto format : {PIXEL_RGB24, PIXEL_BGRX32, PIXEL_RGB565})
+    {
+        for (bool full_chroma : {false, true})
+        {
+            for (bool full_range : {false, true})
+            {
+                for (auto matrix : {MATRIX_BT601, MATRIX_BT709})
+                    check_converter("packed", format, full_chroma, colour_transform(matrix, full_range), random);
+            }
+        }
+        if (format != PIXEL_RGB24)
+            check_converter("packed", format, true, colour_transform(MATRIX_GBR, true), random);
+    }
+}
+
+// Shrinks frames by every factor and compares them with the reference run on blocks averaged one
+// at a time. Each block holds a value and the value one above it in a random mix, so that the
+// rounded average lands on every side of a half.
+static void check_downscale(mt19937 &random)
+{
+    const ColourTransform &colour = colour_transform(MATRIX_BT601, false);
+    for (int factor = 2; factor <= MAX_DOWNSCALE; ++factor)
+    {
+        const int area = factor * factor;
+        const int out_width = 37;
+        const int out_height = 5;
+        const int width = out_width * factor + factor - 1;
+        const int height = out_height * factor + 1;
+        vector<uint8_t> frame(size_t(width) * height * 3);
+        for (int by = 0; by < out_height; ++by)
+        {
+            for (int bx = 0; bx < out_width; ++bx)
+            {
+                for (int c = 0; c < 3; ++c)
+                {
+                    int base = random() % 255;
+                    int above = random() % (area + 1);
+                    for (int i = 0; i < area; ++i)
+                        frame[(size_t(by * factor + i / factor) * width + bx * factor + i % factor) * 3 + c] =
+                            base + (i < above);
+                }
+            }
+        }
+        vector<uint8_t> averaged(size_t(out_width) * out_height * 3);
+        for (int y = 0; y < out_height; ++y)
+        {
+            for (int x = 0; x < out_width * 3; ++x)
+            {
+                int total = 0;
+                for (int i = 0; i < area; ++i)
+                {
+                    int column = (x / 3) * factor + i % factor;
+                    total += frame[(size_t(y * factor + i / factor) * width + column) * 3 + x % 3];
+                }
+                averaged[size_t(y) * out_width * 3 + x] = (total + area / 2) / area;
+            }
+        }
+
+        FrameConverter converter;
+        converter.select(PIXEL_RGB24, false, colour, out_width, factor);
+        TestImage actual(out_width, out_height, false);
+        TestImage expected(out_width, out_height, false);
+        converter.convert(frame.data(), size_t(width) * 3, width, height, actual.planes, actual.strides);
+        expected_image(averaged, out_width, out_height, false, colour, expected);
+        if (!(actual == expected))
+            fail("downscale by " + to_string(factor));
+    }
+}
+
+// One pipeline slot, which keeps its image between frames and only converts what changed since the
+// frame it last held.
+struct DamageSlot
+{
+    TestImage image;
+    uint64_t converted_serial;
+
+    DamageSlot(int width, int height) : image(width, height, false), converted_serial(0)
+    {
+    }
+};
+
+// Runs frames through slots the way the recorder does, with some frames dropped after they were
+// converted, and checks that every frame encoded matches its full conversion and that the screen
+// the encoder last saw is always the latest one. A converted frame that is dropped has moved the
+// damage tracker on, so the frame after it has to be encoded even when the tracker finds nothing
+// changed.
+static void check_damage(mt19937 &random)
+{
+    const int width = 150;
+    const int height = 70;
+    const size_t stride = width * 3;
+    const ColourTransform &colour = colour_transform(MATRIX_BT601, false);
+    FrameConverter converter;
+    converter.select(PIXEL_RGB24, false, colour, width, 1);
+    DamageTracker damage;
+    DamageSlot slots[] = {{width, height}, {width, height}, {width, height}};
+    auto screen = random_bytes(stride * height, random);
+    vector<uint8_t> encoded;
+    bool resync = false;
+    for (int frame = 0; frame < 60; ++frame)
+    {
+        // Some frames change a pixel or a box, and the rest repeat the one before.
+        if (frame % 3 == 0)
+        {
+            screen[(random() % height) * stride + random() % stride] ^= 0xFF;
+        }
+        else if (frame % 3 == 1)
+        {
+            int x = random() % (width - 20), y = random() % (height - 10);
+            for (int row = y; row < y + 10; ++row)
+                memset(&screen[row * stride + x * 3], frame * 5, 20 * 3);
+        }
+        bool dropped = frame % 7 == 3 || frame % 11 == 5;
+        auto &slot = slots[frame % 3];
+
+        bool changed = damage.update(screen.data(), stride, 3, width, height) > 0;
+        if (!changed && !resync)
+        {
+            if (encoded != screen)
+                fail("damage repeat of frame " + to_string(frame) + " left a dropped change out");
+            continue;
+        }
+        resync = false;
+        damage.for_each_dirty_run(slot.converted_serial, [&](int x, int y, int w, int h) {
+            uint8_t *planes[3] = {slot.image.planes[0] + y * slot.image.strides[0] + x,
+                                  slot.image.planes[1] + y / 2 * slot.image.strides[1] + x / 2,
+                                  slot.image.planes[2] + y / 2 * slot.image.strides[2] + x / 2};
+            converter.convert(screen.data() + y * stride + x * 3, stride, w, h, planes, slot.image.strides);
+        });
+        slot.converted_serial = damage.serial;
+        if (dropped)
+        {
+            resync = true;
+            continue;
+        }
+
+        TestImage expected(width, height, false);
+        expected_image(screen, width, height, false, colour, expected);
+        if (!(slot.image == expected))
+            fail("damage conversion of frame " + to_string(frame));
+        encoded = screen;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    mt19937 random(2024);
+    check_kernels(random);
+    check_packed_formats(random);
+    check_downscale(random);
+    check_damage(random);
+    if (failures > 0)
+        output("%d conversions did not match\n", failures);
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,82 @@
+#include <arpa/inet.h>
+#include <cstring>
+#include <netinet/in.h>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "container.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+// Checks that a live TCP address ending in .ivf opens a listener and serves IVF to a viewer.
+
+static int failures = 0;
+
+static void fail(const string &what)
+{
+    output("FAILED %s\n", what.c_str());
+    ++failures;
+}
+
+// A loopback port nothing is listening on, found by binding to port 0.
+static int free_port()
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = sockaddr_in();
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t length = sizeof(address);
+    if (fd < 0 || bind(fd, (sockaddr *)&address, sizeof(address)) < 0 ||
+        getsockname(fd, (sockaddr *)&address, &length) < 0)
+        fatal("Could not find a free port\n");
+    close(fd);
+    return ntohs(address.sin_port);
+}
+
+static void check_tcp_ivf()
+{
+    int port = free_port();
+    auto name = "tcp:127.0.0.1:" + to_string(port) + ".ivf";
+    auto sink = open_sink(name);
+    StreamInfo info = StreamInfo();
+    info.fourcc = 0x30395056;
+    info.codec_id = "V_VP9";
+    info.width = 64;
+    info.height = 48;
+    info.timebase_num = 1;
+    info.timebase_den = 1000;
+    auto container = open_container_writer(sink.get(), info);
+
+    int viewer = socket(AF_INET, SOCK_STREAM, 0);
+    sockaddr_in address = sockaddr_in();
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (viewer < 0 || connect(viewer, (sockaddr *)&address, sizeof(address)) < 0)
+    {
+        fail("connecting to " + name);
+        return;
+    }
+    timeval timeout = {5, 0};
+    setsockopt(viewer, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    char header[4];
+    size_t received = 0;
+    while (received < sizeof(header))
+    {
+        auto res = recv(viewer, header + received, sizeof(header) - received, 0);
+        if (res <= 0)
+            break;
+        received += res;
+    }
+    if (received < sizeof(header) || memcmp(header, "DKIF", 4) != 0)
+        fail("the IVF header from " + name);
+    close(viewer);
+    container->finish();
+}
+
+int main(int argc, char **argv)
+{
+    check_tcp_ivf();
+    return failures > 0 ? 1 : 0;
+}
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include "thread_pool.hpp"
+
+using namespace std;
+
+// The index of the pool worker running on this thread, or -1 elsewhere.
+static thread_local int current_worker = -1;
+
+void ThreadPool::submit(void (*run)(void *), void *arg)
+{
+    Task task = {run, arg};
+    bool pushed = false;
+    {
+        unique_lock<mutex> guard(lock);
+        size_t first = current_worker >= 0 ? current_worker : next_queue++ % queues.size();
+        guard.unlock();
+        for (size_t i = 0; i < queues.size() && !pushed; ++i)
+            pushed = queues[(first + i) % queues.size()]->push(task);
+        guard.lock();
+        if (pushed)
+            ++queued;
+    }
+    if (pushed)
+        wake.notify_one();
+    else
+        run(arg);
+}
+
+void ThreadPool::wait_idle()
+{
+    unique_lock<mutex> guard(lock);
+    idle.wait(guard, [&] { return queued <= 0 && active == 0; });
+}
+
+// The calls of a parallel_for, claimed one at a time by the caller and its helpers.
+struct ParallelWork
+{
+    void (*run)(void *, size_t);
+    void *arg;
+    size_t count;
+    atomic<size_t> next;
+    // Helpers that have not finished yet, including those still queued.
+    atomic<size_t> helpers;
+
+    void claim_all()
+    {
+        size_t i;
+        while ((i = next++) < count)
+            run(arg, i);
+    }
+
+    static void help(void *arg)
+    {
+        auto work = (ParallelWork *)arg;
+        work->claim_all();
+        --work->helpers;
+    }
+};
+
+void ThreadPool::parallel_for(size_t count, void (*run)(void *, size_t), void *arg)
+{
+    if (count == 0)
+        return;
+    ParallelWork work = {run, arg, count, {0}, {min(count, queues.size()) - 1}};
+    for (size_t i = work.helpers; i > 0; --i)
+        submit(ParallelWork::help, &work);
+    work.claim_all();
+    // The helpers point at work, so it has to wait for them even once every call has been claimed.
+    while (work.helpers > 0)
+    {
+        if (!run_queued())
+            this_thread::yield();
+    }
+}
+
+bool ThreadPool::run_queued()
+{
+    Task task;
+    if (!take(current_worker >= 0 ? current_worker : 0, task))
+        return false;
+    {
+        lock_guard<mutex> guard(lock);
+        --queued;
+        ++active;
+    }
+    task.run(task.arg);
+    lock_guard<mutex> guard(lock);
+    --active;
+    if (queued <= 0 && active == 0)
+        idle.notify_all();
+    return true;
+}
+
+bool ThreadPool::take(size_t worker, Task &task)
+{
+    for (size_t i = 0; i < queues.size(); ++i)
+    {
+        if (queues[(worker + i) % queues.size()]->try_pop(task))
+            return true;
+    }
+    return false;
+}
+
+void ThreadPool::work(size_t worker)
+{
+    current_worker = worker;
+    unique_lock<mutex> guard(lock);
+    while (true)
+    {
+        wake.wait(guard, [&] { return queued > 0 || stopping; });
+        if (queued <= 0)
+            return;
+
+        // A task counted in queued may still be on its way into a queue, so look again if needed.
+        guard.unlock();
+        Task task;
+        bool found = take(worker, task);
+        guard.lock();
+        if (!found)
+            continue;
+        --queued;
+        ++active;
+        guard.unlock();
+
+        task.run(task.arg);
+
+        guard.lock();
+        --active;
+        if (queued <= 0 && active == 0)
+            idle.notify_all();
+    }
+}
+
+ThreadPool::ThreadPool(int threads) : queued(0), active(0), next_queue(0), stopping(false)
+{
+    for (int i = 0; i < threads; ++i)
+        queues.push_back(make_unique<RingBuffer<Task>>(QUEUE_CAPACITY));
+    for (int i = 0; i < threads; ++i)
+        workers.emplace_back(&ThreadPool::work, this, i);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ring_buffer.hpp"
+
+// A unit of work for the pool. A plain function and argument, so submitting never allocates.
+struct Task
+{
+    void (*run)(void *);
+    void *arg;
+};
+
+// A fixed set of workers, each with its own queue. Tasks submitted from a worker go on that
+// worker's queue and everything else is spread round robin. A worker whose queue is empty steals
+// from the others before going to sleep.
+struct ThreadPool
+{
+    static const size_t QUEUE_CAPACITY = 1024;
+
+    std::vector<std::unique_ptr<RingBuffer<Task>>> queues;
+    std::vector<std::thread> workers;
+    std::mutex lock;
+    std::condition_variable wake;
+    std::condition_variable idle;
+    // Goes briefly negative when a worker takes a task before its submitter has counted it.
+    long queued;
+    size_t active;
+    size_t next_queue;
+    bool stopping;
+
+    void submit(void (*run)(void *), void *arg);
+
+    // Blocks until every queue is empty and no task is running.
+    void wait_idle();
+
+    // Calls run(arg, i) for every i below count, on the calling thread and on as many workers as
+    // pick it up, and returns once all calls are done. While it waits the caller runs queued tasks
+    // itself, so it can be called from a task even when every worker is busy.
+    void parallel_for(size_t count, void (*run)(void *, size_t), void *arg);
+
+    size_t size() const
+    {
+        return workers.size();
+    }
+
+    explicit ThreadPool(int threads);
+    ~ThreadPool();
+
+    ThreadPool(const ThreadPool &o) = delete;
+
+private:
+    bool take(size_t worker, Task &task);
+    bool run_queued();
+    void work(size_t worker);
+};
+
+// Runs the items put on a queue through handle on the pool, one at a time and in order, which is
+// what a stateful stage such as an encoder needs. After a batch the strand goes to the back of the
+// pool so that one busy producer cannot starve the rest.
+template <typename T>
+struct Strand
+{
+    static const int BATCH = 4;
+
+    ThreadPool *pool;
+    RingBuffer<T> *queue;
+    void (*handle)(void *context, T item);
+    void *context;
+    std::atomic<bool> scheduled;
+
+    // Called after pushing onto the queue.
+    void kick()
+    {
+        if (!scheduled.exchange(true))
+            pool->submit(drain, this);
+    }
+
+    static void drain(void *arg)
+    {
+        auto strand = (Strand *)arg;
+        T item;
+        for (int i = 0; i < BATCH; ++i)
+        {
+            if (!strand->queue->try_pop(item))
+            {
+                // Whoever pushes after this point sees the strand idle and schedules it again.
+                strand->scheduled = false;
+                if (strand->queue->size() == 0 || strand->scheduled.exchange(true))
+                    return;
+                continue;
+            }
+            strand->handle(strand->context, item);
+        }
+        strand->pool->submit(drain, strand);
+    }
+
+    Strand(ThreadPool *pool, RingBuffer<T> *queue, void (*handle)(void *, T), void *context) : pool(pool), queue(queue), handle(handle), context(context), scheduled(false)
+    {
+    }
+
+    Strand(const Strand &o) = delete;
+};
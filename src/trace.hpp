@@ -0,0 +1,24 @@
+#pragma once
+
+// Static probes on the hot path, built in with make USDT=1, which needs the systemtap sdt headers.
+// They cost a nop each until a tracer attaches, and are listed by bpftrace -l 'usdt:./lvsc:*' or
+// perf list sdt_lvsc once perf buildid-cache --add has seen the binary. Otherwise they compile to
+// nothing.
+#ifdef LVSC_USDT
+#include <sys/sdt.h>
+
+// Fires the probe lvsc:name with up to 12 integer or pointer arguments.
+#define TRACE_PROBE(name, ...) STAP_PROBEV(lvsc, name, ##__VA_ARGS__)
+
+// Fires lvsc:name_start with the arguments here and lvsc:name_end when the enclosing scope is left,
+// however it is left.
+#define TRACE_SCOPE(name, ...)                                  \
+    TRACE_PROBE(name##_start, ##__VA_ARGS__);                   \
+    struct name##_trace_scope                                   \
+    {                                                           \
+        ~name##_trace_scope() { TRACE_PROBE(name##_end); }      \
+    } name##_trace_scope_instance
+#else
+#define TRACE_PROBE(name, ...) do {} while (0)
+#define TRACE_SCOPE(name, ...) do {} while (0)
+#endif
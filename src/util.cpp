@@ -0,0 +1,75 @@
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "util.hpp"
+
+using namespace std;
+
+bool DEBUG = false;
+bool MESSAGES_TO_STDERR = false;
+
+void perform_debug(const char *fmt, ...)
+{
+    if (DEBUG)
+    {
+        va_list ap;
+        va_start(ap, fmt);
+        vfprintf(stderr, fmt, ap);
+        va_end(ap);
+    }
+}
+
+void fatal(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(EXIT_FAILURE);
+}
+
+void output(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(MESSAGES_TO_STDERR ? stderr : stdout, fmt, ap);
+    va_end(ap);
+}
+
+int parse_int(const char *option, const char *value, int min, int max)
+{
+    char *end;
+    long result = strtol(value, &end, 10);
+    if (*value == '\0' || *end != '\0' || result < min || result > max)
+        fatal("Invalid value %s for %s, expected a number from %d to %d\n", value, option, min, max);
+    return result;
+}
+
+int listen_unix(const string &path)
+{
+    sockaddr_un address = sockaddr_un();
+    address.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(address.sun_path))
+        return -1;
+    path.copy(address.sun_path, path.size());
+    unlink(path.c_str());
+    int listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listener >= 0 && (bind(listener, (sockaddr *)&address, sizeof(address)) < 0 || listen(listener, 16) < 0))
+    {
+        close(listener);
+        listener = -1;
+    }
+    return listener;
+}
+
+int accept_client(int listener, int timeout_ms)
+{
+    pollfd fd = {listener, POLLIN, 0};
+    if (poll(&fd, 1, timeout_ms) <= 0)
+        return -1;
+    return accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+}
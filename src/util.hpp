@@ -0,0 +1,54 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <sys/types.h>
+
+// Maths and endian routines.
+inline uint8_t clamp(ssize_t x)
+{
+    return std::max(std::min(x, ssize_t(255)), ssize_t(0));
+}
+
+inline void mem_put_le16(void *vmem, int val)
+{
+    uint8_t *mem = (uint8_t *)vmem;
+
+    mem[0] = (uint8_t)((val >> 0) & 0xff);
+    mem[1] = (uint8_t)((val >> 8) & 0xff);
+}
+
+inline void mem_put_le32(void *vmem, int val)
+{
+    uint8_t *mem = (uint8_t *)vmem;
+
+    mem[0] = (uint8_t)((val >> 0) & 0xff);
+    mem[1] = (uint8_t)((val >> 8) & 0xff);
+    mem[2] = (uint8_t)((val >> 16) & 0xff);
+    mem[3] = (uint8_t)((val >> 24) & 0xff);
+}
+
+// Output functions
+extern bool DEBUG;
+// Set when stdout carries the recording, so that output() writes to stderr instead.
+extern bool MESSAGES_TO_STDERR;
+
+void perform_debug(const char *fmt, ...);
+
+#define XSTRINGIFY(x) #x
+#define STRINGIFY(x) XSTRINGIFY(x)
+#define debug(...) perform_debug("[" __FILE__ ":" STRINGIFY(__LINE__) "]: " __VA_ARGS__)
+
+[[noreturn]] void fatal(const char *fmt, ...);
+void output(const char *fmt, ...);
+
+// Parses the value of a numeric command line option, exiting if it is not a number in range.
+int parse_int(const char *option, const char *value, int min, int max);
+
+// Socket routines
+// Listens on a Unix socket at path, replacing whatever was there. Returns -1 if it cannot.
+int listen_unix(const std::string &path);
+
+// Waits up to timeout_ms for a connection on listener and accepts it. Returns -1 if none came.
+int accept_client(int listener, int timeout_ms);
@@ -0,0 +1,328 @@
+#include "encoder.hpp"
+#include "util.hpp"
+
+#ifdef LVSC_VAAPI
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <vector>
+#include <va/va.h>
+#include <va/va_drm.h>
+#include <va/va_enc_vp9.h>
+#endif
+
+using namespace std;
+
+#ifdef LVSC_VAAPI
+
+// Only the last frame is predicted from, so two reconstructed surfaces are enough: the one being
+// written and the one it refers to. The input surface is the first of them all.
+static const int RECONSTRUCTED_SURFACES = 2;
+static const int SURFACES = 1 + RECONSTRUCTED_SURFACES;
+static const int VP9_REFERENCE_SLOTS = 8;
+
+// The VP9 quantizer index, which the 0 to 63 cq-level is scaled to.
+static const int MAX_QINDEX = 255;
+
+// The loop filter settings libvpx starts from, the hardware does not pick its own.
+static const int LOOP_FILTER_LEVEL = 16;
+static const int LOOP_FILTER_SHARPNESS = 4;
+
+// VBR lets the bitrate peak at twice the target.
+static const int VBR_PEAK_FACTOR = 2;
+
+// Encodes VP9 on the GPU through VAAPI. Every frame after a keyframe is predicted from the one
+// before it, which suits a screen where most of the picture stays put, and the driver writes the
+// frame headers itself. Frames are encoded one at a time, so nothing is held back to drain.
+struct VaapiEncoder : Encoder
+{
+    EncoderOptions options;
+    int width;
+    int height;
+    int fd;
+    VADisplay display;
+    VAConfigID config;
+    VAContextID context;
+    VASurfaceID surfaces[SURFACES];
+    // The frame is copied into this NV12 image and from there onto the input surface.
+    VAImage image;
+    VABufferID coded;
+    unsigned int rate_control;
+    int qindex;
+    // The reconstructed surface the next frame is written to, the other one holds its reference.
+    int current;
+    bool has_reference;
+    int frames_since_keyframe;
+    vector<uint8_t> packet_bytes;
+    EncodedPacket packet;
+    bool packet_ready;
+
+    void check(VAStatus status, const char *what)
+    {
+        if (status != VA_STATUS_SUCCESS)
+            fatal("VAAPI failed to %s. %s\n", what, vaErrorStr(status));
+    }
+
+    VABufferID create_buffer(VABufferType type, void *data, size_t size)
+    {
+        VABufferID buffer;
+        check(vaCreateBuffer(display, context, type, size, 1, data, &buffer), "create a parameter buffer");
+        return buffer;
+    }
+
+    void upload(const vpx_image_t *img)
+    {
+        uint8_t *data;
+        check(vaMapBuffer(display, image.buf, (void **)&data), "map the upload image");
+        for (int y = 0; y < height; ++y)
+            memcpy(data + image.offsets[0] + y * image.pitches[0], img->planes[0] + y * img->stride[0], width);
+        // NV12 interleaves the two chroma planes of I420.
+        for (int y = 0; y < (height + 1) / 2; ++y)
+        {
+            auto row = data + image.offsets[1] + y * image.pitches[1];
+            auto u = img->planes[1] + y * img->stride[1];
+            auto v = img->planes[2] + y * img->stride[2];
+            for (int x = 0; x < (width + 1) / 2; ++x)
+            {
+                row[2 * x] = u[x];
+                row[2 * x + 1] = v[x];
+            }
+        }
+        check(vaUnmapBuffer(display, image.buf), "unmap the upload image");
+        check(vaPutImage(display, surfaces[0], image.image_id, 0, 0, width, height, 0, 0, width, height),
+              "upload a frame");
+    }
+
+    void encode(const vpx_image_t *img, int64_t pts, int64_t duration, bool keyframe) override
+    {
+        if (!img)
+            return;
+        keyframe = keyframe || !has_reference ||
+                   (options.auto_keyframes && options.keyframe_interval > 0 &&
+                    frames_since_keyframe >= options.keyframe_interval);
+        upload(img);
+
+        VABufferID buffers[4];
+        int count = 0;
+        if (keyframe)
+        {
+            VAEncSequenceParameterBufferVP9 sequence = {};
+            sequence.max_frame_width = width;
+            sequence.max_frame_height = height;
+            sequence.kf_min_dist = 1;
+            sequence.kf_max_dist = options.keyframe_interval;
+            sequence.intra_period = options.keyframe_interval;
+            sequence.bits_per_second = rate_control == VA_RC_CQP ? 0 : options.bitrate * 1000;
+            buffers[count++] = create_buffer(VAEncSequenceParameterBufferType, &sequence, sizeof(sequence));
+
+            if (rate_control != VA_RC_CQP)
+            {
+                alignas(VAEncMiscParameterBuffer) uint8_t misc[sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterRateControl)] = {};
+                auto header = (VAEncMiscParameterBuffer *)misc;
+                header->type = VAEncMiscParameterTypeRateControl;
+                auto rate = (VAEncMiscParameterRateControl *)header->data;
+                bool vbr = rate_control == VA_RC_VBR;
+                rate->bits_per_second = options.bitrate * 1000 * (vbr ? VBR_PEAK_FACTOR : 1);
+                rate->target_percentage = vbr ? 100 / VBR_PEAK_FACTOR : 100;
+                rate->window_size = 1000;
+                buffers[count++] = create_buffer(VAEncMiscParameterBufferType, misc, sizeof(misc));
+
+                // The bitrate is shared out by the frame rate, which is the one this frame is shown at.
+                alignas(VAEncMiscParameterBuffer) uint8_t frame_rate_misc[sizeof(VAEncMiscParameterBuffer) + sizeof(VAEncMiscParameterFrameRate)] = {};
+                header = (VAEncMiscParameterBuffer *)frame_rate_misc;
+                header->type = VAEncMiscParameterTypeFrameRate;
+                auto frame_rate = (VAEncMiscParameterFrameRate *)header->data;
+                frame_rate->framerate = (uint32_t(max<int64_t>(duration, 1)) << 16) | TIMEBASE_DENOMINATOR;
+                buffers[count++] = create_buffer(VAEncMiscParameterBufferType, frame_rate_misc, sizeof(frame_rate_misc));
+            }
+        }
+
+        VAEncPictureParameterBufferVP9 picture = {};
+        picture.frame_width_src = picture.frame_width_dst = width;
+        picture.frame_height_src = picture.frame_height_dst = height;
+        picture.reconstructed_frame = surfaces[1 + current];
+        for (int i = 0; i < VP9_REFERENCE_SLOTS; ++i)
+            picture.reference_frames[i] = VA_INVALID_SURFACE;
+        picture.coded_buf = coded;
+        picture.pic_flags.bits.show_frame = 1;
+        if (keyframe)
+        {
+            picture.refresh_frame_flags = 0xFF;
+        }
+        else
+        {
+            // Slot 0 holds the last frame, which is all that is predicted from and all that is replaced.
+            picture.pic_flags.bits.frame_type = 1;
+            picture.reference_frames[0] = surfaces[1 + (1 - current)];
+            picture.ref_flags.bits.ref_frame_ctrl_l0 = 1;
+            picture.ref_flags.bits.ref_last_idx = 0;
+            picture.refresh_frame_flags = 0x01;
+        }
+        picture.luma_ac_qindex = qindex;
+        picture.filter_level = LOOP_FILTER_LEVEL;
+        picture.sharpness_level = LOOP_FILTER_SHARPNESS;
+        buffers[count++] = create_buffer(VAEncPictureParameterBufferType, &picture, sizeof(picture));
+
+        check(vaBeginPicture(display, context, surfaces[0]), "begin a frame");
+        check(vaRenderPicture(display, context, buffers, count), "set up a frame");
+        check(vaEndPicture(display, context), "encode a frame");
+        for (int i = 0; i < count; ++i)
+            vaDestroyBuffer(display, buffers[i]);
+        check(vaSyncSurface(display, surfaces[0]), "wait for a frame");
+
+        // The coded buffer is copied out so that it can be reused for the next frame right away.
+        VACodedBufferSegment *segment;
+        check(vaMapBuffer(display, coded, (void **)&segment), "map an encoded frame");
+        packet_bytes.clear();
+        for (; segment; segment = (VACodedBufferSegment *)segment->next)
+            packet_bytes.insert(packet_bytes.end(), (uint8_t *)segment->buf, (uint8_t *)segment->buf + segment->size);
+        check(vaUnmapBuffer(display, coded), "unmap an encoded frame");
+
+        packet = EncodedPacket{packet_bytes.data(), packet_bytes.size(), pts, duration, keyframe};
+        packet_ready = true;
+        current = 1 - current;
+        has_reference = true;
+        frames_since_keyframe = keyframe ? 1 : frames_since_keyframe + 1;
+    }
+
+    bool next_packet(EncodedPacket &packet) override
+    {
+        if (!packet_ready)
+            return false;
+        packet = this->packet;
+        packet_ready = false;
+        return true;
+    }
+
+    // Sets up the device, returns why not if it cannot encode VP9 like this.
+    string open()
+    {
+        if (options.lossless)
+            return "lossless VP9 is not supported, pick a --rate-control";
+        if (options.full_chroma)
+            return "only 4:2:0 is supported";
+        // The driver writes the frame headers, which leave the colour space to the decoder's default.
+        if (options.matrix != MATRIX_BT601 || options.full_range)
+            return "only BT.601 limited range is supported";
+        rate_control = options.rate_control == VPX_CBR ? VA_RC_CBR : options.rate_control == VPX_VBR ? VA_RC_VBR : VA_RC_CQP;
+        if (options.bitrate == 0)
+            rate_control = VA_RC_CQP;
+        qindex = options.cq_level * MAX_QINDEX / MAX_CQ_LEVEL;
+
+        fd = ::open(options.vaapi_device.c_str(), O_RDWR);
+        if (fd < 0)
+            return "cannot open " + options.vaapi_device;
+        display = vaGetDisplayDRM(fd);
+        int major, minor;
+        if (!display || vaInitialize(display, &major, &minor) != VA_STATUS_SUCCESS)
+        {
+            display = nullptr;
+            return "cannot initialize VAAPI on " + options.vaapi_device;
+        }
+        debug("Using VAAPI %d.%d with %s\n", major, minor, vaQueryVendorString(display));
+
+        // Intel only encodes VP9 in its low power mode, so that is looked for first.
+        vector<VAEntrypoint> entrypoints(vaMaxNumEntrypoints(display));
+        int entrypoint_count = 0;
+        if (vaQueryConfigEntrypoints(display, VAProfileVP9Profile0, entrypoints.data(), &entrypoint_count) != VA_STATUS_SUCCESS)
+            entrypoint_count = 0;
+        entrypoints.resize(entrypoint_count);
+        VAEntrypoint entrypoint = VAEntrypointEncSliceLP;
+        if (find(entrypoints.begin(), entrypoints.end(), entrypoint) == entrypoints.end())
+            entrypoint = VAEntrypointEncSlice;
+        if (find(entrypoints.begin(), entrypoints.end(), entrypoint) == entrypoints.end())
+            return "the device cannot encode VP9";
+
+        VAConfigAttrib attributes[2] = {};
+        attributes[0].type = VAConfigAttribRTFormat;
+        attributes[1].type = VAConfigAttribRateControl;
+        if (vaGetConfigAttributes(display, VAProfileVP9Profile0, entrypoint, attributes, 2) != VA_STATUS_SUCCESS ||
+            !(attributes[0].value & VA_RT_FORMAT_YUV420))
+            return "the device cannot encode 4:2:0 VP9";
+        if (attributes[1].value == VA_ATTRIB_NOT_SUPPORTED || !(attributes[1].value & rate_control))
+            return "the device does not support that rate control";
+        attributes[0].value = VA_RT_FORMAT_YUV420;
+        attributes[1].value = rate_control;
+        if (vaCreateConfig(display, VAProfileVP9Profile0, entrypoint, attributes, 2, &config) != VA_STATUS_SUCCESS)
+            return "cannot configure the encoder";
+
+        if (vaCreateSurfaces(display, VA_RT_FORMAT_YUV420, width, height, surfaces, SURFACES, nullptr, 0) != VA_STATUS_SUCCESS)
+        {
+            surfaces[0] = VA_INVALID_SURFACE;
+            return "cannot create surfaces of that size";
+        }
+        if (vaCreateContext(display, config, width, height, VA_PROGRESSIVE, surfaces, SURFACES, &context) != VA_STATUS_SUCCESS)
+            return "cannot create an encoder for that size";
+        // Even a keyframe of noise fits in the size of the raw frame.
+        if (vaCreateBuffer(display, context, VAEncCodedBufferType, width * height * 3 / 2, 1, nullptr, &coded) != VA_STATUS_SUCCESS)
+            return "cannot create a buffer for the encoded frames";
+
+        VAImageFormat format = {};
+        format.fourcc = VA_FOURCC_NV12;
+        format.byte_order = VA_LSB_FIRST;
+        format.bits_per_pixel = 12;
+        if (vaCreateImage(display, &format, width, height, &image) != VA_STATUS_SUCCESS)
+            return "cannot create an NV12 image to upload frames with";
+        debug("Encoding VP9 with VAAPI at %dx%d, rate control %u and qindex %d\n", width, height, rate_control, qindex);
+        return "";
+    }
+
+    VaapiEncoder(int width, int height, const EncoderOptions &options)
+        : Encoder(VP9_FOURCC, "V_VP9"), options(options), width(width), height(height), fd(-1), display(nullptr),
+          config(VA_INVALID_ID), context(VA_INVALID_ID), coded(VA_INVALID_ID), rate_control(VA_RC_CQP), qindex(0),
+          current(0), has_reference(false), frames_since_keyframe(0), packet_ready(false)
+    {
+        surfaces[0] = VA_INVALID_SURFACE;
+        image.image_id = VA_INVALID_ID;
+    }
+
+    ~VaapiEncoder()
+    {
+        if (display)
+        {
+            if (image.image_id != VA_INVALID_ID)
+                vaDestroyImage(display, image.image_id);
+            if (coded != VA_INVALID_ID)
+                vaDestroyBuffer(display, coded);
+            if (context != VA_INVALID_ID)
+                vaDestroyContext(display, context);
+            if (surfaces[0] != VA_INVALID_SURFACE)
+                vaDestroySurfaces(display, surfaces, SURFACES);
+            if (config != VA_INVALID_ID)
+                vaDestroyConfig(display, config);
+            vaTerminate(display);
+        }
+        if (fd >= 0)
+            close(fd);
+    }
+};
+
+unique_ptr<Encoder> open_vaapi_encoder(int width, int height, const EncoderOptions &options)
+{
+    auto encoder = make_unique<VaapiEncoder>(width, height, options);
+    auto error = encoder->open();
+    if (error.empty())
+        return encoder;
+    output("Cannot encode with VAAPI, %s. Using libvpx instead\n", error.c_str());
+    return nullptr;
+}
+
+bool vaapi_available()
+{
+    return true;
+}
+
+#else
+
+unique_ptr<Encoder> open_vaapi_encoder(int width, int height, const EncoderOptions &options)
+{
+    return nullptr;
+}
+
+bool vaapi_available()
+{
+    return false;
+}
+
+#endif
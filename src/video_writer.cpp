@@ -0,0 +1,151 @@
+#include "prerecord.hpp"
+#include "trace.hpp"
+#include "util.hpp"
+#include "video_writer.hpp"
+
+using namespace std;
+
+StreamInfo stream_info(const Encoder &encoder, int width, int height, const EncoderOptions &options)
+{
+    static const int MATRICES[] = {CICP_MATRIX_BT601, CICP_MATRIX_BT709, CICP_MATRIX_IDENTITY};
+    return StreamInfo{encoder.fourcc, encoder.codec_id, width, height, TIMEBASE_NUMERATOR, TIMEBASE_DENOMINATOR,
+                      encoder.codec_private, CICP_PRIMARIES_BT709, CICP_TRANSFER_SRGB, MATRICES[options.matrix],
+                      options.full_range, !options.full_chroma};
+}
+
+int VideoWriter::vpx_video_writer_write_frame(const uint8_t *buffer, size_t size, int64_t pts, int64_t duration, bool keyframe)
+{
+    TRACE_PROBE(write_frame, size, pts, keyframe);
+    debug("Writing frame\n");
+    for (size_t i = containers.size(); i-- > 0;)
+    {
+        if (containers[i]->write_frame(buffer, size, pts, duration, keyframe))
+            continue;
+        // A viewer going away must not end the recording, but a file that cannot be written does.
+        if (containers[i]->sink->seekable() || (containers.size() == 1 && !ring))
+            return 0;
+        output("Stopped streaming to %s, it could not be written\n", containers[i]->sink->name.c_str());
+        containers[i]->sink->close();
+        containers.erase(containers.begin() + i);
+    }
+    if (ring)
+        ring->add(buffer, size, pts, duration, keyframe);
+    ++frames_written;
+    if (keyframe)
+        frames_since_keyframe = 0;
+    if (packet_sizes)
+        packet_sizes->record(size);
+    return 1;
+}
+
+int VideoWriter::encode_frame(const vpx_image_t *img, int64_t pts, int64_t duration)
+{
+    bool flush = img == nullptr;
+    TRACE_SCOPE(encode_frame, pts, flush);
+    debug("Encoding frame with flush=%d\n", flush);
+    if (!flush)
+        keyframe_wanted();
+    bool periodic = !options.auto_keyframes && options.keyframe_interval > 0 &&
+                    frames_encoded % options.keyframe_interval == 0;
+    bool keyframe = !flush && (force_keyframe || periodic);
+    if (!flush)
+    {
+        force_keyframe = false;
+        ++frames_encoded;
+        ++frames_since_keyframe;
+    }
+    int got_pkts = 0;
+    encoder->encode(img, pts, duration, keyframe);
+    EncodedPacket packet;
+    while (encoder->next_packet(packet))
+    {
+        got_pkts = 1;
+        if (!vpx_video_writer_write_frame(packet.data, packet.size, packet.pts, packet.duration, packet.keyframe))
+            fatal("Failed to write compressed frame.\n");
+    }
+    return got_pkts;
+}
+
+void VideoWriter::scene_change()
+{
+    if (frames_since_keyframe < MIN_SCENE_CHANGE_DISTANCE)
+        return;
+    debug("Forcing a keyframe at a scene change after %d frames\n", frames_since_keyframe);
+    force_keyframe = true;
+}
+
+bool VideoWriter::keyframe_wanted()
+{
+    for (auto &container : containers)
+    {
+        if (container->sink->wants_keyframe())
+            force_keyframe = true;
+    }
+    return force_keyframe;
+}
+
+void VideoWriter::extend(int64_t end_pts)
+{
+    for (auto &container : containers)
+        container->extend(end_pts);
+    if (ring)
+        ring->extend(end_pts);
+}
+
+void VideoWriter::resize(int width, int height)
+{
+    debug("Resizing writer from %dx%d to %dx%d\n", this->width, this->height, width, height);
+    this->width = width;
+    this->height = height;
+    force_keyframe = true;
+    if (!encoder->resize(width, height))
+    {
+        while (encode_frame(nullptr))
+        {
+        }
+        encoder = open_encoder(width, height, options);
+    }
+    // A new encoder has a sequence header of its own for AV1.
+    info = stream_info(*encoder, width, height, options);
+    for (auto &container : containers)
+        container->resize(info);
+    if (ring)
+        ring->start(info);
+}
+
+void VideoWriter::flush(chrono::steady_clock::time_point deadline)
+{
+    if (flushed)
+        return;
+    debug("Flushing writer\n");
+
+    // Flush encoder.
+    while (encode_frame(nullptr))
+    {
+        if (chrono::steady_clock::now() >= deadline)
+        {
+            output("Ran out of time to drain the encoder, its last frames are dropped\n");
+            break;
+        }
+    }
+    for (auto &container : containers)
+        container->finish();
+    flushed = true;
+}
+
+VideoWriter::~VideoWriter()
+{
+    debug("Destroying writer\n");
+
+    flush();
+}
+
+VideoWriter::VideoWriter(const vector<Sink *> &sinks, int width, int height, const EncoderOptions &options) : width(width), height(height), info(StreamInfo()), frames_written(0), frames_encoded(0), frames_since_keyframe(0), options(options), flushed(false), force_keyframe(false), packet_sizes(nullptr), ring(nullptr)
+{
+    debug("Creating writer for %zu outputs of size %dx%d\n", sinks.size(), width, height);
+
+    encoder = open_encoder(width, height, options);
+    info = stream_info(*encoder, width, height, options);
+    for (auto sink : sinks)
+        containers.push_back(open_container_writer(sink, info));
+}
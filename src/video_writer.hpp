@@ -0,0 +1,77 @@
+#pragma once
+
+#include <chrono>
+#include <memory>
+#include <string>
+#include <vector>
+#include <vpx/vpx_image.h>
+#include "container.hpp"
+#include "encoder.hpp"
+#include "stats.hpp"
+
+struct PacketRing;
+
+// Scene changes only force a keyframe this many frames after the last one, so that a guest playing
+// video does not turn every frame into a keyframe.
+static const int MIN_SCENE_CHANGE_DISTANCE = 10;
+
+// What the containers are told about the stream encoder makes from frames of the given size.
+StreamInfo stream_info(const Encoder &encoder, int width, int height, const EncoderOptions &options);
+
+// A writer that takes in I420 frames and saves them out as a VP9 or AV1 stream in IVF or WebM,
+// once for each of its sinks, so a file and any number of live viewers share one encode. The
+// frames are compressed by the encoder the options pick.
+struct VideoWriter
+{
+    std::vector<std::unique_ptr<ContainerWriter>> containers;
+    int width;
+    int height;
+    // What the containers were told about the stream.
+    StreamInfo info;
+    int frames_written;
+    int frames_encoded;
+    int frames_since_keyframe;
+    std::unique_ptr<Encoder> encoder;
+    EncoderOptions options;
+    bool flushed;
+    // Set when the next frame must be a keyframe, such as the first one after a resize or when a
+    // viewer is waiting to join.
+    bool force_keyframe;
+    // Records the size of every packet written, if set.
+    Histogram *packet_sizes;
+    // Keeps the packets written for a later dump as well, if set.
+    PacketRing *ring;
+
+    int vpx_video_writer_write_frame(const uint8_t *buffer, size_t size, int64_t pts, int64_t duration, bool keyframe);
+
+    // Encodes img shown from pts for duration, or flushes the encoder when img is null.
+    int encode_frame(const vpx_image_t *img, int64_t pts = 0, int64_t duration = 1);
+
+    // Makes the next frame a keyframe because most of the picture changed, unless there was one in
+    // the last MIN_SCENE_CHANGE_DISTANCE frames.
+    void scene_change();
+
+    // Asks the sinks whether a viewer is waiting to join, in which case the next frame is made a
+    // keyframe. Returns whether it will be one.
+    bool keyframe_wanted();
+
+    // Keeps showing the last frame until end_pts instead of encoding a repeat of it.
+    void extend(int64_t end_pts);
+
+    // Switches to frames of a new size within the same file. The encoder is reconfigured in place
+    // if it can be, otherwise it is drained and started again, and the next frame is a keyframe.
+    // The containers and the ring are told about the new size and encoder.
+    void resize(int width, int height);
+
+    // Drains the encoder and completes the files and streams, after which no more frames can be
+    // encoded. Frames the encoder still holds at deadline are dropped, so that the files are
+    // always completed in time.
+    void flush(std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max());
+
+    ~VideoWriter();
+
+    // The sinks must outlive the writer.
+    VideoWriter(const std::vector<Sink *> &sinks, int width, int height, const EncoderOptions &options);
+
+    VideoWriter(const VideoWriter &o) = delete;
+};
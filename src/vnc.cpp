@@ -0,0 +1,315 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include "shutdown.hpp"
+#include "util.hpp"
+#include "vnc.hpp"
+
+using namespace std;
+
+// The RFB protocol version spoken, 3.8, and the oldest accepted, 3.3.
+static const int RFB_VERSION_LENGTH = 12;
+static const int RFB_MINOR_VERSION = 8;
+static const uint8_t SECURITY_NONE = 1;
+
+// Client to server messages.
+static const uint8_t SET_PIXEL_FORMAT = 0;
+static const uint8_t SET_ENCODINGS = 2;
+static const uint8_t FRAMEBUFFER_UPDATE_REQUEST = 3;
+
+// Server to client messages.
+static const uint8_t FRAMEBUFFER_UPDATE = 0;
+static const uint8_t SET_COLOUR_MAP_ENTRIES = 1;
+static const uint8_t BELL = 2;
+static const uint8_t SERVER_CUT_TEXT = 3;
+
+// Raw is cheapest to decode and the socket is local, CopyRect covers moving windows and scrolling,
+// and DesktopSize announces a new resolution.
+static const int32_t ENCODING_RAW = 0;
+static const int32_t ENCODING_COPY_RECT = 1;
+static const int32_t ENCODING_DESKTOP_SIZE = -223;
+
+// Pixels are asked for as 32 bit little endian true colour with blue in the lowest byte, the
+// BGRX layout the converters read, so updates are copied into the framebuffer as they are.
+static const int BYTES_PER_PIXEL = 4;
+
+static const int FIRST_FRAME_TIMEOUT_MS = 5000;
+
+static uint16_t get_u16(const uint8_t *data)
+{
+    return uint16_t(data[0] << 8 | data[1]);
+}
+
+static uint32_t get_u32(const uint8_t *data)
+{
+    return uint32_t(data[0]) << 24 | uint32_t(data[1]) << 16 | uint32_t(data[2]) << 8 | data[3];
+}
+
+static void put_u16(uint8_t *data, uint16_t value)
+{
+    data[0] = value >> 8;
+    data[1] = value & 0xFF;
+}
+
+static void put_u32(uint8_t *data, uint32_t value)
+{
+    put_u16(data, value >> 16);
+    put_u16(data + 2, value & 0xFFFF);
+}
+
+bool VncClient::read_fully(void *data, size_t size)
+{
+    auto bytes = (uint8_t *)data;
+    while (size > 0)
+    {
+        if (!wait_readable(fd, -1))
+            return false;
+        auto res = read(fd, bytes, size);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+        bytes += res;
+        size -= res;
+    }
+    return true;
+}
+
+bool VncClient::write_fully(const void *data, size_t size)
+{
+    auto bytes = (const uint8_t *)data;
+    while (size > 0)
+    {
+        auto res = write(fd, bytes, size);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+        bytes += res;
+        size -= res;
+    }
+    return true;
+}
+
+bool VncClient::skip(size_t size)
+{
+    uint8_t discard[256];
+    while (size > 0)
+    {
+        auto chunk = min(size, sizeof(discard));
+        if (!read_fully(discard, chunk))
+            return false;
+        size -= chunk;
+    }
+    return true;
+}
+
+bool VncClient::request_update(bool incremental)
+{
+    uint8_t request[10] = {FRAMEBUFFER_UPDATE_REQUEST, incremental};
+    put_u16(request + 6, width);
+    put_u16(request + 8, height);
+    return write_fully(request, sizeof(request));
+}
+
+bool VncClient::resize(int width, int height)
+{
+    if (width <= 0 || height <= 0)
+        return false;
+    debug("VNC display is %dx%d\n", width, height);
+    this->width = width;
+    this->height = height;
+    framebuffer.assign(size_t(width) * height * BYTES_PER_PIXEL, 0);
+    damage.clear();
+    damage.push_back(DirtyRect{0, 0, width, height});
+    return true;
+}
+
+int VncClient::receive(int timeout_ms)
+{
+    if (!wait_readable(fd, timeout_ms))
+        return 0;
+
+    uint8_t type;
+    if (!read_fully(&type, 1))
+        return -1;
+    if (type == BELL)
+        return 1;
+    if (type == SET_COLOUR_MAP_ENTRIES)
+    {
+        uint8_t entries[5];
+        return read_fully(entries, sizeof(entries)) && skip(get_u16(entries + 3) * 6) ? 1 : -1;
+    }
+    if (type == SERVER_CUT_TEXT)
+    {
+        uint8_t text[7];
+        return read_fully(text, sizeof(text)) && skip(get_u32(text + 3)) ? 1 : -1;
+    }
+    if (type != FRAMEBUFFER_UPDATE)
+    {
+        debug("Unexpected VNC message %d\n", type);
+        return -1;
+    }
+
+    uint8_t update[3];
+    if (!read_fully(update, sizeof(update)))
+        return -1;
+    bool resized = false;
+    for (int count = get_u16(update + 1); count > 0; --count)
+    {
+        uint8_t header[12];
+        if (!read_fully(header, sizeof(header)))
+            return -1;
+        int x = get_u16(header);
+        int y = get_u16(header + 2);
+        int w = get_u16(header + 4);
+        int h = get_u16(header + 6);
+        auto encoding = int32_t(get_u32(header + 8));
+        if (encoding == ENCODING_DESKTOP_SIZE)
+        {
+            if (!resize(w, h))
+                return -1;
+            resized = true;
+            continue;
+        }
+        if (x + w > width || y + h > height)
+            return -1;
+
+        auto pixels = framebuffer.data();
+        size_t stride = size_t(width) * BYTES_PER_PIXEL;
+        if (encoding == ENCODING_RAW)
+        {
+            for (int line = y; line < y + h; ++line)
+            {
+                if (!read_fully(pixels + line * stride + x * BYTES_PER_PIXEL, size_t(w) * BYTES_PER_PIXEL))
+                    return -1;
+            }
+        }
+        else if (encoding == ENCODING_COPY_RECT)
+        {
+            uint8_t source[4];
+            if (!read_fully(source, sizeof(source)))
+                return -1;
+            int source_x = get_u16(source);
+            int source_y = get_u16(source + 2);
+            if (source_x + w > width || source_y + h > height)
+                return -1;
+            // Rows are copied in the order that leaves overlapping source rows unread until used.
+            for (int i = 0; i < h; ++i)
+            {
+                int line = source_y < y ? h - 1 - i : i;
+                memmove(pixels + (y + line) * stride + x * BYTES_PER_PIXEL,
+                        pixels + (source_y + line) * stride + source_x * BYTES_PER_PIXEL, size_t(w) * BYTES_PER_PIXEL);
+            }
+        }
+        else
+        {
+            debug("Unexpected VNC encoding %d\n", encoding);
+            return -1;
+        }
+        damage.push_back(DirtyRect{x, y, w, h});
+    }
+
+    // The next request goes out straight away, so the server collects changes while frames are
+    // taken and answers as soon as it has any.
+    return request_update(!resized) ? 2 : -1;
+}
+
+string VncClient::open(Domain &domain)
+{
+    fd = virDomainOpenGraphicsFD(domain.get(), 0, VIR_DOMAIN_OPEN_GRAPHICS_SKIPAUTH);
+    if (fd < 0)
+        return "libvirt cannot hand out the display, which needs a local connection";
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    char version[RFB_VERSION_LENGTH + 1] = {};
+    int major, minor;
+    if (!read_fully(version, RFB_VERSION_LENGTH) || sscanf(version, "RFB %3d.%3d\n", &major, &minor) != 2 || major != 3)
+        return "the first display is not VNC";
+    minor = minor >= RFB_MINOR_VERSION ? RFB_MINOR_VERSION : minor >= 7 ? 7 : 3;
+    snprintf(version, sizeof(version), "RFB 003.%03d\n", minor);
+    if (!write_fully(version, RFB_VERSION_LENGTH))
+        return "the VNC server hung up";
+
+    // Authentication was skipped by libvirt, so the server should offer no security.
+    bool none = false;
+    if (minor == 3)
+    {
+        uint8_t type[4];
+        none = read_fully(type, sizeof(type)) && get_u32(type) == SECURITY_NONE;
+    }
+    else
+    {
+        uint8_t count;
+        uint8_t types[255];
+        if (read_fully(&count, 1) && read_fully(types, count))
+            none = memchr(types, SECURITY_NONE, count) != nullptr;
+        none = none && write_fully(&SECURITY_NONE, 1);
+    }
+    uint8_t result[4] = {};
+    if (none && minor == RFB_MINOR_VERSION)
+        none = read_fully(result, sizeof(result)) && get_u32(result) == 0;
+    if (!none)
+        return "the VNC server wants a password";
+
+    // The display stays shared, so that anyone already watching it is not thrown off.
+    uint8_t shared = 1;
+    uint8_t init[24];
+    if (!write_fully(&shared, 1) || !read_fully(init, sizeof(init)) || !skip(get_u32(init + 20)))
+        return "the VNC server hung up";
+
+    uint8_t pixel_format[20] = {SET_PIXEL_FORMAT, 0, 0, 0, 32, 24, 0, 1};
+    put_u16(pixel_format + 8, 255);
+    put_u16(pixel_format + 10, 255);
+    put_u16(pixel_format + 12, 255);
+    pixel_format[14] = 16;
+    pixel_format[15] = 8;
+    pixel_format[16] = 0;
+    uint8_t encodings[16] = {SET_ENCODINGS, 0};
+    put_u16(encodings + 2, 3);
+    put_u32(encodings + 4, ENCODING_RAW);
+    put_u32(encodings + 8, ENCODING_COPY_RECT);
+    put_u32(encodings + 12, uint32_t(ENCODING_DESKTOP_SIZE));
+    if (!resize(get_u16(init), get_u16(init + 2)) || !write_fully(pixel_format, sizeof(pixel_format)) ||
+        !write_fully(encodings, sizeof(encodings)) || !request_update(false))
+        return "the VNC server hung up";
+
+    while (true)
+    {
+        auto res = receive(FIRST_FRAME_TIMEOUT_MS);
+        if (res == 2)
+            return "";
+        if (res <= 0)
+            return "the VNC server sent no frame";
+    }
+}
+
+ssize_t VncClient::take_frame(FrameBuffer &buffer, vector<DirtyRect> &rects, FrameLayout &layout)
+{
+    while (true)
+    {
+        auto res = receive(0);
+        if (res < 0)
+        {
+            debug("Lost the VNC connection\n");
+            return -1;
+        }
+        if (res == 0)
+            break;
+    }
+
+    rects.insert(rects.end(), damage.begin(), damage.end());
+    damage.clear();
+    layout = FrameLayout{width, height, 0, size_t(width) * BYTES_PER_PIXEL, PIXEL_BGRX32};
+    buffer.resize(framebuffer.size());
+    memcpy(buffer.data(), framebuffer.data(), framebuffer.size());
+    return framebuffer.size();
+}
+
+VncClient::~VncClient()
+{
+    if (fd >= 0)
+        close(fd);
+}
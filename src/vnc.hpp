@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "capture.hpp"
+#include "convert.hpp"
+#include "damage.hpp"
+#include "memory.hpp"
+
+// Receives a domain's display from its VNC server, over a socket libvirt hands out with
+// virDomainOpenGraphicsFD, instead of taking screenshots. The server only sends the rectangles that
+// changed, so an unchanged screen costs nothing to capture and each frame comes with its damage.
+struct VncClient
+{
+    int fd;
+    int width;
+    int height;
+    // Packed BGRX 32 bit, which the server sends and the converters read.
+    FrameBuffer framebuffer;
+    // What changed since the last frame was taken.
+    std::vector<DirtyRect> damage;
+
+    // Connects to the first display of the domain and waits for its first full frame. Returns why
+    // not if it cannot, such as over a remote connection or when the display is not VNC.
+    std::string open(Domain &domain);
+
+    // Applies the updates that have arrived and copies the frame into buffer, with its layout, and
+    // adds the rectangles that changed since the last one to rects. Returns its size, or -1 if the
+    // connection failed.
+    ssize_t take_frame(FrameBuffer &buffer, std::vector<DirtyRect> &rects, FrameLayout &layout);
+
+    VncClient() : fd(-1), width(0), height(0)
+    {
+    }
+
+    ~VncClient();
+
+    VncClient(const VncClient &o) = delete;
+
+    bool read_fully(void *data, size_t size);
+    bool write_fully(const void *data, size_t size);
+    bool skip(size_t size);
+    bool request_update(bool incremental);
+    bool resize(int width, int height);
+    // Reads and applies one message from the server, waiting up to timeout_ms for it to start, and
+    // asks for the next update after each one. The server holds back its answer until something
+    // changes, so there is only ever one request outstanding. Returns 0 if no message arrived, 1 for
+    // a message, 2 for a framebuffer update and -1 if the connection failed.
+    int receive(int timeout_ms);
+};
@@ -0,0 +1,134 @@
+#include <vpx/vp8cx.h>
+#include "encoder.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+// Encodes VP9 in software with libvpx, tuned for screen content unless lossless.
+struct VpxEncoder : Encoder
+{
+    vpx_codec_ctx_t codec;
+    vpx_codec_enc_cfg_t cfg;
+    EncoderOptions options;
+    unsigned long deadline;
+    vpx_codec_iter_t iter;
+
+    void encode(const vpx_image_t *img, int64_t pts, int64_t duration, bool keyframe) override
+    {
+        int flags = img && keyframe ? VPX_EFLAG_FORCE_KF : 0;
+        iter = nullptr;
+        if (vpx_codec_encode(&codec, img, pts, duration, flags, deadline) != VPX_CODEC_OK)
+            fatal("Failed to encode frame. %s\n", vpx_codec_error_detail(&codec));
+    }
+
+    bool next_packet(EncodedPacket &packet) override
+    {
+        const vpx_codec_cx_pkt_t *pkt;
+        while ((pkt = vpx_codec_get_cx_data(&codec, &iter)) != NULL)
+        {
+            if (pkt->kind != VPX_CODEC_CX_FRAME_PKT)
+                continue;
+            packet = EncodedPacket{(const uint8_t *)pkt->data.frame.buf, pkt->data.frame.sz, pkt->data.frame.pts,
+                                   int64_t(pkt->data.frame.duration), (pkt->data.frame.flags & VPX_FRAME_IS_KEY) != 0};
+            return true;
+        }
+        return false;
+    }
+
+    bool resize(int width, int height) override
+    {
+        cfg.g_w = width;
+        cfg.g_h = height;
+        // libvpx refuses some changes in place, such as growing past the first size with lookahead.
+        if (vpx_codec_enc_config_set(&codec, &cfg) != VPX_CODEC_OK)
+        {
+            debug("Reconfiguring failed, restarting the encoder. %s\n", vpx_codec_error_detail(&codec));
+            return false;
+        }
+        set_tile_columns();
+        return true;
+    }
+
+    void init_codec()
+    {
+        if (vpx_codec_enc_init(&codec, vpx_codec_vp9_cx(), &cfg, 0))
+            fatal("Failed to initialize encoder with VP9 codec. %s\n", vpx_codec_error_detail(&codec));
+
+        if (vpx_codec_control_(&codec, VP9E_SET_LOSSLESS, options.lossless ? 1 : 0))
+            fatal("Failed to set lossless mode on VP9 codec. %s\n", vpx_codec_error_detail(&codec));
+        if (!options.lossless)
+        {
+            debug("Encoding lossy with rate control %d at %u kbit/s and cq-level %d\n", options.rate_control,
+                  cfg.rc_target_bitrate, options.cq_level);
+            if (vpx_codec_control_(&codec, VP9E_SET_TUNE_CONTENT, VP9E_CONTENT_SCREEN))
+                fatal("Failed to tune VP9 codec for screen content. %s\n", vpx_codec_error_detail(&codec));
+            if ((options.rate_control == VPX_CQ || options.rate_control == VPX_Q) &&
+                vpx_codec_control_(&codec, VP8E_SET_CQ_LEVEL, options.cq_level))
+                fatal("Failed to set cq-level on VP9 codec. %s\n", vpx_codec_error_detail(&codec));
+        }
+
+        // sRGB is what VP9 calls GBR planes, which only profile 1 and 3 can hold.
+        static const vpx_color_space_t COLOUR_SPACES[] = {VPX_CS_BT_601, VPX_CS_BT_709, VPX_CS_SRGB};
+        auto colour_space = COLOUR_SPACES[options.matrix];
+        auto colour_range = options.full_range ? VPX_CR_FULL_RANGE : VPX_CR_STUDIO_RANGE;
+        if (vpx_codec_control_(&codec, VP9E_SET_COLOR_SPACE, colour_space) ||
+            vpx_codec_control_(&codec, VP9E_SET_COLOR_RANGE, colour_range))
+            fatal("Failed to set the colour space on VP9 codec. %s\n", vpx_codec_error_detail(&codec));
+        if (vpx_codec_control_(&codec, VP8E_SET_CPUUSED, options.cpu_used))
+            fatal("Failed to set cpu-used on VP9 codec. %s\n", vpx_codec_error_detail(&codec));
+        set_tile_columns();
+        if (vpx_codec_control_(&codec, VP9E_SET_ROW_MT, options.row_mt ? 1 : 0))
+            fatal("Failed to set row-mt on VP9 codec. %s\n", vpx_codec_error_detail(&codec));
+    }
+
+    void set_tile_columns()
+    {
+        auto tile_columns = options.log2_tile_columns(cfg.g_w);
+        debug("Encoding with %d threads, %d tile columns, row-mt=%d and cpu-used=%d\n",
+              options.threads, 1 << tile_columns, options.row_mt, options.cpu_used);
+        if (vpx_codec_control_(&codec, VP9E_SET_TILE_COLUMNS, tile_columns))
+            fatal("Failed to set tile columns on VP9 codec. %s\n", vpx_codec_error_detail(&codec));
+    }
+
+    VpxEncoder(int width, int height, const EncoderOptions &options)
+        : Encoder(VP9_FOURCC, "V_VP9"), codec(vpx_codec_ctx_t()), options(options),
+          deadline(options.realtime ? VPX_DL_REALTIME : VPX_DL_GOOD_QUALITY), iter(nullptr)
+    {
+        auto error = vpx_codec_enc_config_default(vpx_codec_vp9_cx(), &cfg, 0);
+        if (error)
+            fatal("Failed to get default codec config. %s\n", vpx_codec_error_detail(&codec));
+
+        cfg.g_w = width;
+        cfg.g_h = height;
+        // Profile 1 is 8 bit with chroma that is not 4:2:0.
+        cfg.g_profile = options.full_chroma ? 1 : 0;
+        cfg.g_timebase.num = TIMEBASE_NUMERATOR;
+        cfg.g_timebase.den = TIMEBASE_DENOMINATOR;
+        cfg.g_error_resilient = 0;
+        cfg.g_threads = options.threads;
+        // Fixed keyframes are all forced, so libvpx is left to place none of its own.
+        cfg.kf_mode = options.auto_keyframes && options.keyframe_interval > 0 ? VPX_KF_AUTO : VPX_KF_DISABLED;
+        cfg.kf_min_dist = 0;
+        cfg.kf_max_dist = options.keyframe_interval;
+        // Realtime encoding must not hold frames back for lookahead.
+        if (options.realtime)
+            cfg.g_lag_in_frames = 0;
+        if (!options.lossless)
+        {
+            cfg.rc_end_usage = options.rate_control;
+            if (options.bitrate > 0)
+                cfg.rc_target_bitrate = options.bitrate;
+        }
+        init_codec();
+    }
+
+    ~VpxEncoder()
+    {
+        vpx_codec_destroy(&codec);
+    }
+};
+
+unique_ptr<Encoder> open_vpx_encoder(int width, int height, const EncoderOptions &options)
+{
+    return make_unique<VpxEncoder>(width, height, options);
+}
@@ -0,0 +1,455 @@
+#include <cstring>
+#include <vector>
+#include "container.hpp"
+#include "util.hpp"
+
+using namespace std;
+
+// Matroska element IDs used by the WebM writer.
+enum : uint32_t
+{
+    EBML = 0x1A45DFA3,
+    EBML_VERSION = 0x4286,
+    EBML_READ_VERSION = 0x42F7,
+    EBML_MAX_ID_LENGTH = 0x42F2,
+    EBML_MAX_SIZE_LENGTH = 0x42F3,
+    DOC_TYPE = 0x4282,
+    DOC_TYPE_VERSION = 0x4287,
+    DOC_TYPE_READ_VERSION = 0x4285,
+    VOID = 0xEC,
+    SEGMENT = 0x18538067,
+    SEEK_HEAD = 0x114D9B74,
+    SEEK = 0x4DBB,
+    SEEK_ID = 0x53AB,
+    SEEK_POSITION = 0x53AC,
+    INFO = 0x1549A966,
+    TIMECODE_SCALE = 0x2AD7B1,
+    DURATION = 0x4489,
+    MUXING_APP = 0x4D80,
+    WRITING_APP = 0x5741,
+    TRACKS = 0x1654AE6B,
+    TRACK_ENTRY = 0xAE,
+    TRACK_NUMBER = 0xD7,
+    TRACK_UID = 0x73C5,
+    TRACK_TYPE = 0x83,
+    FLAG_LACING = 0x9C,
+    CODEC_ID = 0x86,
+    CODEC_PRIVATE = 0x63A2,
+    VIDEO = 0xE0,
+    PIXEL_WIDTH = 0xB0,
+    PIXEL_HEIGHT = 0xBA,
+    COLOUR = 0x55B0,
+    MATRIX_COEFFICIENTS = 0x55B1,
+    CHROMA_SITING_HORZ = 0x55B7,
+    CHROMA_SITING_VERT = 0x55B8,
+    RANGE = 0x55B9,
+    TRANSFER_CHARACTERISTICS = 0x55BA,
+    PRIMARIES = 0x55BB,
+    CLUSTER = 0x1F43B675,
+    TIMECODE = 0xE7,
+    SIMPLE_BLOCK = 0xA3,
+    CUES = 0x1C53BB6B,
+    CUE_POINT = 0xBB,
+    CUE_TIME = 0xB3,
+    CUE_TRACK_POSITIONS = 0xB7,
+    CUE_TRACK = 0xF7,
+    CUE_CLUSTER_POSITION = 0xF1,
+};
+
+// Sizes written before their value is known take the full 8 bytes so they can be patched in place.
+// Left unpatched they read as "unknown", which players accept for a file cut short.
+static const uint64_t UNKNOWN_SIZE = 0x01FFFFFFFFFFFFFFULL;
+static const int PATCHABLE_SIZE_LENGTH = 8;
+
+// Timestamps are written in milliseconds.
+static const uint64_t TIMECODE_SCALE_NS = 1000000;
+
+// Space kept after the segment header for the SeekHead, which can only be written once the Cues
+// are placed at the end of the file.
+static const size_t SEEK_HEAD_RESERVED = 96;
+
+// Space kept after the Tracks of a file, so that they can be written again in place when the stream
+// changes size, which can also change the length of an AV1 CodecPrivate.
+static const size_t TRACKS_RESERVED = 64;
+
+// SimpleBlock timecodes are signed 16 bit offsets from their cluster's timecode.
+static const int64_t MAX_CLUSTER_OFFSET = 32767;
+
+static const uint64_t VIDEO_TRACK = 1;
+
+// Values of the Colour element that are not ISO/IEC 23091-4 code points.
+static const uint64_t RANGE_BROADCAST = 1;
+static const uint64_t RANGE_FULL = 2;
+static const uint64_t CHROMA_SITING_HALF = 2;
+
+// Appends EBML encodings to a byte buffer.
+struct EbmlBuffer
+{
+    vector<uint8_t> bytes;
+
+    void put_id(uint32_t id)
+    {
+        int length = id > 0xFFFFFF ? 4 : id > 0xFFFF ? 3 : id > 0xFF ? 2 : 1;
+        for (int i = length - 1; i >= 0; --i)
+            bytes.push_back(id >> (i * 8));
+    }
+
+    void put_size(uint64_t size, int length = 0)
+    {
+        // A length of n bytes holds 7n bits, with the all ones value reserved for "unknown".
+        if (length == 0)
+        {
+            length = 1;
+            while (length < 8 && size >= (1ULL << (7 * length)) - 1)
+                ++length;
+        }
+        uint64_t value = size | (1ULL << (7 * length));
+        for (int i = length - 1; i >= 0; --i)
+            bytes.push_back(value >> (i * 8));
+    }
+
+    void put_uint(uint32_t id, uint64_t value)
+    {
+        int length = 1;
+        while (length < 8 && (value >> (length * 8)) != 0)
+            ++length;
+        put_id(id);
+        put_size(length);
+        for (int i = length - 1; i >= 0; --i)
+            bytes.push_back(value >> (i * 8));
+    }
+
+    void put_float(uint32_t id, double value)
+    {
+        uint64_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        put_id(id);
+        put_size(8);
+        for (int i = 7; i >= 0; --i)
+            bytes.push_back(bits >> (i * 8));
+    }
+
+    void put_binary(uint32_t id, const void *data, size_t size)
+    {
+        put_id(id);
+        put_size(size);
+        bytes.insert(bytes.end(), (const uint8_t *)data, (const uint8_t *)data + size);
+    }
+
+    void put_string(uint32_t id, const char *value)
+    {
+        put_binary(id, value, strlen(value));
+    }
+
+    void put_master(uint32_t id, const EbmlBuffer &children)
+    {
+        put_id(id);
+        put_size(children.bytes.size());
+        bytes.insert(bytes.end(), children.bytes.begin(), children.bytes.end());
+    }
+
+    // Fills exactly size bytes with a Void element, size must be at least 2.
+    void put_void(size_t size)
+    {
+        size_t length = size - 1 > 127 ? 8 : 1;
+        put_id(VOID);
+        put_size(size - 1 - length, length);
+        bytes.insert(bytes.end(), size - 1 - length, 0);
+    }
+};
+
+static EbmlBuffer id_bytes(uint32_t id)
+{
+    EbmlBuffer buffer;
+    buffer.put_id(id);
+    return buffer;
+}
+
+// A seekable WebM file: clusters start on keyframes and are indexed by Cues written at the end.
+// The sizes of the segment and of each finished cluster are patched in as the file grows, so a
+// recording cut short is still readable up to its last complete cluster.
+// On a sink that cannot seek it writes live WebM instead, as players expect from a stream: the
+// segment and clusters keep their unknown sizes and there is no duration, SeekHead or Cues.
+// When the sink is split into segments, each file is completed on its own and its timecodes start
+// from the keyframe that opens it. A resize always starts a cluster, as it comes with a keyframe, and
+// a file's Tracks are rewritten to the new size, while a live stream keeps the header it started
+// with and leaves the size to the frames, which carry it too.
+struct WebMWriter : ContainerWriter
+{
+    StreamInfo info;
+    bool live;
+    int64_t origin_pts;
+    long written;
+    long segment_data;
+    long info_position;
+    long tracks_position;
+    long tracks_end;
+    long duration_position;
+    long cluster_position;
+    int64_t cluster_timecode;
+    int64_t end_timecode;
+    vector<pair<int64_t, long>> cues;
+    // Holds the elements written with every frame, so that their bytes are only allocated once.
+    EbmlBuffer scratch;
+
+    bool write(const void *data, size_t size)
+    {
+        written += size;
+        return sink->write(data, size);
+    }
+
+    bool write(const EbmlBuffer &buffer)
+    {
+        return write(buffer.bytes.data(), buffer.bytes.size());
+    }
+
+    void patch(long position, const EbmlBuffer &buffer)
+    {
+        sink->patch(position, buffer.bytes.data(), buffer.bytes.size());
+    }
+
+    void patch_size(long size_position, uint64_t size)
+    {
+        scratch.bytes.clear();
+        scratch.put_size(size, PATCHABLE_SIZE_LENGTH);
+        patch(size_position, scratch);
+    }
+
+    int64_t to_timecode(int64_t pts) const
+    {
+        return (pts - origin_pts) * info.timebase_num * 1000 / info.timebase_den;
+    }
+
+    // Appends the Tracks element describing the stream as it is now.
+    void put_tracks(EbmlBuffer &buffer) const
+    {
+        EbmlBuffer video;
+        video.put_uint(PIXEL_WIDTH, info.width);
+        video.put_uint(PIXEL_HEIGHT, info.height);
+        EbmlBuffer colour;
+        colour.put_uint(MATRIX_COEFFICIENTS, info.matrix_coefficients);
+        if (info.subsampled)
+        {
+            colour.put_uint(CHROMA_SITING_HORZ, CHROMA_SITING_HALF);
+            colour.put_uint(CHROMA_SITING_VERT, CHROMA_SITING_HALF);
+        }
+        colour.put_uint(RANGE, info.full_range ? RANGE_FULL : RANGE_BROADCAST);
+        colour.put_uint(TRANSFER_CHARACTERISTICS, info.transfer);
+        colour.put_uint(PRIMARIES, info.primaries);
+        video.put_master(COLOUR, colour);
+        EbmlBuffer entry;
+        entry.put_uint(TRACK_NUMBER, VIDEO_TRACK);
+        entry.put_uint(TRACK_UID, VIDEO_TRACK);
+        entry.put_uint(TRACK_TYPE, 1);
+        entry.put_uint(FLAG_LACING, 0);
+        entry.put_string(CODEC_ID, info.codec_id);
+        if (!info.codec_private.empty())
+            entry.put_binary(CODEC_PRIVATE, info.codec_private.data(), info.codec_private.size());
+        entry.put_master(VIDEO, video);
+        EbmlBuffer tracks;
+        tracks.put_master(TRACK_ENTRY, entry);
+        buffer.put_master(TRACKS, tracks);
+    }
+
+    void write_headers()
+    {
+        EbmlBuffer header;
+        EbmlBuffer ebml;
+        ebml.put_uint(EBML_VERSION, 1);
+        ebml.put_uint(EBML_READ_VERSION, 1);
+        ebml.put_uint(EBML_MAX_ID_LENGTH, 4);
+        ebml.put_uint(EBML_MAX_SIZE_LENGTH, 8);
+        ebml.put_string(DOC_TYPE, "webm");
+        ebml.put_uint(DOC_TYPE_VERSION, 4);
+        ebml.put_uint(DOC_TYPE_READ_VERSION, 2);
+        header.put_master(EBML, ebml);
+        header.put_id(SEGMENT);
+        header.put_size(UNKNOWN_SIZE, PATCHABLE_SIZE_LENGTH);
+        segment_data = header.bytes.size();
+        if (!live)
+            header.put_void(SEEK_HEAD_RESERVED);
+
+        EbmlBuffer segment_info;
+        segment_info.put_uint(TIMECODE_SCALE, TIMECODE_SCALE_NS);
+        segment_info.put_string(MUXING_APP, "lvsc");
+        segment_info.put_string(WRITING_APP, "lvsc");
+        info_position = header.bytes.size();
+        header.put_id(INFO);
+        header.put_size(segment_info.bytes.size() + (live ? 0 : 11));
+        header.bytes.insert(header.bytes.end(), segment_info.bytes.begin(), segment_info.bytes.end());
+        duration_position = header.bytes.size();
+        if (!live)
+            header.put_float(DURATION, 0);
+
+        tracks_position = header.bytes.size();
+        put_tracks(header);
+        if (!live)
+            header.put_void(TRACKS_RESERVED);
+        tracks_end = header.bytes.size();
+
+        if (!write(header))
+            fatal("Failed to write WebM headers\n");
+        sink->end_header();
+    }
+
+    void close_cluster()
+    {
+        if (cluster_position < 0)
+            return;
+        if (!live)
+            patch_size(cluster_position + 4, written - cluster_position - 4 - PATCHABLE_SIZE_LENGTH);
+        cluster_position = -1;
+    }
+
+    void open_cluster(int64_t timecode, bool keyframe)
+    {
+        close_cluster();
+        cluster_position = written;
+        cluster_timecode = timecode;
+        if (keyframe)
+        {
+            if (!live)
+                cues.emplace_back(timecode, cluster_position - segment_data);
+            sink->sync_point();
+        }
+
+        scratch.bytes.clear();
+        scratch.put_id(CLUSTER);
+        scratch.put_size(UNKNOWN_SIZE, PATCHABLE_SIZE_LENGTH);
+        scratch.put_uint(TIMECODE, timecode);
+        write(scratch);
+    }
+
+    // Completes this file and carries on in the sink's next one from the keyframe at pts.
+    void start_segment(int64_t pts)
+    {
+        complete();
+        if (!sink->next_segment())
+            return;
+        origin_pts = pts;
+        written = segment_data = info_position = tracks_position = tracks_end = duration_position = 0;
+        cluster_timecode = end_timecode = 0;
+        cues.clear();
+        write_headers();
+    }
+
+    bool write_frame(const uint8_t *data, size_t size, int64_t pts, int64_t duration, bool keyframe) override
+    {
+        if (keyframe && sink->segment_due())
+            start_segment(pts);
+        auto timecode = to_timecode(pts);
+        if (cluster_position < 0 || keyframe || timecode - cluster_timecode > MAX_CLUSTER_OFFSET)
+            open_cluster(timecode, keyframe);
+        end_timecode = max(end_timecode, to_timecode(pts + duration));
+
+        int16_t offset = timecode - cluster_timecode;
+        scratch.bytes.clear();
+        scratch.put_id(SIMPLE_BLOCK);
+        scratch.put_size(size + 4);
+        scratch.put_size(VIDEO_TRACK);
+        scratch.bytes.push_back(uint16_t(offset) >> 8);
+        scratch.bytes.push_back(uint16_t(offset) & 0xFF);
+        scratch.bytes.push_back(keyframe ? 0x80 : 0x00);
+        if (!write(scratch) || !write(data, size))
+            return false;
+        sink->flush();
+        return true;
+    }
+
+    void resize(const StreamInfo &info) override
+    {
+        this->info = info;
+        if (live)
+            return;
+        EbmlBuffer tracks;
+        put_tracks(tracks);
+        size_t space = tracks_end - tracks_position;
+        if (tracks.bytes.size() != space && tracks.bytes.size() + 2 > space)
+        {
+            debug("The new Tracks do not fit in the space kept for them\n");
+            return;
+        }
+        if (tracks.bytes.size() < space)
+            tracks.put_void(space - tracks.bytes.size());
+        patch(tracks_position, tracks);
+    }
+
+    void extend(int64_t end_pts) override
+    {
+        end_timecode = max(end_timecode, to_timecode(end_pts));
+    }
+
+    // Writes the Cues and patches in the SeekHead, duration and segment size.
+    void complete()
+    {
+        close_cluster();
+        if (live)
+        {
+            debug("Finishing live WebM stream\n");
+            return;
+        }
+        debug("Finishing WebM file with %zu cue points\n", cues.size());
+
+        EbmlBuffer cue_points;
+        for (auto &cue : cues)
+        {
+            EbmlBuffer position;
+            position.put_uint(CUE_TRACK, VIDEO_TRACK);
+            position.put_uint(CUE_CLUSTER_POSITION, cue.second);
+            EbmlBuffer point;
+            point.put_uint(CUE_TIME, cue.first);
+            point.put_master(CUE_TRACK_POSITIONS, position);
+            cue_points.put_master(CUE_POINT, point);
+        }
+        EbmlBuffer cues_element;
+        cues_element.put_master(CUES, cue_points);
+        auto cues_position = written;
+        write(cues_element);
+        auto end = written;
+
+        EbmlBuffer seeks;
+        pair<uint32_t, long> entries[] = {{INFO, info_position}, {TRACKS, tracks_position}, {CUES, cues_position}};
+        for (auto &entry : entries)
+        {
+            auto id = id_bytes(entry.first);
+            EbmlBuffer seek;
+            seek.put_binary(SEEK_ID, id.bytes.data(), id.bytes.size());
+            seek.put_uint(SEEK_POSITION, entry.second - segment_data);
+            seeks.put_master(SEEK, seek);
+        }
+        EbmlBuffer seek_head;
+        seek_head.put_master(SEEK_HEAD, seeks);
+        seek_head.put_void(SEEK_HEAD_RESERVED - seek_head.bytes.size());
+        patch(segment_data, seek_head);
+
+        EbmlBuffer duration;
+        duration.put_float(DURATION, end_timecode);
+        patch(duration_position, duration);
+        patch_size(segment_data - PATCHABLE_SIZE_LENGTH, end - segment_data);
+    }
+
+    void finish() override
+    {
+        complete();
+        sink->close();
+        sink = nullptr;
+    }
+
+    ~WebMWriter()
+    {
+        if (sink)
+            finish();
+    }
+
+    WebMWriter(Sink *sink, const StreamInfo &info) : ContainerWriter(sink), info(info), live(!sink->seekable()), origin_pts(0), written(0), segment_data(0), info_position(0), tracks_position(0), tracks_end(0), duration_position(0), cluster_position(-1), cluster_timecode(0), end_timecode(0)
+    {
+        write_headers();
+    }
+
+    WebMWriter(const WebMWriter &o) = delete;
+};
+
+unique_ptr<ContainerWriter> open_webm_writer(Sink *sink, const StreamInfo &info)
+{
+    return make_unique<WebMWriter>(sink, info);
+}